@@ -0,0 +1,336 @@
+#!/usr/bin/env python3
+"""
+Drives an nginx built with RADOS_MOCK=1 through a set of scenarios and
+reports requests per second, latency percentiles and worker CPU per GB sent.
+
+    RADOS_MOCK=1 ./configure --add-module=/path/to/nginx-rados-module ...
+    make
+    bench/rados_bench.py --nginx objs/nginx
+
+The objects are the mock's generated gen/<size> objects, so nothing has to be
+stored first. Every scenario runs against a freshly started nginx, extra
+directives for the rados location are passed with --directive.
+"""
+
+import argparse
+import asyncio
+import json
+import os
+import random
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+NGINX_CONF = """
+worker_processes {workers};
+daemon off;
+pid logs/nginx.pid;
+error_log logs/error.log warn;
+
+events {{
+    worker_connections 8192;
+}}
+
+http {{
+    access_log off;
+    rados_stats_zone rados_bench 1m;
+
+    server {{
+        listen 127.0.0.1:{port} reuseport backlog=4096;
+        rados_conf "{mock_conf}";
+        rados_pool bench;
+
+        location /o/ {{
+            rados;
+            rados_stats rados_bench;
+{directives}
+        }}
+
+        location = /metrics {{
+            rados_status rados_bench;
+        }}
+    }}
+}}
+"""
+
+MOCK_CONF = """
+mock_latency = {latency}
+mock_jitter = {jitter}
+mock_bandwidth = {bandwidth}
+mock_error_rate = {error_rate}
+"""
+
+
+class Scenario:
+    def __init__(self, name, description, concurrency, path, headers=None, rate=0):
+        self.name = name
+        self.description = description
+        self.concurrency = concurrency
+        self.path = path          # callable returning the next object
+        self.headers = headers    # callable returning extra request headers
+        self.rate = rate          # bytes per second a client reads, 0 for as fast as it can
+
+
+def scenarios(args):
+    small = args.small_objects
+
+    def ranged():
+        start = random.randrange(0, (1 << 30) - 65536)
+        return {"Range": "bytes=%d-%d" % (start, start + 65535)}
+
+    return [
+        Scenario("small", "4k objects out of %d distinct ones" % small, args.concurrency,
+                 lambda: "gen/4k-%d" % random.randrange(small)),
+        Scenario("large", "whole 256m objects", max(1, args.concurrency // 16),
+                 lambda: "gen/256m"),
+        Scenario("ranges", "64k ranges of a 1g object", args.concurrency,
+                 lambda: "gen/1g", ranged),
+        Scenario("slow", "16m objects read at 1m/s per client", args.concurrency,
+                 lambda: "gen/16m", rate=1 << 20),
+    ]
+
+
+class Result:
+    def __init__(self):
+        self.latencies = []
+        self.first_bytes = []
+        self.bytes = 0
+        self.errors = 0
+
+
+async def request(reader, writer, host, path, headers, rate, result):
+    start = time.monotonic()
+
+    lines = ["GET /o/%s HTTP/1.1" % path, "Host: %s" % host]
+    for name, value in (headers or {}).items():
+        lines.append("%s: %s" % (name, value))
+    writer.write(("\r\n".join(lines) + "\r\n\r\n").encode())
+
+    status = await reader.readline()
+    if not status:
+        raise ConnectionError("connection closed")
+
+    first_byte = time.monotonic()
+    length = 0
+    close = False
+
+    while True:
+        line = await reader.readline()
+        if line in (b"\r\n", b""):
+            break
+        name, _, value = line.decode("latin-1").partition(":")
+        name = name.strip().lower()
+        if name == "content-length":
+            length = int(value)
+        elif name == "connection" and value.strip().lower() == "close":
+            close = True
+
+    code = int(status.split()[1])
+    left = length
+    chunk = 65536 if not rate else max(4096, rate // 10)
+
+    while left:
+        data = await reader.read(min(left, chunk))
+        if not data:
+            raise ConnectionError("body cut short")
+        left -= len(data)
+        if rate:
+            await asyncio.sleep(len(data) / rate)
+
+    end = time.monotonic()
+
+    if code >= 400:
+        result.errors += 1
+    else:
+        result.latencies.append(end - start)
+        result.first_bytes.append(first_byte - start)
+        result.bytes += length
+
+    return close
+
+
+async def client(port, scenario, deadline, result):
+    reader = writer = None
+
+    while time.monotonic() < deadline:
+        try:
+            if writer is None:
+                reader, writer = await asyncio.open_connection("127.0.0.1", port, limit=1 << 20)
+
+            headers = scenario.headers() if scenario.headers else None
+            if await request(reader, writer, "127.0.0.1", scenario.path(), headers,
+                             scenario.rate, result):
+                writer.close()
+                writer = None
+
+        except (ConnectionError, OSError, ValueError, IndexError):
+            result.errors += 1
+            if writer is not None:
+                writer.close()
+            writer = None
+            await asyncio.sleep(0.01)
+
+    if writer is not None:
+        writer.close()
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def worker_cpu(master):
+    """CPU seconds the workers of the master have used so far"""
+    ticks = os.sysconf("SC_CLK_TCK")
+    total = 0
+
+    for pid in os.listdir("/proc"):
+        if not pid.isdigit():
+            continue
+        try:
+            with open("/proc/%s/stat" % pid) as f:
+                fields = f.read().rsplit(")", 1)[1].split()
+        except OSError:
+            continue
+        # fields[1] is the ppid, [11] and [12] utime and stime
+        if int(fields[1]) == master:
+            total += int(fields[11]) + int(fields[12])
+
+    return total / ticks
+
+
+def free_port():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+
+def start_nginx(args, prefix, port):
+    os.makedirs(os.path.join(prefix, "logs"), exist_ok=True)
+    os.makedirs(os.path.join(prefix, "conf"), exist_ok=True)
+
+    mock_conf = os.path.join(prefix, "conf", "mock.conf")
+    with open(mock_conf, "w") as f:
+        f.write(MOCK_CONF.format(latency=args.latency, jitter=args.jitter,
+                                 bandwidth=args.bandwidth, error_rate=args.error_rate))
+
+    directives = "".join("            %s;\n" % d.rstrip(";") for d in args.directive)
+
+    conf = os.path.join(prefix, "conf", "nginx.conf")
+    with open(conf, "w") as f:
+        f.write(NGINX_CONF.format(workers=args.workers, port=port, mock_conf=mock_conf,
+                                  directives=directives))
+
+    proc = subprocess.Popen([args.nginx, "-p", prefix, "-c", conf])
+
+    for _ in range(100):
+        try:
+            socket.create_connection(("127.0.0.1", port), timeout=0.1).close()
+            return proc
+        except OSError:
+            if proc.poll() is not None:
+                break
+            time.sleep(0.05)
+
+    proc.kill()
+    with open(os.path.join(prefix, "logs", "error.log")) as f:
+        sys.stderr.write(f.read())
+    raise SystemExit("nginx did not start")
+
+
+def run(args, scenario):
+    prefix = tempfile.mkdtemp(prefix="rados-bench-")
+    port = free_port()
+    proc = start_nginx(args, prefix, port)
+    result = Result()
+
+    try:
+        cpu = worker_cpu(proc.pid)
+        start = time.monotonic()
+        deadline = start + args.duration
+
+        async def main():
+            await asyncio.gather(*(client(port, scenario, deadline, result)
+                                   for _ in range(scenario.concurrency)))
+
+        asyncio.run(main())
+
+        elapsed = time.monotonic() - start
+        cpu = worker_cpu(proc.pid) - cpu
+
+    finally:
+        proc.send_signal(signal.SIGQUIT)
+        try:
+            proc.wait(timeout=10)
+        except subprocess.TimeoutExpired:
+            proc.kill()
+        shutil.rmtree(prefix, ignore_errors=True)
+
+    gb = result.bytes / (1 << 30)
+
+    return {
+        "scenario": scenario.name,
+        "description": scenario.description,
+        "concurrency": scenario.concurrency,
+        "requests": len(result.latencies),
+        "errors": result.errors,
+        "rps": len(result.latencies) / elapsed,
+        "mb_per_s": result.bytes / (1 << 20) / elapsed,
+        "p50_ms": percentile(result.latencies, 50) * 1000,
+        "p99_ms": percentile(result.latencies, 99) * 1000,
+        "first_byte_p50_ms": percentile(result.first_bytes, 50) * 1000,
+        "first_byte_p99_ms": percentile(result.first_bytes, 99) * 1000,
+        "cpu_s": cpu,
+        "cpu_s_per_gb": cpu / gb if gb else 0.0,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--nginx", required=True, help="nginx built with RADOS_MOCK=1")
+    parser.add_argument("--scenario", action="append",
+                        help="small, large, ranges or slow, all by default")
+    parser.add_argument("--duration", type=float, default=10, help="seconds per scenario")
+    parser.add_argument("--concurrency", type=int, default=64, help="clients")
+    parser.add_argument("--workers", type=int, default=2, help="nginx worker processes")
+    parser.add_argument("--small-objects", type=int, default=100000)
+    parser.add_argument("--latency", default="1", help="milliseconds per rados op")
+    parser.add_argument("--jitter", default="1", help="random extra milliseconds per op")
+    parser.add_argument("--bandwidth", default="0", help="bytes per second per handle, 0 for none")
+    parser.add_argument("--error-rate", default="0", help="share of failing rados ops")
+    parser.add_argument("--directive", action="append", default=[],
+                        help='added to the rados location, e.g. "rados_readahead 4"')
+    parser.add_argument("--json", help="also write the results to this file")
+    args = parser.parse_args()
+
+    known = {s.name: s for s in scenarios(args)}
+    names = args.scenario or list(known)
+    for name in names:
+        if name not in known:
+            parser.error("unknown scenario %s" % name)
+
+    results = []
+    print("%-8s %6s %9s %9s %9s %9s %9s %8s %10s" % (
+        "scenario", "conc", "req/s", "MB/s", "p50 ms", "p99 ms", "ttfb p99", "errors", "cpu s/GB"))
+
+    for name in names:
+        r = run(args, known[name])
+        results.append(r)
+        print("%-8s %6d %9.0f %9.1f %9.2f %9.2f %9.2f %8d %10.3f" % (
+            r["scenario"], r["concurrency"], r["rps"], r["mb_per_s"], r["p50_ms"], r["p99_ms"],
+            r["first_byte_p99_ms"], r["errors"], r["cpu_s_per_gb"]))
+        sys.stdout.flush()
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump({"args": vars(args), "results": results}, f, indent=2)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,1586 @@
+/*
+* A stand-in for librados that serves objects from memory or a local
+* directory, with configurable latency, bandwidth and failures, so the module
+* can be run and measured without a cluster. Built instead of -lrados when
+* nginx is configured with RADOS_MOCK=1, see the README.
+*
+* Settings are read from the file given to rados_conf, lines the mock does
+* not know (a real ceph.conf) are ignored:
+*
+*     mock_dir = /srv/rados-mock   objects in <dir>/<pool>/<oid>, in memory if unset
+*     mock_latency = 2             milliseconds every op takes, fractions allowed
+*     mock_jitter = 3              up to this many milliseconds more, at random
+*     mock_bandwidth = 200m        bytes per second a cluster handle moves
+*     mock_error_rate = 0.001      share of ops failing with mock_error
+*     mock_error = 5               errno of injected failures, EIO by default
+*
+* Objects named gen/<size>[k|m|g][-anything] exist in every pool without being
+* stored, filled with a fixed pattern, so benchmarks need no setup.
+*
+* Namespaces keep objects apart, locator keys are accepted and ignored, and
+* pools have no snapshots.
+*
+* Every cluster handle runs one thread completing ops in the order they are
+* due, the way librados calls back from its own threads.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include "rados/librados.h"
+
+#define RADOS_MOCK_BUCKETS     65536
+#define RADOS_MOCK_STEPS       8
+#define RADOS_MOCK_GEN_PREFIX  "gen/"
+#define RADOS_MOCK_XATTR_PREFIX "user."
+#define RADOS_MOCK_KEY_MAX     1024
+
+typedef struct rados_mock_object_s  rados_mock_object_t;
+typedef struct rados_mock_task_s    rados_mock_task_t;
+
+/* objects of the memory store, shared by all handles of the process */
+struct rados_mock_object_s {
+    rados_mock_object_t *next;
+    char *key;               /* pool, namespace and oid, NUL separated */
+    size_t key_len;
+    char *data;
+    size_t size;
+    size_t capacity;
+    time_t mtime;
+    uint64_t version;
+};
+
+typedef struct {
+    char dir[PATH_MAX];      /* empty for the memory store */
+    uint64_t latency;        /* nanoseconds */
+    uint64_t jitter;
+    uint64_t bandwidth;      /* bytes per second, 0 for no cap */
+    double error_rate;
+    int error;
+
+    time_t created;          /* mtime of generated objects */
+    unsigned seed;
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    rados_mock_task_t *head; /* ordered by due */
+    rados_mock_task_t *tail;
+    uint64_t link_free;      /* when the bandwidth cap lets the next transfer start */
+    unsigned connected:1;
+    unsigned stop:1;
+} rados_mock_cluster_t;
+
+typedef struct {
+    rados_mock_cluster_t *cluster;
+    char *pool;
+    char *nspace;            /* NULL for the default namespace */
+} rados_mock_ioctx_t;
+
+typedef struct {
+    rados_callback_t handler;
+    void *arg;
+    int rc;
+    uint64_t version;
+    unsigned complete:1;
+    unsigned released:1;
+} rados_mock_completion_t;
+
+enum {
+    RADOS_MOCK_STAT = 0,
+    RADOS_MOCK_READ,
+    RADOS_MOCK_XATTRS,
+    RADOS_MOCK_CREATE,
+    RADOS_MOCK_TRUNCATE,
+    RADOS_MOCK_WRITE
+};
+
+/* one part of a compound op, or a plain aio call */
+typedef struct {
+    int kind;
+    uint64_t offset;
+    size_t len;
+    char *buf;               /* owned by the step for writes */
+    size_t *bytes_read;
+    uint64_t *psize;
+    time_t *pmtime;
+    rados_xattrs_iter_t *iter;
+    int exclusive;
+    int *prval;
+} rados_mock_step_t;
+
+typedef struct {
+    rados_mock_step_t steps[RADOS_MOCK_STEPS];
+    int nsteps;
+    int overflow;
+} rados_mock_op_t;
+
+struct rados_mock_task_s {
+    rados_mock_task_t *prev;
+    rados_mock_task_t *next;
+    uint64_t due;
+    rados_mock_ioctx_t *io;
+    char *oid;
+    rados_mock_completion_t *completion;
+    rados_mock_op_t *op;     /* the caller's, or single below */
+    rados_mock_op_t single;
+    time_t *mtime;           /* to set after a write op */
+};
+
+typedef struct {
+    char **names;
+    char **values;
+    size_t *lens;
+    size_t n;
+    size_t next;
+} rados_mock_xattrs_t;
+
+static pthread_mutex_t rados_mock_store_mutex = PTHREAD_MUTEX_INITIALIZER;
+static rados_mock_object_t *rados_mock_store[RADOS_MOCK_BUCKETS];
+static uint64_t rados_mock_store_version;
+
+/* guards the complete and released flags of all completions */
+static pthread_mutex_t rados_mock_completion_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static char rados_mock_pattern[4096];
+
+
+static uint64_t
+rados_mock_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/*
+* Generated objects are named gen/<size>[k|m|g][-anything], returns -1 for
+* any other name
+*/
+static int64_t
+rados_mock_gen_size(const char *oid)
+{
+    char *end;
+    uint64_t size;
+
+    if (strncmp(oid, RADOS_MOCK_GEN_PREFIX, sizeof(RADOS_MOCK_GEN_PREFIX) - 1) != 0) {
+        return -1;
+    }
+
+    oid += sizeof(RADOS_MOCK_GEN_PREFIX) - 1;
+
+    if (*oid < '0' || *oid > '9') {
+        return -1;
+    }
+
+    size = strtoull(oid, &end, 10);
+
+    switch (*end) {
+    case 'k':
+        size <<= 10;
+        end++;
+        break;
+    case 'm':
+        size <<= 20;
+        end++;
+        break;
+    case 'g':
+        size <<= 30;
+        end++;
+        break;
+    }
+
+    if (*end != '\0' && *end != '-') {
+        return -1;
+    }
+
+    return (int64_t) size;
+}
+
+
+static void
+rados_mock_gen_read(char *buf, size_t len, uint64_t offset)
+{
+    size_t n, at;
+
+    while (len) {
+        at = offset % sizeof(rados_mock_pattern);
+        n = sizeof(rados_mock_pattern) - at;
+        n = n < len ? n : len;
+
+        memcpy(buf, rados_mock_pattern + at, n);
+
+        buf += n;
+        offset += n;
+        len -= n;
+    }
+}
+
+
+static char *
+rados_mock_encode(char *p, char *last, const char *s)
+{
+    const char *start = s;
+
+    for ( ; *s; s++) {
+        if (p >= last) {
+            return NULL;
+        }
+
+        if (*s == '/' || *s == '%' || (*s == '.' && s == start)) {
+            p += sprintf(p, "%%%02X", (unsigned char) *s);
+            continue;
+        }
+
+        *p++ = *s;
+    }
+
+    return p;
+}
+
+
+/*
+* Every oid is one file of the pool's directory, slashes, percent signs and a
+* leading dot are percent-encoded, a namespace goes in front with %00 after it
+*/
+static int
+rados_mock_path(rados_mock_ioctx_t *io, const char *oid, char *path)
+{
+    char *p, *last;
+    int n;
+
+    if (*oid == '\0') {
+        return -EINVAL;
+    }
+
+    n = snprintf(path, PATH_MAX, "%s/%s/", io->cluster->dir, io->pool);
+    if (n >= PATH_MAX) {
+        return -ENAMETOOLONG;
+    }
+
+    p = path + n;
+    last = path + PATH_MAX - 4;
+
+    if (io->nspace) {
+        p = rados_mock_encode(p, last - 3, io->nspace);
+        if (p == NULL) {
+            return -ENAMETOOLONG;
+        }
+
+        p += sprintf(p, "%%00");
+    }
+
+    p = rados_mock_encode(p, last, oid);
+    if (p == NULL) {
+        return -ENAMETOOLONG;
+    }
+
+    *p = '\0';
+
+    return 0;
+}
+
+
+/*
+* Returns where the object is or would be linked, NULL for names too long
+* for key
+*/
+static rados_mock_object_t **
+rados_mock_store_find(rados_mock_ioctx_t *io, const char *oid, char *key, size_t *key_len)
+{
+    rados_mock_object_t **o;
+    size_t plen, nlen, olen, i;
+    uint32_t hash;
+
+    plen = strlen(io->pool);
+    nlen = io->nspace ? strlen(io->nspace) : 0;
+    olen = strlen(oid);
+    *key_len = plen + 1 + nlen + 1 + olen;
+
+    if (*key_len > RADOS_MOCK_KEY_MAX) {
+        return NULL;
+    }
+
+    memcpy(key, io->pool, plen + 1);
+    if (nlen) {
+        memcpy(key + plen + 1, io->nspace, nlen);
+    }
+    key[plen + 1 + nlen] = '\0';
+    memcpy(key + plen + 1 + nlen + 1, oid, olen);
+
+    hash = 2166136261u;
+    for (i = 0; i < *key_len; i++) {
+        hash = (hash ^ (unsigned char) key[i]) * 16777619u;
+    }
+
+    for (o = &rados_mock_store[hash % RADOS_MOCK_BUCKETS]; *o; o = &(*o)->next) {
+        if ((*o)->key_len == *key_len && memcmp((*o)->key, key, *key_len) == 0) {
+            break;
+        }
+    }
+
+    return o;
+}
+
+
+static int
+rados_mock_stat(rados_mock_ioctx_t *io, const char *oid, uint64_t *size, time_t *mtime,
+    uint64_t *version)
+{
+    rados_mock_object_t **o;
+    struct stat st;
+    char path[PATH_MAX], key[RADOS_MOCK_KEY_MAX];
+    size_t key_len;
+    int64_t gen;
+    int rc;
+
+    gen = rados_mock_gen_size(oid);
+    if (gen >= 0) {
+        *size = gen;
+        *mtime = io->cluster->created;
+        *version = 1;
+        return 0;
+    }
+
+    if (io->cluster->dir[0]) {
+        rc = rados_mock_path(io, oid, path);
+        if (rc < 0) {
+            return rc;
+        }
+
+        if (stat(path, &st) != 0) {
+            return -errno;
+        }
+
+        *size = st.st_size;
+        *mtime = st.st_mtime;
+        *version = (uint64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        return 0;
+    }
+
+    pthread_mutex_lock(&rados_mock_store_mutex);
+
+    o = rados_mock_store_find(io, oid, key, &key_len);
+    if (o == NULL || *o == NULL) {
+        pthread_mutex_unlock(&rados_mock_store_mutex);
+        return o ? -ENOENT : -ENAMETOOLONG;
+    }
+
+    *size = (*o)->size;
+    *mtime = (*o)->mtime;
+    *version = (*o)->version;
+
+    pthread_mutex_unlock(&rados_mock_store_mutex);
+
+    return 0;
+}
+
+
+static int
+rados_mock_read(rados_mock_ioctx_t *io, const char *oid, char *buf, size_t len, uint64_t offset)
+{
+    rados_mock_object_t **o;
+    char path[PATH_MAX], key[RADOS_MOCK_KEY_MAX];
+    size_t key_len, done;
+    ssize_t n;
+    int64_t gen;
+    int fd, rc;
+
+    gen = rados_mock_gen_size(oid);
+    if (gen >= 0) {
+        if (offset >= (uint64_t) gen) {
+            return 0;
+        }
+
+        len = (uint64_t) gen - offset < len ? (size_t) ((uint64_t) gen - offset) : len;
+        rados_mock_gen_read(buf, len, offset);
+        return (int) len;
+    }
+
+    if (io->cluster->dir[0]) {
+        rc = rados_mock_path(io, oid, path);
+        if (rc < 0) {
+            return rc;
+        }
+
+        fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            return -errno;
+        }
+
+        for (done = 0; done < len; done += n) {
+            n = pread(fd, buf + done, len - done, offset + done);
+            if (n == -1) {
+                rc = -errno;
+                close(fd);
+                return rc;
+            }
+
+            if (n == 0) {
+                break;
+            }
+        }
+
+        close(fd);
+        return (int) done;
+    }
+
+    pthread_mutex_lock(&rados_mock_store_mutex);
+
+    o = rados_mock_store_find(io, oid, key, &key_len);
+    if (o == NULL || *o == NULL) {
+        pthread_mutex_unlock(&rados_mock_store_mutex);
+        return o ? -ENOENT : -ENAMETOOLONG;
+    }
+
+    done = 0;
+    if (offset < (*o)->size) {
+        done = (*o)->size - offset < len ? (size_t) ((*o)->size - offset) : len;
+        memcpy(buf, (*o)->data + offset, done);
+    }
+
+    pthread_mutex_unlock(&rados_mock_store_mutex);
+
+    return (int) done;
+}
+
+
+static int
+rados_mock_xattrs(rados_mock_ioctx_t *io, const char *oid, rados_mock_xattrs_t **xattrs)
+{
+    rados_mock_xattrs_t *x;
+    char path[PATH_MAX], list[65536], *name;
+    ssize_t len, vlen;
+    uint64_t size, version;
+    time_t mtime;
+    int rc;
+
+    rc = rados_mock_stat(io, oid, &size, &mtime, &version);
+    if (rc < 0) {
+        return rc;
+    }
+
+    x = calloc(1, sizeof(rados_mock_xattrs_t));
+    if (x == NULL) {
+        return -ENOMEM;
+    }
+
+    *xattrs = x;
+
+    /* only files of mock_dir have xattrs, as user.<name> */
+    if (io->cluster->dir[0] == '\0' || rados_mock_gen_size(oid) >= 0) {
+        return 0;
+    }
+
+    rc = rados_mock_path(io, oid, path);
+    if (rc < 0) {
+        return rc;
+    }
+
+    len = listxattr(path, list, sizeof(list));
+    if (len <= 0) {
+        return 0;
+    }
+
+    for (name = list; name < list + len; name += strlen(name) + 1) {
+        x->n++;
+    }
+
+    x->names = calloc(x->n, sizeof(char *));
+    x->values = calloc(x->n, sizeof(char *));
+    x->lens = calloc(x->n, sizeof(size_t));
+    if (x->names == NULL || x->values == NULL || x->lens == NULL) {
+        x->n = 0;
+        return -ENOMEM;
+    }
+
+    x->n = 0;
+
+    for (name = list; name < list + len; name += strlen(name) + 1) {
+        if (strncmp(name, RADOS_MOCK_XATTR_PREFIX, sizeof(RADOS_MOCK_XATTR_PREFIX) - 1) != 0) {
+            continue;
+        }
+
+        vlen = getxattr(path, name, NULL, 0);
+        if (vlen < 0) {
+            continue;
+        }
+
+        x->values[x->n] = malloc(vlen + 1);
+        x->names[x->n] = strdup(name + sizeof(RADOS_MOCK_XATTR_PREFIX) - 1);
+        if (x->values[x->n] == NULL || x->names[x->n] == NULL) {
+            free(x->values[x->n]);
+            free(x->names[x->n]);
+            return -ENOMEM;
+        }
+
+        vlen = getxattr(path, name, x->values[x->n], vlen);
+        if (vlen < 0) {
+            free(x->values[x->n]);
+            free(x->names[x->n]);
+            continue;
+        }
+
+        x->values[x->n][vlen] = '\0';
+        x->lens[x->n] = vlen;
+        x->n++;
+    }
+
+    return 0;
+}
+
+
+/*
+* Creates, truncates or writes an object, len is the new size for truncates
+*/
+static int
+rados_mock_modify(rados_mock_ioctx_t *io, const char *oid, rados_mock_step_t *step)
+{
+    rados_mock_object_t **o, *obj;
+    char path[PATH_MAX], key[RADOS_MOCK_KEY_MAX], *data;
+    size_t key_len, done, end, capacity;
+    ssize_t n;
+    int fd, flags, rc;
+
+    if (rados_mock_gen_size(oid) >= 0) {
+        return -EROFS;
+    }
+
+    if (io->cluster->dir[0]) {
+        rc = rados_mock_path(io, oid, path);
+        if (rc < 0) {
+            return rc;
+        }
+
+        flags = O_WRONLY|O_CREAT;
+        if (step->kind == RADOS_MOCK_CREATE && step->exclusive) {
+            flags |= O_EXCL;
+        }
+
+        fd = open(path, flags, 0644);
+        if (fd == -1) {
+            return -errno;
+        }
+
+        rc = 0;
+
+        if (step->kind == RADOS_MOCK_TRUNCATE) {
+            if (ftruncate(fd, step->offset) != 0) {
+                rc = -errno;
+            }
+
+        } else if (step->kind == RADOS_MOCK_WRITE) {
+            for (done = 0; done < step->len; done += n) {
+                n = pwrite(fd, step->buf + done, step->len - done, step->offset + done);
+                if (n == -1) {
+                    rc = -errno;
+                    break;
+                }
+            }
+        }
+
+        close(fd);
+        return rc;
+    }
+
+    pthread_mutex_lock(&rados_mock_store_mutex);
+
+    o = rados_mock_store_find(io, oid, key, &key_len);
+    if (o == NULL) {
+        pthread_mutex_unlock(&rados_mock_store_mutex);
+        return -ENAMETOOLONG;
+    }
+
+    obj = *o;
+
+    if (obj && step->kind == RADOS_MOCK_CREATE && step->exclusive) {
+        pthread_mutex_unlock(&rados_mock_store_mutex);
+        return -EEXIST;
+    }
+
+    if (obj == NULL) {
+        obj = calloc(1, sizeof(rados_mock_object_t));
+        if (obj == NULL || (obj->key = malloc(key_len)) == NULL) {
+            free(obj);
+            pthread_mutex_unlock(&rados_mock_store_mutex);
+            return -ENOMEM;
+        }
+
+        memcpy(obj->key, key, key_len);
+        obj->key_len = key_len;
+        *o = obj;
+    }
+
+    end = obj->size;
+
+    if (step->kind == RADOS_MOCK_TRUNCATE) {
+        end = step->offset;
+
+    } else if (step->kind == RADOS_MOCK_WRITE && step->offset + step->len > end) {
+        end = step->offset + step->len;
+    }
+
+    if (end > obj->capacity) {
+        capacity = obj->capacity ? obj->capacity : 4096;
+        while (capacity < end) {
+            capacity *= 2;
+        }
+
+        data = realloc(obj->data, capacity);
+        if (data == NULL) {
+            pthread_mutex_unlock(&rados_mock_store_mutex);
+            return -ENOMEM;
+        }
+
+        obj->data = data;
+        obj->capacity = capacity;
+    }
+
+    if (end > obj->size) {
+        memset(obj->data + obj->size, 0, end - obj->size);
+    }
+
+    if (step->kind == RADOS_MOCK_WRITE) {
+        memcpy(obj->data + step->offset, step->buf, step->len);
+    }
+
+    obj->size = end;
+    obj->mtime = time(NULL);
+    obj->version = ++rados_mock_store_version;
+
+    pthread_mutex_unlock(&rados_mock_store_mutex);
+
+    return 0;
+}
+
+
+static void
+rados_mock_set_mtime(rados_mock_ioctx_t *io, const char *oid, time_t mtime)
+{
+    rados_mock_object_t **o;
+    struct timespec ts[2];
+    char path[PATH_MAX], key[RADOS_MOCK_KEY_MAX];
+    size_t key_len;
+
+    if (io->cluster->dir[0]) {
+        if (rados_mock_path(io, oid, path) == 0) {
+            ts[0].tv_sec = mtime;
+            ts[0].tv_nsec = 0;
+            ts[1] = ts[0];
+            (void) utimensat(AT_FDCWD, path, ts, 0);
+        }
+
+        return;
+    }
+
+    pthread_mutex_lock(&rados_mock_store_mutex);
+
+    o = rados_mock_store_find(io, oid, key, &key_len);
+    if (o && *o) {
+        (*o)->mtime = mtime;
+    }
+
+    pthread_mutex_unlock(&rados_mock_store_mutex);
+}
+
+
+static void
+rados_mock_step_free(rados_mock_op_t *op)
+{
+    int i;
+
+    for (i = 0; i < op->nsteps; i++) {
+        if (op->steps[i].kind == RADOS_MOCK_WRITE) {
+            free(op->steps[i].buf);
+        }
+    }
+
+    op->nsteps = 0;
+}
+
+
+/*
+* Runs the steps of a task in order, stopping at the first failing one like
+* a compound op of librados does
+*/
+static int
+rados_mock_run(rados_mock_task_t *task, uint64_t *version)
+{
+    rados_mock_cluster_t *cluster = task->io->cluster;
+    rados_mock_step_t *step;
+    rados_mock_xattrs_t *xattrs;
+    uint64_t size;
+    time_t mtime;
+    int i, rc, modified;
+
+    *version = 0;
+
+    if (cluster->error_rate > 0
+        && (double) rand_r(&cluster->seed) / RAND_MAX < cluster->error_rate)
+    {
+        return -cluster->error;
+    }
+
+    rc = 0;
+    modified = 0;
+
+    for (i = 0; i < task->op->nsteps; i++) {
+        step = &task->op->steps[i];
+
+        switch (step->kind) {
+
+        case RADOS_MOCK_STAT:
+            rc = rados_mock_stat(task->io, task->oid, &size, &mtime, version);
+            if (rc == 0) {
+                if (step->psize) {
+                    *step->psize = size;
+                }
+
+                if (step->pmtime) {
+                    *step->pmtime = mtime;
+                }
+            }
+            break;
+
+        case RADOS_MOCK_READ:
+            rc = rados_mock_read(task->io, task->oid, step->buf, step->len, step->offset);
+            if (rc >= 0 && step->bytes_read) {
+                *step->bytes_read = rc;
+            }
+            break;
+
+        case RADOS_MOCK_XATTRS:
+            xattrs = NULL;
+            rc = rados_mock_xattrs(task->io, task->oid, &xattrs);
+            if (rc < 0) {
+                rados_getxattrs_end(xattrs);
+
+            } else if (step->iter) {
+                *step->iter = xattrs;
+
+            } else {
+                rados_getxattrs_end(xattrs);
+            }
+            break;
+
+        default:
+            rc = rados_mock_modify(task->io, task->oid, step);
+            modified = 1;
+            break;
+        }
+
+        if (step->prval) {
+            *step->prval = rc < 0 ? rc : 0;
+        }
+
+        if (rc < 0) {
+            return rc;
+        }
+    }
+
+    if (modified && task->mtime) {
+        rados_mock_set_mtime(task->io, task->oid, *task->mtime);
+    }
+
+    if (*version == 0 && rados_mock_stat(task->io, task->oid, &size, &mtime, version) != 0) {
+        *version = 0;
+    }
+
+    /* a plain read reports the bytes read, compound ops 0 */
+    return task->op == &task->single ? rc : 0;
+}
+
+
+static void
+rados_mock_complete(rados_mock_completion_t *c, int rc, uint64_t version)
+{
+    pthread_mutex_lock(&rados_mock_completion_mutex);
+
+    if (c->released) {
+        pthread_mutex_unlock(&rados_mock_completion_mutex);
+        free(c);
+        return;
+    }
+
+    c->rc = rc;
+    c->version = version;
+    c->complete = 1;
+
+    pthread_mutex_unlock(&rados_mock_completion_mutex);
+
+    /* the caller may release the completion from here on */
+    if (c->handler) {
+        c->handler(c, c->arg);
+    }
+}
+
+
+static void
+rados_mock_task_free(rados_mock_task_t *task)
+{
+    rados_mock_step_free(&task->single);
+    free(task->oid);
+    free(task);
+}
+
+
+static void *
+rados_mock_thread(void *data)
+{
+    rados_mock_cluster_t *cluster = data;
+    rados_mock_task_t *task;
+    struct timespec ts;
+    uint64_t now, version;
+    int rc;
+
+    pthread_mutex_lock(&cluster->mutex);
+
+    while (!cluster->stop) {
+        task = cluster->head;
+
+        if (task == NULL) {
+            pthread_cond_wait(&cluster->cond, &cluster->mutex);
+            continue;
+        }
+
+        now = rados_mock_now();
+
+        if (task->due > now) {
+            ts.tv_sec = task->due / 1000000000;
+            ts.tv_nsec = task->due % 1000000000;
+            pthread_cond_timedwait(&cluster->cond, &cluster->mutex, &ts);
+            continue;
+        }
+
+        cluster->head = task->next;
+        if (cluster->head) {
+            cluster->head->prev = NULL;
+
+        } else {
+            cluster->tail = NULL;
+        }
+
+        pthread_mutex_unlock(&cluster->mutex);
+
+        rc = rados_mock_run(task, &version);
+        rados_mock_complete(task->completion, rc, version);
+        rados_mock_task_free(task);
+
+        pthread_mutex_lock(&cluster->mutex);
+    }
+
+    pthread_mutex_unlock(&cluster->mutex);
+
+    return NULL;
+}
+
+
+/*
+* Queues a task to complete after the configured latency and, with a
+* bandwidth cap, after the handle had time to move its bytes. A plain aio
+* call's op is copied, a compound op stays the caller's until completion
+*/
+static int
+rados_mock_submit(rados_mock_ioctx_t *io, const char *oid, rados_completion_t completion,
+    rados_mock_op_t *op, int copy, size_t bytes, time_t *mtime)
+{
+    rados_mock_cluster_t *cluster = io->cluster;
+    rados_mock_task_t *task, *t;
+    uint64_t due;
+
+    if (!cluster->connected) {
+        return -ENOTCONN;
+    }
+
+    if (op->overflow) {
+        return -EINVAL;
+    }
+
+    task = calloc(1, sizeof(rados_mock_task_t));
+    if (task == NULL) {
+        return -ENOMEM;
+    }
+
+    task->oid = strdup(oid);
+    if (task->oid == NULL) {
+        free(task);
+        return -ENOMEM;
+    }
+
+    if (copy) {
+        task->single = *op;
+        op = &task->single;
+    }
+
+    task->io = io;
+    task->completion = completion;
+    task->op = op;
+    task->mtime = mtime;
+
+    pthread_mutex_lock(&cluster->mutex);
+
+    due = rados_mock_now() + cluster->latency;
+    if (cluster->jitter) {
+        due += (uint64_t) rand_r(&cluster->seed) % cluster->jitter;
+    }
+
+    if (cluster->bandwidth && bytes) {
+        due = due > cluster->link_free ? due : cluster->link_free;
+        due += (uint64_t) ((double) bytes * 1000000000 / cluster->bandwidth);
+        cluster->link_free = due;
+    }
+
+    task->due = due;
+
+    /* ops mostly come due in the order they are sent, search from the tail */
+    for (t = cluster->tail; t && t->due > due; t = t->prev) { /* void */ }
+
+    task->prev = t;
+    task->next = t ? t->next : cluster->head;
+
+    if (task->next) {
+        task->next->prev = task;
+
+    } else {
+        cluster->tail = task;
+    }
+
+    if (t) {
+        t->next = task;
+
+    } else {
+        cluster->head = task;
+        pthread_cond_signal(&cluster->cond);
+    }
+
+    pthread_mutex_unlock(&cluster->mutex);
+
+    return 0;
+}
+
+
+static rados_mock_step_t *
+rados_mock_step(rados_mock_op_t *op, int kind)
+{
+    rados_mock_step_t *step;
+
+    if (op->nsteps == RADOS_MOCK_STEPS) {
+        op->overflow = 1;
+        return NULL;
+    }
+
+    step = &op->steps[op->nsteps++];
+    memset(step, 0, sizeof(rados_mock_step_t));
+    step->kind = kind;
+
+    return step;
+}
+
+
+static uint64_t
+rados_mock_parse_size(const char *value)
+{
+    char *end;
+    uint64_t n;
+
+    n = strtoull(value, &end, 10);
+
+    switch (*end) {
+    case 'k': case 'K':
+        return n << 10;
+    case 'm': case 'M':
+        return n << 20;
+    case 'g': case 'G':
+        return n << 30;
+    }
+
+    return n;
+}
+
+
+int
+rados_create(rados_t *cluster, const char * const id)
+{
+    rados_mock_cluster_t *c;
+    size_t i;
+
+    (void) id;
+
+    c = calloc(1, sizeof(rados_mock_cluster_t));
+    if (c == NULL) {
+        return -ENOMEM;
+    }
+
+    c->error = EIO;
+    c->created = time(NULL);
+    c->seed = (unsigned) c->created ^ (unsigned) (uintptr_t) c;
+
+    for (i = 0; i < sizeof(rados_mock_pattern); i++) {
+        rados_mock_pattern[i] = 'a' + i % 26;
+    }
+
+    *cluster = c;
+
+    return 0;
+}
+
+
+int
+rados_conf_read_file(rados_t cluster, const char *path)
+{
+    rados_mock_cluster_t *c = cluster;
+    char line[PATH_MAX + 64], *key, *value, *p;
+    FILE *f;
+
+    if (path == NULL) {
+        return 0;
+    }
+
+    f = fopen(path, "r");
+    if (f == NULL) {
+        return -errno;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        p = line + strlen(line);
+        while (p > line && (p[-1] == '\n' || p[-1] == '\r' || p[-1] == ' ' || p[-1] == '\t')) {
+            *--p = '\0';
+        }
+
+        for (key = line; *key == ' ' || *key == '\t'; key++) { /* void */ }
+
+        value = strchr(key, '=');
+        if (*key == '#' || *key == ';' || *key == '[' || value == NULL) {
+            continue;
+        }
+
+        for (p = value; p > key && (p[-1] == ' ' || p[-1] == '\t'); p--) { /* void */ }
+        *p = '\0';
+
+        for (value++; *value == ' ' || *value == '\t'; value++) { /* void */ }
+
+        /* ceph.conf takes spaces and underscores alike */
+        for (p = key; *p; p++) {
+            if (*p == ' ') {
+                *p = '_';
+            }
+        }
+
+        if (strcmp(key, "mock_dir") == 0) {
+            snprintf(c->dir, sizeof(c->dir), "%s", value);
+
+        } else if (strcmp(key, "mock_latency") == 0) {
+            c->latency = (uint64_t) (strtod(value, NULL) * 1000000);
+
+        } else if (strcmp(key, "mock_jitter") == 0) {
+            c->jitter = (uint64_t) (strtod(value, NULL) * 1000000);
+
+        } else if (strcmp(key, "mock_bandwidth") == 0) {
+            c->bandwidth = rados_mock_parse_size(value);
+
+        } else if (strcmp(key, "mock_error_rate") == 0) {
+            c->error_rate = strtod(value, NULL);
+
+        } else if (strcmp(key, "mock_error") == 0) {
+            c->error = atoi(value);
+        }
+    }
+
+    fclose(f);
+
+    return 0;
+}
+
+
+int
+rados_connect(rados_t cluster)
+{
+    rados_mock_cluster_t *c = cluster;
+    pthread_condattr_t attr;
+    int rc;
+
+    if (c->connected) {
+        return -EISCONN;
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&c->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&c->mutex, NULL);
+
+    rc = pthread_create(&c->thread, NULL, rados_mock_thread, c);
+    if (rc != 0) {
+        pthread_cond_destroy(&c->cond);
+        pthread_mutex_destroy(&c->mutex);
+        return -rc;
+    }
+
+    c->connected = 1;
+
+    return 0;
+}
+
+
+/*
+* Ops still pending are dropped without calling back
+*/
+void
+rados_shutdown(rados_t cluster)
+{
+    rados_mock_cluster_t *c = cluster;
+    rados_mock_task_t *task;
+
+    if (c->connected) {
+        pthread_mutex_lock(&c->mutex);
+        c->stop = 1;
+        pthread_cond_signal(&c->cond);
+        pthread_mutex_unlock(&c->mutex);
+
+        pthread_join(c->thread, NULL);
+
+        while (c->head) {
+            task = c->head;
+            c->head = task->next;
+            rados_mock_task_free(task);
+        }
+
+        pthread_cond_destroy(&c->cond);
+        pthread_mutex_destroy(&c->mutex);
+    }
+
+    free(c);
+}
+
+
+int
+rados_ioctx_create(rados_t cluster, const char *pool_name, rados_ioctx_t *ioctx)
+{
+    rados_mock_cluster_t *c = cluster;
+    rados_mock_ioctx_t *io;
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (!c->connected) {
+        return -ENOTCONN;
+    }
+
+    /* a pool of mock_dir is a directory of it */
+    if (c->dir[0]) {
+        if (snprintf(path, sizeof(path), "%s/%s", c->dir, pool_name) >= (int) sizeof(path)
+            || stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+        {
+            return -ENOENT;
+        }
+    }
+
+    io = calloc(1, sizeof(rados_mock_ioctx_t));
+    if (io == NULL) {
+        return -ENOMEM;
+    }
+
+    io->cluster = c;
+    io->pool = strdup(pool_name);
+    if (io->pool == NULL) {
+        free(io);
+        return -ENOMEM;
+    }
+
+    *ioctx = io;
+
+    return 0;
+}
+
+
+void
+rados_ioctx_destroy(rados_ioctx_t io)
+{
+    rados_mock_ioctx_t *i = io;
+
+    free(i->nspace);
+    free(i->pool);
+    free(i);
+}
+
+
+void
+rados_ioctx_set_namespace(rados_ioctx_t io, const char *nspace)
+{
+    rados_mock_ioctx_t *i = io;
+
+    free(i->nspace);
+    i->nspace = (nspace && *nspace) ? strdup(nspace) : NULL;
+}
+
+
+void
+rados_ioctx_locator_set_key(rados_ioctx_t io, const char *key)
+{
+    (void) io;
+    (void) key;
+}
+
+
+int
+rados_ioctx_snap_lookup(rados_ioctx_t io, const char *name, rados_snap_t *id)
+{
+    (void) io;
+    (void) name;
+    (void) id;
+
+    return -ENOENT;
+}
+
+
+void
+rados_ioctx_snap_set_read(rados_ioctx_t io, rados_snap_t snap)
+{
+    (void) io;
+    (void) snap;
+}
+
+
+int
+rados_aio_create_completion(void *cb_arg, rados_callback_t cb_complete,
+    rados_callback_t cb_safe, rados_completion_t *pc)
+{
+    rados_mock_completion_t *c;
+
+    (void) cb_safe;
+
+    c = calloc(1, sizeof(rados_mock_completion_t));
+    if (c == NULL) {
+        return -ENOMEM;
+    }
+
+    c->handler = cb_complete;
+    c->arg = cb_arg;
+
+    *pc = c;
+
+    return 0;
+}
+
+
+int
+rados_aio_get_return_value(rados_completion_t c)
+{
+    return ((rados_mock_completion_t *) c)->rc;
+}
+
+
+uint64_t
+rados_aio_get_version(rados_completion_t c)
+{
+    return ((rados_mock_completion_t *) c)->version;
+}
+
+
+void
+rados_aio_release(rados_completion_t c)
+{
+    rados_mock_completion_t *mc = c;
+
+    pthread_mutex_lock(&rados_mock_completion_mutex);
+
+    if (!mc->complete) {
+        /* freed by the thread once the op is done */
+        mc->released = 1;
+        pthread_mutex_unlock(&rados_mock_completion_mutex);
+        return;
+    }
+
+    pthread_mutex_unlock(&rados_mock_completion_mutex);
+
+    free(mc);
+}
+
+
+int
+rados_aio_stat(rados_ioctx_t io, const char *o, rados_completion_t completion,
+    uint64_t *psize, time_t *pmtime)
+{
+    rados_mock_op_t op;
+    rados_mock_step_t *step;
+
+    op.nsteps = 0;
+    op.overflow = 0;
+
+    step = rados_mock_step(&op, RADOS_MOCK_STAT);
+    step->psize = psize;
+    step->pmtime = pmtime;
+
+    return rados_mock_submit(io, o, completion, &op, 1, 0, NULL);
+}
+
+
+int
+rados_aio_read(rados_ioctx_t io, const char *oid, rados_completion_t completion,
+    char *buf, size_t len, uint64_t off)
+{
+    rados_mock_op_t op;
+    rados_mock_step_t *step;
+
+    op.nsteps = 0;
+    op.overflow = 0;
+
+    step = rados_mock_step(&op, RADOS_MOCK_READ);
+    step->buf = buf;
+    step->len = len;
+    step->offset = off;
+
+    return rados_mock_submit(io, oid, completion, &op, 1, len, NULL);
+}
+
+
+int
+rados_aio_write(rados_ioctx_t io, const char *oid, rados_completion_t completion,
+    const char *buf, size_t len, uint64_t off)
+{
+    rados_mock_op_t op;
+    rados_mock_step_t *step;
+    int rc;
+
+    op.nsteps = 0;
+    op.overflow = 0;
+
+    /* like librados, the data is copied before the call returns */
+    step = rados_mock_step(&op, RADOS_MOCK_WRITE);
+    step->len = len;
+    step->offset = off;
+    step->buf = malloc(len ? len : 1);
+    if (step->buf == NULL) {
+        return -ENOMEM;
+    }
+
+    memcpy(step->buf, buf, len);
+
+    rc = rados_mock_submit(io, oid, completion, &op, 1, len, NULL);
+    if (rc < 0) {
+        rados_mock_step_free(&op);
+    }
+
+    return rc;
+}
+
+
+rados_read_op_t
+rados_create_read_op(void)
+{
+    return calloc(1, sizeof(rados_mock_op_t));
+}
+
+
+void
+rados_release_read_op(rados_read_op_t read_op)
+{
+    free(read_op);
+}
+
+
+void
+rados_read_op_stat(rados_read_op_t read_op, uint64_t *psize, time_t *pmtime, int *prval)
+{
+    rados_mock_step_t *step;
+
+    step = rados_mock_step(read_op, RADOS_MOCK_STAT);
+    if (step) {
+        step->psize = psize;
+        step->pmtime = pmtime;
+        step->prval = prval;
+    }
+}
+
+
+void
+rados_read_op_read(rados_read_op_t read_op, uint64_t offset, size_t len, char *buffer,
+    size_t *bytes_read, int *prval)
+{
+    rados_mock_step_t *step;
+
+    step = rados_mock_step(read_op, RADOS_MOCK_READ);
+    if (step) {
+        step->offset = offset;
+        step->len = len;
+        step->buf = buffer;
+        step->bytes_read = bytes_read;
+        step->prval = prval;
+    }
+}
+
+
+void
+rados_read_op_getxattrs(rados_read_op_t read_op, rados_xattrs_iter_t *iter, int *prval)
+{
+    rados_mock_step_t *step;
+
+    step = rados_mock_step(read_op, RADOS_MOCK_XATTRS);
+    if (step) {
+        step->iter = iter;
+        step->prval = prval;
+    }
+}
+
+
+int
+rados_aio_read_op_operate(rados_read_op_t read_op, rados_ioctx_t io,
+    rados_completion_t completion, const char *oid, int flags)
+{
+    rados_mock_op_t *op = read_op;
+    size_t bytes;
+    int i;
+
+    (void) flags;
+
+    bytes = 0;
+    for (i = 0; i < op->nsteps; i++) {
+        if (op->steps[i].kind == RADOS_MOCK_READ) {
+            bytes += op->steps[i].len;
+        }
+    }
+
+    return rados_mock_submit(io, oid, completion, op, 0, bytes, NULL);
+}
+
+
+int
+rados_getxattrs_next(rados_xattrs_iter_t iter, const char **name, const char **val,
+    size_t *len)
+{
+    rados_mock_xattrs_t *x = iter;
+
+    if (x->next == x->n) {
+        *name = NULL;
+        *val = NULL;
+        *len = 0;
+        return 0;
+    }
+
+    *name = x->names[x->next];
+    *val = x->values[x->next];
+    *len = x->lens[x->next];
+    x->next++;
+
+    return 0;
+}
+
+
+void
+rados_getxattrs_end(rados_xattrs_iter_t iter)
+{
+    rados_mock_xattrs_t *x = iter;
+    size_t i;
+
+    if (x == NULL) {
+        return;
+    }
+
+    for (i = 0; i < x->n; i++) {
+        free(x->names[i]);
+        free(x->values[i]);
+    }
+
+    free(x->names);
+    free(x->values);
+    free(x->lens);
+    free(x);
+}
+
+
+rados_write_op_t
+rados_create_write_op(void)
+{
+    return calloc(1, sizeof(rados_mock_op_t));
+}
+
+
+void
+rados_release_write_op(rados_write_op_t write_op)
+{
+    rados_mock_step_free(write_op);
+    free(write_op);
+}
+
+
+void
+rados_write_op_create(rados_write_op_t write_op, int exclusive, const char *category)
+{
+    rados_mock_step_t *step;
+
+    (void) category;
+
+    step = rados_mock_step(write_op, RADOS_MOCK_CREATE);
+    if (step) {
+        step->exclusive = (exclusive == LIBRADOS_CREATE_EXCLUSIVE);
+    }
+}
+
+
+void
+rados_write_op_truncate(rados_write_op_t write_op, uint64_t offset)
+{
+    rados_mock_step_t *step;
+
+    step = rados_mock_step(write_op, RADOS_MOCK_TRUNCATE);
+    if (step) {
+        step->offset = offset;
+    }
+}
+
+
+void
+rados_write_op_write(rados_write_op_t write_op, const char *buffer, size_t len,
+    uint64_t offset)
+{
+    rados_mock_op_t *op = write_op;
+    rados_mock_step_t *step;
+
+    step = rados_mock_step(op, RADOS_MOCK_WRITE);
+    if (step == NULL) {
+        return;
+    }
+
+    step->offset = offset;
+    step->len = len;
+    step->buf = malloc(len ? len : 1);
+
+    if (step->buf == NULL) {
+        op->nsteps--;
+        op->overflow = 1;
+        return;
+    }
+
+    memcpy(step->buf, buffer, len);
+}
+
+
+int
+rados_aio_write_op_operate(rados_write_op_t write_op, rados_ioctx_t io,
+    rados_completion_t completion, const char *oid, time_t *mtime, int flags)
+{
+    rados_mock_op_t *op = write_op;
+    size_t bytes;
+    int i;
+
+    (void) flags;
+
+    bytes = 0;
+    for (i = 0; i < op->nsteps; i++) {
+        if (op->steps[i].kind == RADOS_MOCK_WRITE) {
+            bytes += op->steps[i].len;
+        }
+    }
+
+    return rados_mock_submit(io, oid, completion, op, 0, bytes, mtime);
+}
@@ -0,0 +1,91 @@
+#ifndef H_RADOS_MOCK_LIBRADOS
+#define H_RADOS_MOCK_LIBRADOS
+
+/**
+* The part of the librados C API the module uses, served by mock/librados.c
+* instead of a cluster. Signatures and constants match librados, so the
+* module builds unchanged against either.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void *rados_t;
+typedef void *rados_ioctx_t;
+typedef void *rados_completion_t;
+typedef void *rados_read_op_t;
+typedef void *rados_write_op_t;
+typedef void *rados_xattrs_iter_t;
+typedef uint64_t rados_snap_t;
+
+typedef void (*rados_callback_t)(rados_completion_t cb, void *arg);
+
+#define LIBRADOS_CREATE_EXCLUSIVE  1
+#define LIBRADOS_CREATE_IDEMPOTENT 0
+
+#define LIBRADOS_OPERATION_NOFLAG             0
+#define LIBRADOS_OPERATION_BALANCE_READS      1
+#define LIBRADOS_OPERATION_LOCALIZE_READS     2
+#define LIBRADOS_OPERATION_ORDER_READS_WRITES 4
+#define LIBRADOS_OPERATION_IGNORE_CACHE       8
+#define LIBRADOS_OPERATION_SKIPRWLOCKS        16
+#define LIBRADOS_OPERATION_IGNORE_OVERLAY     32
+
+int rados_create(rados_t *cluster, const char * const id);
+int rados_conf_read_file(rados_t cluster, const char *path);
+int rados_connect(rados_t cluster);
+void rados_shutdown(rados_t cluster);
+
+int rados_ioctx_create(rados_t cluster, const char *pool_name, rados_ioctx_t *ioctx);
+void rados_ioctx_destroy(rados_ioctx_t io);
+void rados_ioctx_set_namespace(rados_ioctx_t io, const char *nspace);
+void rados_ioctx_locator_set_key(rados_ioctx_t io, const char *key);
+int rados_ioctx_snap_lookup(rados_ioctx_t io, const char *name, rados_snap_t *id);
+void rados_ioctx_snap_set_read(rados_ioctx_t io, rados_snap_t snap);
+
+int rados_aio_create_completion(void *cb_arg, rados_callback_t cb_complete,
+    rados_callback_t cb_safe, rados_completion_t *pc);
+int rados_aio_get_return_value(rados_completion_t c);
+uint64_t rados_aio_get_version(rados_completion_t c);
+void rados_aio_release(rados_completion_t c);
+
+int rados_aio_stat(rados_ioctx_t io, const char *o, rados_completion_t completion,
+    uint64_t *psize, time_t *pmtime);
+int rados_aio_read(rados_ioctx_t io, const char *oid, rados_completion_t completion,
+    char *buf, size_t len, uint64_t off);
+int rados_aio_write(rados_ioctx_t io, const char *oid, rados_completion_t completion,
+    const char *buf, size_t len, uint64_t off);
+
+rados_read_op_t rados_create_read_op(void);
+void rados_release_read_op(rados_read_op_t read_op);
+void rados_read_op_stat(rados_read_op_t read_op, uint64_t *psize, time_t *pmtime, int *prval);
+void rados_read_op_read(rados_read_op_t read_op, uint64_t offset, size_t len, char *buffer,
+    size_t *bytes_read, int *prval);
+void rados_read_op_getxattrs(rados_read_op_t read_op, rados_xattrs_iter_t *iter, int *prval);
+int rados_aio_read_op_operate(rados_read_op_t read_op, rados_ioctx_t io,
+    rados_completion_t completion, const char *oid, int flags);
+
+int rados_getxattrs_next(rados_xattrs_iter_t iter, const char **name, const char **val,
+    size_t *len);
+void rados_getxattrs_end(rados_xattrs_iter_t iter);
+
+rados_write_op_t rados_create_write_op(void);
+void rados_release_write_op(rados_write_op_t write_op);
+void rados_write_op_create(rados_write_op_t write_op, int exclusive, const char *category);
+void rados_write_op_truncate(rados_write_op_t write_op, uint64_t offset);
+void rados_write_op_write(rados_write_op_t write_op, const char *buffer, size_t len,
+    uint64_t offset);
+int rados_aio_write_op_operate(rados_write_op_t write_op, rados_ioctx_t io,
+    rados_completion_t completion, const char *oid, time_t *mtime, int flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,388 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include "ngx_http_rados_aio.h"
+
+#if (NGX_HAVE_EVENTFD && NGX_HAVE_SYS_EVENTFD_H)
+#include <sys/eventfd.h>
+#define NGX_HTTP_RADOS_EVENTFD  1
+#else
+#define NGX_HTTP_RADOS_EVENTFD  0
+#endif
+
+/* cached I/O buffers come in power of two sizes from 64k to 4m */
+#define NGX_HTTP_RADOS_BUF_MIN_SHIFT  16
+#define NGX_HTTP_RADOS_BUF_CLASSES    7
+
+/* bytes a worker keeps on its free lists at most */
+#define NGX_HTTP_RADOS_BUF_CACHE      (32 * 1024 * 1024)
+
+static void ngx_http_rados_aio_complete(rados_completion_t cb, void *arg);
+static void ngx_http_rados_aio_notify(void);
+static void ngx_http_rados_aio_event_handler(ngx_event_t *ev);
+
+/*
+ * Completed ops are pushed here by librados threads (lock-free LIFO) and
+ * taken all at once by the worker, which restores submission order.
+ */
+static ngx_atomic_t           ngx_http_rados_completed;
+
+static ngx_http_rados_op_t   *ngx_http_rados_free_ops;
+static ngx_connection_t      *ngx_http_rados_notify_conn;
+static ngx_fd_t               ngx_http_rados_notify_fd = -1;
+
+/* free buffers are linked through their first bytes */
+static u_char                *ngx_http_rados_free_bufs[NGX_HTTP_RADOS_BUF_CLASSES];
+static size_t                 ngx_http_rados_cached;
+
+
+ngx_int_t
+ngx_http_rados_aio_init(ngx_cycle_t *cycle)
+{
+    ngx_fd_t           fd;
+    ngx_connection_t  *c;
+
+#if (NGX_HTTP_RADOS_EVENTFD)
+
+    fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (fd == -1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "rados: eventfd() failed");
+        return NGX_ERROR;
+    }
+
+    ngx_http_rados_notify_fd = fd;
+
+#else
+
+    ngx_fd_t  fds[2];
+
+    if (pipe(fds) == -1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "rados: pipe() failed");
+        return NGX_ERROR;
+    }
+
+    if (ngx_nonblocking(fds[0]) == -1 || ngx_nonblocking(fds[1]) == -1) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+                      "rados: " ngx_nonblocking_n " failed");
+        close(fds[0]);
+        close(fds[1]);
+        return NGX_ERROR;
+    }
+
+    fd = fds[0];
+    ngx_http_rados_notify_fd = fds[1];
+
+#endif
+
+    c = ngx_get_connection(fd, cycle->log);
+    if (c == NULL) {
+        close(fd);
+#if !(NGX_HTTP_RADOS_EVENTFD)
+        close(ngx_http_rados_notify_fd);
+#endif
+        ngx_http_rados_notify_fd = -1;
+        return NGX_ERROR;
+    }
+
+    c->read->handler = ngx_http_rados_aio_event_handler;
+    c->read->log = cycle->log;
+    c->write->log = cycle->log;
+    c->log = cycle->log;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_close_connection(c);
+#if !(NGX_HTTP_RADOS_EVENTFD)
+        close(ngx_http_rados_notify_fd);
+#endif
+        ngx_http_rados_notify_fd = -1;
+        return NGX_ERROR;
+    }
+
+    ngx_http_rados_notify_conn = c;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_rados_aio_done(ngx_cycle_t *cycle)
+{
+    u_char               *buf;
+    ngx_uint_t            n;
+    ngx_http_rados_op_t  *op;
+
+    if (ngx_http_rados_notify_conn == NULL) {
+        return;
+    }
+
+    ngx_close_connection(ngx_http_rados_notify_conn);
+    ngx_http_rados_notify_conn = NULL;
+
+#if !(NGX_HTTP_RADOS_EVENTFD)
+    close(ngx_http_rados_notify_fd);
+#endif
+    ngx_http_rados_notify_fd = -1;
+
+    while (ngx_http_rados_free_ops) {
+        op = ngx_http_rados_free_ops;
+        ngx_http_rados_free_ops = op->next;
+        ngx_free(op);
+    }
+
+    for (n = 0; n < NGX_HTTP_RADOS_BUF_CLASSES; n++) {
+        while (ngx_http_rados_free_bufs[n]) {
+            buf = ngx_http_rados_free_bufs[n];
+            ngx_http_rados_free_bufs[n] = *(u_char **) buf;
+            ngx_free(buf);
+        }
+    }
+
+    ngx_http_rados_cached = 0;
+}
+
+
+ngx_http_rados_op_t *
+ngx_http_rados_op_create(ngx_log_t *log, ngx_http_rados_op_handler_pt handler,
+    void *data)
+{
+    ngx_http_rados_op_t  *op;
+
+    op = ngx_http_rados_free_ops;
+
+    if (op) {
+        ngx_http_rados_free_ops = op->next;
+
+    } else {
+        op = ngx_alloc(sizeof(ngx_http_rados_op_t), log);
+        if (op == NULL) {
+            return NULL;
+        }
+    }
+
+    ngx_memzero(op, sizeof(ngx_http_rados_op_t));
+
+    if (rados_aio_create_completion(op, ngx_http_rados_aio_complete, NULL,
+                                    &op->completion)
+        < 0)
+    {
+        ngx_log_error(NGX_LOG_ERR, log, 0,
+                      "rados: could not create aio completion");
+        op->next = ngx_http_rados_free_ops;
+        ngx_http_rados_free_ops = op;
+        return NULL;
+    }
+
+    op->handler = handler;
+    op->data = data;
+
+    return op;
+}
+
+
+void
+ngx_http_rados_op_free(ngx_http_rados_op_t *op)
+{
+    if (op->completion) {
+        rados_aio_release(op->completion);
+        op->completion = NULL;
+    }
+
+    if (op->xattrs) {
+        rados_getxattrs_end(op->xattrs);
+        op->xattrs = NULL;
+    }
+
+    if (op->read_op) {
+        rados_release_read_op(op->read_op);
+        op->read_op = NULL;
+    }
+
+    if (op->write_op) {
+        rados_release_write_op(op->write_op);
+        op->write_op = NULL;
+    }
+
+    if (op->pending) {
+        (*op->pending)--;
+        op->pending = NULL;
+    }
+
+    if (op->io_pending) {
+        (*op->io_pending)--;
+        op->io_pending = NULL;
+    }
+
+    if (op->data == NULL) {
+        ngx_http_rados_buf_free(op->buf, op->buf_size);
+    }
+
+    op->buf = NULL;
+    op->next = ngx_http_rados_free_ops;
+    ngx_http_rados_free_ops = op;
+}
+
+
+static ngx_int_t
+ngx_http_rados_buf_class(size_t size)
+{
+    ngx_uint_t  n;
+
+    for (n = 0; n < NGX_HTTP_RADOS_BUF_CLASSES; n++) {
+        if (size <= (size_t) 1 << (NGX_HTTP_RADOS_BUF_MIN_SHIFT + n)) {
+            return n;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+
+u_char *
+ngx_http_rados_buf_alloc(size_t size, ngx_log_t *log)
+{
+    u_char     *buf;
+    ngx_int_t   n;
+
+    n = ngx_http_rados_buf_class(size);
+
+    if (n == NGX_DECLINED) {
+        return ngx_memalign(ngx_pagesize, size, log);
+    }
+
+    buf = ngx_http_rados_free_bufs[n];
+
+    if (buf) {
+        ngx_http_rados_free_bufs[n] = *(u_char **) buf;
+        ngx_http_rados_cached -= (size_t) 1 << (NGX_HTTP_RADOS_BUF_MIN_SHIFT + n);
+        return buf;
+    }
+
+    return ngx_memalign(ngx_pagesize,
+                        (size_t) 1 << (NGX_HTTP_RADOS_BUF_MIN_SHIFT + n), log);
+}
+
+
+void
+ngx_http_rados_buf_free(u_char *buf, size_t size)
+{
+    size_t      class_size;
+    ngx_int_t   n;
+
+    if (buf == NULL) {
+        return;
+    }
+
+    n = ngx_http_rados_buf_class(size);
+
+    if (n == NGX_DECLINED) {
+        ngx_free(buf);
+        return;
+    }
+
+    class_size = (size_t) 1 << (NGX_HTTP_RADOS_BUF_MIN_SHIFT + n);
+
+    if (ngx_http_rados_cached + class_size > NGX_HTTP_RADOS_BUF_CACHE) {
+        ngx_free(buf);
+        return;
+    }
+
+    *(u_char **) buf = ngx_http_rados_free_bufs[n];
+    ngx_http_rados_free_bufs[n] = buf;
+    ngx_http_rados_cached += class_size;
+}
+
+
+/* runs on a librados finisher thread: no nginx API beyond atomics here */
+
+static void
+ngx_http_rados_aio_complete(rados_completion_t cb, void *arg)
+{
+    ngx_http_rados_op_t  *op = arg;
+    ngx_atomic_uint_t     head;
+
+    op->rc = rados_aio_get_return_value(cb);
+
+    do {
+        head = ngx_http_rados_completed;
+        op->next = (ngx_http_rados_op_t *) head;
+    } while (!ngx_atomic_cmp_set(&ngx_http_rados_completed, head,
+                                 (ngx_atomic_uint_t) op));
+
+    if (head == 0) {
+        ngx_http_rados_aio_notify();
+    }
+}
+
+
+static void
+ngx_http_rados_aio_notify(void)
+{
+#if (NGX_HTTP_RADOS_EVENTFD)
+    uint64_t  one = 1;
+
+    (void) write(ngx_http_rados_notify_fd, &one, sizeof(uint64_t));
+#else
+    u_char    one = 1;
+
+    (void) write(ngx_http_rados_notify_fd, &one, 1);
+#endif
+}
+
+
+static void
+ngx_http_rados_aio_event_handler(ngx_event_t *ev)
+{
+    ngx_connection_t     *c;
+    ngx_atomic_uint_t     head;
+    ngx_http_rados_op_t  *op, *next, *list;
+
+    c = ev->data;
+
+    /* drain before taking the queue, a later push will signal again */
+
+#if (NGX_HTTP_RADOS_EVENTFD)
+    {
+    uint64_t  count;
+
+    (void) read(c->fd, &count, sizeof(uint64_t));
+    }
+#else
+    {
+    u_char  buf[64];
+
+    while (read(c->fd, buf, sizeof(buf)) == sizeof(buf)) { /* void */ }
+    }
+#endif
+
+    do {
+        head = ngx_http_rados_completed;
+    } while (!ngx_atomic_cmp_set(&ngx_http_rados_completed, head, 0));
+
+    list = NULL;
+
+    for (op = (ngx_http_rados_op_t *) head; op; op = next) {
+        next = op->next;
+        op->next = list;
+        list = op;
+    }
+
+    for (op = list; op; op = next) {
+        next = op->next;
+
+        if (op->data == NULL) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                           "rados: dropping orphaned completion");
+            ngx_http_rados_op_free(op);
+            continue;
+        }
+
+        op->handler(op);
+    }
+
+    if (ngx_handle_read_event(ev, 0) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, 0,
+                      "rados: could not re-arm completion notifier");
+    }
+}
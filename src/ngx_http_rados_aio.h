@@ -0,0 +1,81 @@
+#ifndef H_NGX_HTTP_RADOS_AIO
+#define H_NGX_HTTP_RADOS_AIO
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <rados/librados.h>
+
+typedef struct ngx_http_rados_op_s  ngx_http_rados_op_t;
+
+typedef void (*ngx_http_rados_op_handler_pt)(ngx_http_rados_op_t *op);
+
+/**
+* One outstanding librados operation. Completions are queued by the librados
+* finisher thread and the handler is always run on the worker thread.
+*/
+struct ngx_http_rados_op_s {
+    ngx_http_rados_op_t          *next;     /* completion queue link */
+    ngx_queue_t                   queue;    /* owner's list of pending ops */
+
+    rados_completion_t            completion;
+    ngx_http_rados_op_handler_pt  handler;
+    void                         *data;     /* owner, NULL once orphaned */
+    int                           rc;
+
+    /* stat results live here so an orphaned op never touches freed memory */
+    uint64_t                      size;
+    time_t                        mtime;
+
+    /* read target, released together with the op once orphaned */
+    u_char                       *buf;
+    size_t                        buf_size;
+
+    /* compound stat + read, the read op lives until the completion is freed */
+    rados_read_op_t               read_op;
+    size_t                        nread;
+    int                           read_rc;
+    /* xattrs read along with the stat, released with the op */
+    rados_xattrs_iter_t           xattrs;
+    int                           xattrs_rc;
+    /* closing write op of an upload */
+    rados_write_op_t              write_op;
+
+    /* in-flight counter of the cluster handle, decremented on free */
+    ngx_uint_t                   *pending;
+    /* same for the ioctx bound to a namespace, locator or snapshot, if any */
+    ngx_uint_t                   *io_pending;
+};
+
+/**
+* Creates the per-worker completion notifier and hooks it into the event loop
+*/
+ngx_int_t ngx_http_rados_aio_init(ngx_cycle_t *cycle);
+
+/**
+* Closes the notifier on worker exit
+*/
+void ngx_http_rados_aio_done(ngx_cycle_t *cycle);
+
+/**
+* Allocates an op with a fresh completion bound to the worker queue
+*/
+ngx_http_rados_op_t *ngx_http_rados_op_create(ngx_log_t *log,
+    ngx_http_rados_op_handler_pt handler, void *data);
+
+/**
+* Releases the completion (and read or write op) and returns the op to the worker free list
+*/
+void ngx_http_rados_op_free(ngx_http_rados_op_t *op);
+
+/**
+* Takes a page aligned I/O buffer of at least size bytes from the worker's
+* free lists
+*/
+u_char *ngx_http_rados_buf_alloc(size_t size, ngx_log_t *log);
+
+/**
+* Returns a buffer, size as passed to ngx_http_rados_buf_alloc
+*/
+void ngx_http_rados_buf_free(u_char *buf, size_t size);
+
+#endif
@@ -0,0 +1,556 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_rados_cache.h"
+
+/* entries freed at once when the zone runs out of memory */
+#define NGX_HTTP_RADOS_CACHE_EVICT  8
+
+typedef struct {
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t queue; /* most recently used first */
+    ngx_queue_t pins[NGX_MAX_PROCESSES]; /* held by every process, see content_cache_reset */
+} ngx_http_rados_cache_sh_t;
+
+typedef struct {
+    ngx_http_rados_cache_sh_t *sh;
+    ngx_slab_pool_t *shpool;
+} ngx_http_rados_cache_t;
+
+/* lives in the rbtree node starting at its color field, like limit_req */
+typedef struct {
+    u_char color;
+    u_char deleted; /* unlinked while pinned, freed with the last pin */
+    u_short len;
+    ngx_queue_t queue;
+    time_t expire;
+    ngx_uint_t pins; /* responses sending the body straight from the zone */
+    ngx_http_rados_stat_t stat;
+    size_t body_len; /* object bytes, or xattrs of a stat, stored right after the key */
+    u_char data[1];
+} ngx_http_rados_cache_node_t;
+
+/* a response holding an entry, recorded with the process that holds it */
+typedef struct {
+    ngx_queue_t queue;
+    ngx_http_rados_cache_node_t *node;
+} ngx_http_rados_cache_pin_t;
+
+#define ngx_http_rados_cache_rbnode(cn)                                      \
+    ((ngx_rbtree_node_t *) ((u_char *) (cn) - offsetof(ngx_rbtree_node_t, color)))
+
+
+static void
+ngx_http_rados_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t **p;
+    ngx_http_rados_cache_node_t *cn, *cnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else {
+            cn = (ngx_http_rados_cache_node_t *) &node->color;
+            cnt = (ngx_http_rados_cache_node_t *) &temp->color;
+
+            p = (ngx_memn2cmp(cn->data, cnt->data, cn->len, cnt->len) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_int_t
+ngx_http_rados_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_rados_cache_t *ocache = data;
+    ngx_http_rados_cache_t *cache;
+    ngx_uint_t i;
+    size_t len;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_rados_cache_sh_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_http_rados_cache_rbtree_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    for (i = 0; i < NGX_MAX_PROCESSES; i++) {
+        ngx_queue_init(&cache->sh->pins[i]);
+    }
+
+    len = sizeof(" in rados cache zone \"\"") + shm_zone->shm.name.len;
+
+    cache->shpool->log_ctx = ngx_slab_alloc(cache->shpool, len);
+    if (cache->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(cache->shpool->log_ctx, " in rados cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+/*
+* Zones are tagged with their kind rather than the module, so nginx refuses a
+* name declared for two kinds of zone instead of handing one kind's data to
+* the other. Stat and content entries look alike but hold different things.
+*/
+static ngx_uint_t ngx_http_rados_stat_cache_tag;
+static ngx_uint_t ngx_http_rados_content_cache_tag;
+
+
+ngx_shm_zone_t *
+ngx_http_rados_cache_add(ngx_conf_t *cf, ngx_str_t *name, size_t size, ngx_uint_t content)
+{
+    ngx_shm_zone_t *shm_zone;
+    ngx_http_rados_cache_t *cache;
+
+    shm_zone = ngx_shared_memory_add(cf, name, size,
+                                     content ? &ngx_http_rados_content_cache_tag
+                                             : &ngx_http_rados_stat_cache_tag);
+    if (shm_zone == NULL) {
+        return NULL;
+    }
+
+    if (shm_zone->data == NULL) {
+        cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_rados_cache_t));
+        if (cache == NULL) {
+            return NULL;
+        }
+
+        shm_zone->init = ngx_http_rados_cache_init_zone;
+        shm_zone->data = cache;
+    }
+
+    return shm_zone;
+}
+
+
+static ngx_http_rados_cache_node_t *
+ngx_http_rados_cache_lookup_locked(ngx_http_rados_cache_t *cache,
+    ngx_str_t *key, uint32_t hash)
+{
+    ngx_int_t rc;
+    ngx_rbtree_node_t *node, *sentinel;
+    ngx_http_rados_cache_node_t *cn;
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        cn = (ngx_http_rados_cache_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(key->data, cn->data, key->len, (size_t) cn->len);
+
+        if (rc == 0) {
+            return cn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_rados_cache_delete_locked(ngx_http_rados_cache_t *cache,
+    ngx_http_rados_cache_node_t *cn)
+{
+    ngx_rbtree_node_t *node;
+
+    node = ngx_http_rados_cache_rbnode(cn);
+
+    ngx_queue_remove(&cn->queue);
+    ngx_rbtree_delete(&cache->sh->rbtree, node);
+
+    if (cn->pins) {
+        cn->deleted = 1;
+        return;
+    }
+
+    ngx_slab_free_locked(cache->shpool, node);
+}
+
+
+static void
+ngx_http_rados_cache_evict_locked(ngx_http_rados_cache_t *cache, ngx_uint_t n)
+{
+    ngx_queue_t *q;
+    ngx_http_rados_cache_node_t *cn;
+
+    while (n-- && !ngx_queue_empty(&cache->sh->queue)) {
+        q = ngx_queue_last(&cache->sh->queue);
+        cn = ngx_queue_data(q, ngx_http_rados_cache_node_t, queue);
+
+        ngx_http_rados_cache_delete_locked(cache, cn);
+    }
+}
+
+
+static ngx_http_rados_cache_node_t *
+ngx_http_rados_cache_insert_locked(ngx_http_rados_cache_t *cache,
+    ngx_str_t *key, uint32_t hash, size_t body_len)
+{
+    size_t size;
+    ngx_uint_t tries;
+    ngx_rbtree_node_t *node;
+    ngx_http_rados_cache_node_t *cn;
+
+    size = offsetof(ngx_rbtree_node_t, color)
+           + offsetof(ngx_http_rados_cache_node_t, data)
+           + key->len + body_len;
+
+    /* large bodies may need a good part of the zone freed */
+    for (tries = 0; ; tries++) {
+        node = ngx_slab_alloc_locked(cache->shpool, size);
+        if (node != NULL) {
+            break;
+        }
+
+        if (tries == 4 + body_len / ngx_pagesize || ngx_queue_empty(&cache->sh->queue)) {
+            return NULL;
+        }
+
+        ngx_http_rados_cache_evict_locked(cache, NGX_HTTP_RADOS_CACHE_EVICT);
+    }
+
+    node->key = hash;
+
+    cn = (ngx_http_rados_cache_node_t *) &node->color;
+    cn->len = (u_short) key->len;
+    cn->deleted = 0;
+    cn->pins = 0;
+    cn->body_len = body_len;
+    ngx_memcpy(cn->data, key->data, key->len);
+
+    ngx_rbtree_insert(&cache->sh->rbtree, node);
+    ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+    return cn;
+}
+
+
+ngx_int_t
+ngx_http_rados_stat_cache_get(ngx_shm_zone_t *zone, ngx_str_t *key,
+    ngx_http_rados_stat_t *st, ngx_pool_t *pool, ngx_str_t *xattrs)
+{
+    uint32_t hash;
+    ngx_int_t rc;
+    ngx_http_rados_cache_t *cache = zone->data;
+    ngx_http_rados_cache_node_t *cn;
+
+    hash = ngx_crc32_short(key->data, key->len);
+    rc = NGX_DECLINED;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_http_rados_cache_lookup_locked(cache, key, hash);
+
+    if (cn != NULL) {
+        if (cn->expire < ngx_time()) {
+            ngx_http_rados_cache_delete_locked(cache, cn);
+
+        } else {
+            *st = cn->stat;
+
+            xattrs->len = cn->body_len;
+            xattrs->data = NULL;
+
+            if (cn->body_len) {
+                xattrs->data = ngx_pnalloc(pool, cn->body_len);
+                if (xattrs->data == NULL) {
+                    ngx_shmtx_unlock(&cache->shpool->mutex);
+                    return NGX_ERROR;
+                }
+
+                ngx_memcpy(xattrs->data, cn->data + cn->len, cn->body_len);
+            }
+
+            ngx_queue_remove(&cn->queue);
+            ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+            rc = NGX_OK;
+        }
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return rc;
+}
+
+
+void
+ngx_http_rados_stat_cache_put(ngx_shm_zone_t *zone, ngx_str_t *key,
+    ngx_http_rados_stat_t *st, ngx_str_t *xattrs, time_t valid)
+{
+    uint32_t hash;
+    ngx_http_rados_cache_t *cache = zone->data;
+    ngx_http_rados_cache_node_t *cn;
+
+    if (key->len > 65535) {
+        return;
+    }
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_http_rados_cache_lookup_locked(cache, key, hash);
+
+    /* the xattrs are stored in place, an entry of another size is replaced */
+    if (cn != NULL && cn->body_len != xattrs->len) {
+        ngx_http_rados_cache_delete_locked(cache, cn);
+        cn = NULL;
+    }
+
+    if (cn != NULL) {
+        ngx_queue_remove(&cn->queue);
+        ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+    } else {
+        cn = ngx_http_rados_cache_insert_locked(cache, key, hash, xattrs->len);
+    }
+
+    if (cn != NULL) {
+        cn->stat = *st;
+        cn->expire = ngx_time() + valid;
+        ngx_memcpy(cn->data + cn->len, xattrs->data, xattrs->len);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+ngx_int_t
+ngx_http_rados_content_cache_pin(ngx_shm_zone_t *zone, ngx_str_t *key,
+    ngx_http_rados_stat_t *st, off_t offset, size_t len, u_char **body,
+    void **pin)
+{
+    uint32_t hash;
+    ngx_int_t rc;
+    ngx_http_rados_cache_t *cache = zone->data;
+    ngx_http_rados_cache_node_t *cn;
+    ngx_http_rados_cache_pin_t *p;
+
+    hash = ngx_crc32_short(key->data, key->len);
+    rc = NGX_DECLINED;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_http_rados_cache_lookup_locked(cache, key, hash);
+
+    if (cn == NULL) {
+        goto done;
+    }
+
+    /* the object changed since it was cached */
+    if (cn->stat.mtime != st->mtime || cn->stat.size != st->size
+        || cn->stat.version != st->version)
+    {
+        ngx_http_rados_cache_delete_locked(cache, cn);
+        goto done;
+    }
+
+    if ((size_t) offset + len > cn->body_len) {
+        goto done;
+    }
+
+    /* a full zone only costs the hit, the object is read instead */
+    p = ngx_slab_alloc_locked(cache->shpool, sizeof(ngx_http_rados_cache_pin_t));
+    if (p == NULL) {
+        goto done;
+    }
+
+    p->node = cn;
+    ngx_queue_insert_head(&cache->sh->pins[ngx_process_slot], &p->queue);
+
+    cn->pins++;
+    *body = cn->data + cn->len + offset;
+    *pin = p;
+
+    ngx_queue_remove(&cn->queue);
+    ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+    rc = NGX_OK;
+
+done:
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return rc;
+}
+
+
+ngx_int_t
+ngx_http_rados_content_cache_find(ngx_shm_zone_t *zone, ngx_str_t *key)
+{
+    uint32_t hash;
+    ngx_int_t rc;
+    ngx_http_rados_cache_t *cache = zone->data;
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    rc = ngx_http_rados_cache_lookup_locked(cache, key, hash) ? NGX_OK : NGX_DECLINED;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    return rc;
+}
+
+
+static void
+ngx_http_rados_cache_unpin_locked(ngx_http_rados_cache_t *cache,
+    ngx_http_rados_cache_pin_t *p)
+{
+    ngx_http_rados_cache_node_t *cn = p->node;
+
+    ngx_queue_remove(&p->queue);
+    ngx_slab_free_locked(cache->shpool, p);
+
+    if (--cn->pins == 0 && cn->deleted) {
+        ngx_slab_free_locked(cache->shpool, ngx_http_rados_cache_rbnode(cn));
+    }
+}
+
+
+void
+ngx_http_rados_content_cache_unpin(ngx_shm_zone_t *zone, void *pin)
+{
+    ngx_http_rados_cache_t *cache = zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    ngx_http_rados_cache_unpin_locked(cache, pin);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+void
+ngx_http_rados_content_cache_reset(ngx_shm_zone_t *zone)
+{
+    ngx_queue_t *pins;
+    ngx_http_rados_cache_t *cache = zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    pins = &cache->sh->pins[ngx_process_slot];
+
+    while (!ngx_queue_empty(pins)) {
+        ngx_http_rados_cache_unpin_locked(cache,
+            ngx_queue_data(ngx_queue_head(pins), ngx_http_rados_cache_pin_t, queue));
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+void
+ngx_http_rados_content_cache_put(ngx_shm_zone_t *zone, ngx_str_t *key,
+    ngx_http_rados_stat_t *st, u_char *body, size_t len)
+{
+    uint32_t hash;
+    ngx_http_rados_cache_t *cache = zone->data;
+    ngx_http_rados_cache_node_t *cn;
+
+    if (key->len > 65535) {
+        return;
+    }
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_http_rados_cache_lookup_locked(cache, key, hash);
+    if (cn != NULL) {
+        ngx_http_rados_cache_delete_locked(cache, cn);
+    }
+
+    cn = ngx_http_rados_cache_insert_locked(cache, key, hash, len);
+
+    if (cn != NULL) {
+        cn->stat = *st;
+        cn->expire = 0;
+        ngx_memcpy(cn->data + cn->len, body, len);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+void
+ngx_http_rados_cache_delete(ngx_shm_zone_t *zone, ngx_str_t *key)
+{
+    uint32_t hash;
+    ngx_http_rados_cache_t *cache = zone->data;
+    ngx_http_rados_cache_node_t *cn;
+
+    hash = ngx_crc32_short(key->data, key->len);
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_http_rados_cache_lookup_locked(cache, key, hash);
+    if (cn != NULL) {
+        ngx_http_rados_cache_delete_locked(cache, cn);
+    }
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
@@ -0,0 +1,76 @@
+#ifndef H_NGX_HTTP_RADOS_CACHE
+#define H_NGX_HTTP_RADOS_CACHE
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+/**
+* Object metadata as returned by rados_aio_stat
+*/
+typedef struct {
+    uint64_t size;
+    time_t mtime;
+    uint64_t version;
+    unsigned negative:1;
+    unsigned xattrs:1; /* xattrs were read along with the stat */
+} ngx_http_rados_stat_t;
+
+/**
+* Declares (or references, when size is 0) a shared stat cache zone, or a
+* content cache zone when content is set
+*/
+ngx_shm_zone_t *ngx_http_rados_cache_add(ngx_conf_t *cf, ngx_str_t *name, size_t size,
+    ngx_uint_t content);
+
+/**
+* Looks up cached metadata, the xattrs stored with it are copied to pool.
+* Returns NGX_DECLINED on miss or expiry
+*/
+ngx_int_t ngx_http_rados_stat_cache_get(ngx_shm_zone_t *zone, ngx_str_t *key,
+    ngx_http_rados_stat_t *st, ngx_pool_t *pool, ngx_str_t *xattrs);
+
+/**
+* Stores metadata and xattrs for valid seconds, evicting least recently used
+* entries if needed
+*/
+void ngx_http_rados_stat_cache_put(ngx_shm_zone_t *zone, ngx_str_t *key,
+    ngx_http_rados_stat_t *st, ngx_str_t *xattrs, time_t valid);
+
+/**
+* Points body at len bytes at offset of a cached object, provided the cached
+* copy still matches the object's size, mtime and version. The entry stays in
+* the zone until ngx_http_rados_content_cache_unpin is called with pin
+*/
+ngx_int_t ngx_http_rados_content_cache_pin(ngx_shm_zone_t *zone, ngx_str_t *key,
+    ngx_http_rados_stat_t *st, off_t offset, size_t len, u_char **body,
+    void **pin);
+
+/**
+* Releases an entry pinned by ngx_http_rados_content_cache_pin
+*/
+void ngx_http_rados_content_cache_unpin(ngx_shm_zone_t *zone, void *pin);
+
+/**
+* Releases the pins a process left behind when it died, called at worker
+* start for the process slot the worker took over
+*/
+void ngx_http_rados_content_cache_reset(ngx_shm_zone_t *zone);
+
+/**
+* Tells whether some copy of the object is cached, NGX_DECLINED if none.
+* The copy may still turn out stale once the object is stat'ed
+*/
+ngx_int_t ngx_http_rados_content_cache_find(ngx_shm_zone_t *zone, ngx_str_t *key);
+
+/**
+* Stores a whole object, replacing any older copy
+*/
+void ngx_http_rados_content_cache_put(ngx_shm_zone_t *zone, ngx_str_t *key,
+    ngx_http_rados_stat_t *st, u_char *body, size_t len);
+
+/**
+* Drops whatever is cached for the key, after the object was overwritten
+*/
+void ngx_http_rados_cache_delete(ngx_shm_zone_t *zone, ngx_str_t *key);
+
+#endif
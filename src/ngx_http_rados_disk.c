@@ -0,0 +1,829 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_rados_aio.h"
+#include "ngx_http_rados_disk.h"
+
+/* most entries evicted by one store, the writing thread removes their files */
+#define NGX_HTTP_RADOS_DISK_EVICT  16
+
+/* files are named after the md5 of key, chunking, mtime, version and size in hex */
+#define NGX_HTTP_RADOS_DISK_NAME_LEN  (2 * NGX_HTTP_RADOS_DISK_MD5_LEN)
+#define NGX_HTTP_RADOS_DISK_MD5_LEN   16
+
+/* temporary files older than this were left by a crash */
+#define NGX_HTTP_RADOS_DISK_TMP_AGE  600
+
+typedef struct {
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t queue; /* most recently used first */
+    off_t size;        /* bytes of all chunks, written or being written */
+} ngx_http_rados_disk_sh_t;
+
+typedef struct {
+    ngx_http_rados_disk_sh_t *sh;
+    ngx_slab_pool_t *shpool;
+    ngx_path_t *path;
+    off_t max_size;
+    size_t chunk;
+#if (NGX_THREADS)
+    ngx_thread_pool_t *thread_pool;
+#endif
+} ngx_http_rados_disk_t;
+
+/* lives in the rbtree node starting at its color field, keyed by the md5 */
+typedef struct {
+    u_char color;
+    u_char ready; /* file complete, chunks still being written are never evicted */
+    u_short dummy;
+    ngx_queue_t queue;
+    size_t size;
+    u_char md5[NGX_HTTP_RADOS_DISK_MD5_LEN];
+} ngx_http_rados_disk_node_t;
+
+#define ngx_http_rados_disk_rbnode(dn)                                       \
+    ((ngx_rbtree_node_t *) ((u_char *) (dn) - offsetof(ngx_rbtree_node_t, color)))
+
+#if (NGX_THREADS)
+
+typedef struct {
+    ngx_http_rados_disk_t *disk;
+    u_char md5[NGX_HTTP_RADOS_DISK_MD5_LEN];
+    u_char *buf;
+    size_t size;     /* bytes to read or write */
+    size_t buf_size; /* as allocated */
+    off_t offset;
+    off_t file_size; /* the chunk file has when complete */
+    ngx_http_rados_disk_handler_pt handler;
+    void *data;      /* NULL once abandoned */
+    ngx_int_t rc;
+    ngx_err_t err;
+    ngx_uint_t nevicted;
+    u_char evicted[NGX_HTTP_RADOS_DISK_EVICT][NGX_HTTP_RADOS_DISK_MD5_LEN];
+    u_char *name;    /* room for the longest file name */
+    u_char *tmp;     /* and for the name written to */
+} ngx_http_rados_disk_task_t;
+
+#endif
+
+
+static void
+ngx_http_rados_disk_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t **p;
+    ngx_http_rados_disk_node_t *dn, *dnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else {
+            dn = (ngx_http_rados_disk_node_t *) &node->color;
+            dnt = (ngx_http_rados_disk_node_t *) &temp->color;
+
+            p = (ngx_memcmp(dn->md5, dnt->md5, NGX_HTTP_RADOS_DISK_MD5_LEN) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_int_t
+ngx_http_rados_disk_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_rados_disk_t *odisk = data;
+    ngx_http_rados_disk_t *disk;
+    size_t len;
+
+    disk = shm_zone->data;
+
+    if (odisk) {
+        disk->sh = odisk->sh;
+        disk->shpool = odisk->shpool;
+        return NGX_OK;
+    }
+
+    disk->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        disk->sh = disk->shpool->data;
+        return NGX_OK;
+    }
+
+    disk->sh = ngx_slab_alloc(disk->shpool, sizeof(ngx_http_rados_disk_sh_t));
+    if (disk->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    disk->shpool->data = disk->sh;
+
+    ngx_rbtree_init(&disk->sh->rbtree, &disk->sh->sentinel,
+                    ngx_http_rados_disk_rbtree_insert_value);
+
+    ngx_queue_init(&disk->sh->queue);
+    disk->sh->size = 0;
+
+    len = sizeof(" in rados disk cache zone \"\"") + shm_zone->shm.name.len;
+
+    disk->shpool->log_ctx = ngx_slab_alloc(disk->shpool, len);
+    if (disk->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(disk->shpool->log_ctx, " in rados disk cache zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    disk->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t ngx_http_rados_disk_tag;
+
+
+ngx_shm_zone_t *
+ngx_http_rados_disk_add(ngx_conf_t *cf, ngx_str_t *name, size_t size)
+{
+    ngx_shm_zone_t *shm_zone;
+    ngx_http_rados_disk_t *disk;
+
+    shm_zone = ngx_shared_memory_add(cf, name, size, &ngx_http_rados_disk_tag);
+    if (shm_zone == NULL) {
+        return NULL;
+    }
+
+    if (shm_zone->data == NULL) {
+        disk = ngx_pcalloc(cf->pool, sizeof(ngx_http_rados_disk_t));
+        if (disk == NULL) {
+            return NULL;
+        }
+
+        shm_zone->init = ngx_http_rados_disk_init_zone;
+        shm_zone->data = disk;
+    }
+
+    return shm_zone;
+}
+
+
+size_t
+ngx_http_rados_disk_chunk(ngx_shm_zone_t *zone)
+{
+    ngx_http_rados_disk_t *disk = zone->data;
+
+    return disk->chunk;
+}
+
+
+/*
+* The chunk size keeps the files of a cache that was given another chunk size
+* from being read as chunks of the new one. The object size tells objects
+* apart when no version is known.
+*/
+static void
+ngx_http_rados_disk_md5(ngx_http_rados_disk_t *disk, ngx_str_t *key, off_t index,
+    time_t mtime, uint64_t version, size_t size, u_char *md5)
+{
+    ngx_md5_t ctx;
+
+    ngx_md5_init(&ctx);
+    ngx_md5_update(&ctx, key->data, key->len);
+    ngx_md5_update(&ctx, &disk->chunk, sizeof(size_t));
+    ngx_md5_update(&ctx, &index, sizeof(off_t));
+    ngx_md5_update(&ctx, &mtime, sizeof(time_t));
+    ngx_md5_update(&ctx, &version, sizeof(uint64_t));
+    ngx_md5_update(&ctx, &size, sizeof(size_t));
+    ngx_md5_final(md5, &ctx);
+}
+
+
+static u_char *
+ngx_http_rados_disk_name(ngx_http_rados_disk_t *disk, u_char *name, u_char *md5,
+    ngx_uint_t tmp)
+{
+    u_char *p;
+
+    p = ngx_cpymem(name, disk->path->name.data, disk->path->name.len);
+    *p++ = '/';
+    p = ngx_hex_dump(p, md5, NGX_HTTP_RADOS_DISK_MD5_LEN);
+
+    if (tmp) {
+        p = ngx_cpymem(p, ".tmp", sizeof(".tmp") - 1);
+    }
+
+    *p = '\0';
+
+    return name;
+}
+
+
+static ngx_http_rados_disk_node_t *
+ngx_http_rados_disk_lookup_locked(ngx_http_rados_disk_t *disk, u_char *md5)
+{
+    ngx_int_t rc;
+    ngx_rbtree_key_t key;
+    ngx_rbtree_node_t *node, *sentinel;
+    ngx_http_rados_disk_node_t *dn;
+
+    ngx_memcpy((u_char *) &key, md5, sizeof(ngx_rbtree_key_t));
+
+    node = disk->sh->rbtree.root;
+    sentinel = disk->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        dn = (ngx_http_rados_disk_node_t *) &node->color;
+
+        rc = ngx_memcmp(md5, dn->md5, NGX_HTTP_RADOS_DISK_MD5_LEN);
+
+        if (rc == 0) {
+            return dn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_rados_disk_delete_locked(ngx_http_rados_disk_t *disk,
+    ngx_http_rados_disk_node_t *dn)
+{
+    disk->sh->size -= dn->size;
+
+    ngx_queue_remove(&dn->queue);
+    ngx_rbtree_delete(&disk->sh->rbtree, ngx_http_rados_disk_rbnode(dn));
+    ngx_slab_free_locked(disk->shpool, ngx_http_rados_disk_rbnode(dn));
+}
+
+
+/*
+* Runs in the cache loader process: removes the files the index does not
+* know, left over from before a restart or by a crashed write.
+*/
+static void
+ngx_http_rados_disk_loader(void *data)
+{
+    ngx_shm_zone_t *zone = data;
+    ngx_http_rados_disk_t *disk = zone->data;
+    ngx_http_rados_disk_node_t *dn;
+    ngx_dir_t dir;
+    ngx_int_t n;
+    ngx_uint_t i;
+    size_t len;
+    u_char *name, *p;
+    u_char md5[NGX_HTTP_RADOS_DISK_MD5_LEN];
+
+    if (ngx_open_dir(&disk->path->name, &dir) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_dir_n " \"%V\" failed", &disk->path->name);
+        return;
+    }
+
+    name = ngx_alloc(disk->path->name.len + NGX_HTTP_RADOS_DISK_NAME_LEN + sizeof("/.tmp"),
+                     ngx_cycle->log);
+    if (name == NULL) {
+        ngx_close_dir(&dir);
+        return;
+    }
+
+    for ( ;; ) {
+        ngx_set_errno(0);
+
+        if (ngx_read_dir(&dir) == NGX_ERROR) {
+            break;
+        }
+
+        len = ngx_de_namelen(&dir);
+        p = ngx_de_name(&dir);
+
+        if (len != NGX_HTTP_RADOS_DISK_NAME_LEN
+            && (len != NGX_HTTP_RADOS_DISK_NAME_LEN + sizeof(".tmp") - 1
+                || ngx_strncmp(p + NGX_HTTP_RADOS_DISK_NAME_LEN, ".tmp", sizeof(".tmp") - 1) != 0))
+        {
+            continue;
+        }
+
+        for (i = 0; i < NGX_HTTP_RADOS_DISK_MD5_LEN; i++) {
+            n = ngx_hextoi(p + 2 * i, 2);
+            if (n == NGX_ERROR) {
+                break;
+            }
+
+            md5[i] = (u_char) n;
+        }
+
+        if (i < NGX_HTTP_RADOS_DISK_MD5_LEN) {
+            continue;
+        }
+
+        ngx_http_rados_disk_name(disk, name, md5, len != NGX_HTTP_RADOS_DISK_NAME_LEN);
+
+        if (len != NGX_HTTP_RADOS_DISK_NAME_LEN) {
+            if (ngx_de_info(name, &dir) == NGX_FILE_ERROR
+                || ngx_time() - ngx_de_mtime(&dir) < NGX_HTTP_RADOS_DISK_TMP_AGE)
+            {
+                continue;
+            }
+
+        } else {
+            ngx_shmtx_lock(&disk->shpool->mutex);
+            dn = ngx_http_rados_disk_lookup_locked(disk, md5);
+            ngx_shmtx_unlock(&disk->shpool->mutex);
+
+            if (dn != NULL) {
+                continue;
+            }
+        }
+
+        if (ngx_delete_file(name) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", name);
+        }
+    }
+
+    ngx_free(name);
+    ngx_close_dir(&dir);
+}
+
+
+char *
+ngx_http_rados_disk_set(ngx_conf_t *cf, ngx_shm_zone_t *zone, ngx_str_t *path,
+    off_t max_size, size_t chunk, ngx_str_t *threads)
+{
+    ngx_http_rados_disk_t *disk = zone->data;
+
+    if (disk->path != NULL) {
+        return "is duplicate";
+    }
+
+#if (NGX_THREADS)
+
+    disk->thread_pool = ngx_thread_pool_add(cf, threads);
+    if (disk->thread_pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+#else
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "rados disk cache requires nginx built with threads");
+    return NGX_CONF_ERROR;
+
+#endif
+
+    disk->path = ngx_pcalloc(cf->pool, sizeof(ngx_path_t));
+    if (disk->path == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    disk->path->name = *path;
+
+    if (ngx_conf_full_name(cf->cycle, &disk->path->name, 0) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* nginx creates the directory for the worker user */
+    disk->path->loader = ngx_http_rados_disk_loader;
+    disk->path->data = zone;
+    disk->path->conf_file = cf->conf_file->file.name.data;
+    disk->path->line = cf->conf_file->line;
+
+    if (ngx_add_path(cf, &disk->path) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    disk->max_size = max_size;
+    disk->chunk = chunk;
+
+    return NGX_CONF_OK;
+}
+
+
+#if (NGX_THREADS)
+
+static ngx_thread_task_t *
+ngx_http_rados_disk_task(ngx_http_rados_disk_t *disk, ngx_log_t *log)
+{
+    ngx_thread_task_t *task;
+    ngx_http_rados_disk_task_t *ctx;
+    size_t len;
+
+    len = disk->path->name.len + NGX_HTTP_RADOS_DISK_NAME_LEN + sizeof("/.tmp");
+
+    /* outlives the request, an abandoned read still lands in the buffer */
+    task = ngx_calloc(sizeof(ngx_thread_task_t) + sizeof(ngx_http_rados_disk_task_t)
+                      + 2 * len, log);
+    if (task == NULL) {
+        return NULL;
+    }
+
+    ctx = (ngx_http_rados_disk_task_t *) (task + 1);
+    ctx->disk = disk;
+    ctx->name = (u_char *) (ctx + 1);
+    ctx->tmp = ctx->name + len;
+
+    /* the request and its log may be gone when the task is done */
+    task->ctx = ctx;
+    task->event.data = task;
+    task->event.log = ngx_cycle->log;
+
+    return task;
+}
+
+
+static void
+ngx_http_rados_disk_read_thread(void *data, ngx_log_t *log)
+{
+    ngx_http_rados_disk_task_t *ctx = data;
+    ngx_file_info_t fi;
+    ngx_fd_t fd;
+    ssize_t n;
+
+    ngx_http_rados_disk_name(ctx->disk, ctx->name, ctx->md5, 0);
+
+    ctx->rc = NGX_ERROR;
+
+    fd = ngx_open_file(ctx->name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        ctx->err = ngx_errno;
+        return;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ctx->err = ngx_errno;
+        ngx_close_file(fd);
+        return;
+    }
+
+    /* a file truncated or replaced behind the index is not the chunk */
+    if (ngx_file_size(&fi) != ctx->file_size) {
+        ngx_close_file(fd);
+        return;
+    }
+
+    n = pread(fd, ctx->buf, ctx->size, ctx->offset);
+
+    if (n == -1) {
+        ctx->err = ngx_errno;
+
+    } else if ((size_t) n == ctx->size) {
+        ctx->rc = NGX_OK;
+    }
+
+    ngx_close_file(fd);
+}
+
+
+static void
+ngx_http_rados_disk_read_done(ngx_event_t *ev)
+{
+    ngx_thread_task_t *task = ev->data;
+    ngx_http_rados_disk_task_t *ctx = task->ctx;
+    ngx_http_rados_disk_t *disk = ctx->disk;
+    ngx_http_rados_disk_node_t *dn;
+
+    if (ctx->rc != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ctx->err,
+                      "rados disk cache read of \"%s\" failed", ctx->name);
+
+        /* the chunk is fetched from the cluster again and rewritten */
+        ngx_shmtx_lock(&disk->shpool->mutex);
+
+        dn = ngx_http_rados_disk_lookup_locked(disk, ctx->md5);
+        if (dn != NULL && dn->ready) {
+            ngx_http_rados_disk_delete_locked(disk, dn);
+        }
+
+        ngx_shmtx_unlock(&disk->shpool->mutex);
+    }
+
+    if (ctx->data == NULL) {
+        ngx_http_rados_buf_free(ctx->buf, ctx->buf_size);
+
+    } else {
+        ctx->handler(ctx->data, task, ctx->rc);
+    }
+
+    ngx_free(task);
+}
+
+
+static void
+ngx_http_rados_disk_write_thread(void *data, ngx_log_t *log)
+{
+    ngx_http_rados_disk_task_t *ctx = data;
+    ngx_fd_t fd;
+    ngx_uint_t i;
+    ssize_t n;
+    size_t written;
+
+    for (i = 0; i < ctx->nevicted; i++) {
+        ngx_http_rados_disk_name(ctx->disk, ctx->name, ctx->evicted[i], 0);
+        (void) ngx_delete_file(ctx->name);
+    }
+
+    ctx->rc = NGX_ERROR;
+
+    if (ctx->buf == NULL) {
+        return;
+    }
+
+    ngx_http_rados_disk_name(ctx->disk, ctx->name, ctx->md5, 0);
+    ngx_http_rados_disk_name(ctx->disk, ctx->tmp, ctx->md5, 1);
+
+    fd = ngx_open_file(ctx->tmp, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+    if (fd == NGX_INVALID_FILE) {
+        ctx->err = ngx_errno;
+        return;
+    }
+
+    for (written = 0; written < ctx->size; written += n) {
+        n = ngx_write_fd(fd, ctx->buf + written, ctx->size - written);
+        if (n == -1) {
+            ctx->err = ngx_errno;
+            break;
+        }
+    }
+
+    ngx_close_file(fd);
+
+    if (written == ctx->size && ngx_rename_file(ctx->tmp, ctx->name) == NGX_FILE_ERROR) {
+        ctx->err = ngx_errno;
+        written = 0;
+    }
+
+    if (written != ctx->size) {
+        (void) ngx_delete_file(ctx->tmp);
+        return;
+    }
+
+    ctx->rc = NGX_OK;
+}
+
+
+static void
+ngx_http_rados_disk_write_done(ngx_event_t *ev)
+{
+    ngx_thread_task_t *task = ev->data;
+    ngx_http_rados_disk_task_t *ctx = task->ctx;
+    ngx_http_rados_disk_t *disk = ctx->disk;
+    ngx_http_rados_disk_node_t *dn;
+
+    if (ctx->rc != NGX_OK && ctx->size) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ctx->err,
+                      "rados disk cache write of \"%s\" failed", ctx->tmp);
+    }
+
+    ngx_shmtx_lock(&disk->shpool->mutex);
+
+    dn = ngx_http_rados_disk_lookup_locked(disk, ctx->md5);
+    if (dn != NULL) {
+        if (ctx->rc == NGX_OK) {
+            dn->ready = 1;
+
+        } else {
+            ngx_http_rados_disk_delete_locked(disk, dn);
+        }
+    }
+
+    ngx_shmtx_unlock(&disk->shpool->mutex);
+
+    if (ctx->buf != NULL) {
+        ngx_http_rados_buf_free(ctx->buf, ctx->buf_size);
+    }
+
+    ngx_free(task);
+}
+
+#endif
+
+
+ngx_int_t
+ngx_http_rados_disk_read(ngx_shm_zone_t *zone, ngx_str_t *key, off_t index,
+    time_t mtime, uint64_t version, size_t size, off_t offset, size_t len, u_char *buf,
+    ngx_http_rados_disk_handler_pt handler, void *data, ngx_log_t *log, void **task)
+{
+#if (NGX_THREADS)
+    ngx_http_rados_disk_t *disk = zone->data;
+    ngx_http_rados_disk_node_t *dn;
+    ngx_http_rados_disk_task_t *ctx;
+    ngx_thread_task_t *t;
+    off_t file_size;
+    u_char md5[NGX_HTTP_RADOS_DISK_MD5_LEN];
+
+    ngx_http_rados_disk_md5(disk, key, index, mtime, version, size, md5);
+
+    ngx_shmtx_lock(&disk->shpool->mutex);
+
+    dn = ngx_http_rados_disk_lookup_locked(disk, md5);
+
+    if (dn == NULL || !dn->ready || offset + (off_t) len > (off_t) dn->size) {
+        ngx_shmtx_unlock(&disk->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    file_size = dn->size;
+
+    ngx_queue_remove(&dn->queue);
+    ngx_queue_insert_head(&disk->sh->queue, &dn->queue);
+
+    ngx_shmtx_unlock(&disk->shpool->mutex);
+
+    t = ngx_http_rados_disk_task(disk, log);
+    if (t == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx = t->ctx;
+    ngx_memcpy(ctx->md5, md5, NGX_HTTP_RADOS_DISK_MD5_LEN);
+    ctx->buf = buf;
+    ctx->size = len;
+    ctx->offset = offset;
+    ctx->file_size = file_size;
+    ctx->handler = handler;
+    ctx->data = data;
+
+    t->handler = ngx_http_rados_disk_read_thread;
+    t->event.handler = ngx_http_rados_disk_read_done;
+
+    if (ngx_thread_task_post(disk->thread_pool, t) != NGX_OK) {
+        ngx_free(t);
+        return NGX_DECLINED;
+    }
+
+    *task = t;
+
+    return NGX_OK;
+
+#else
+
+    return NGX_DECLINED;
+
+#endif
+}
+
+
+void
+ngx_http_rados_disk_abandon(void *task, u_char *buf, size_t size)
+{
+#if (NGX_THREADS)
+    ngx_thread_task_t *t = task;
+    ngx_http_rados_disk_task_t *ctx = t->ctx;
+
+    ctx->data = NULL;
+    ctx->buf_size = size;
+#endif
+}
+
+
+void
+ngx_http_rados_disk_store(ngx_shm_zone_t *zone, ngx_str_t *key, off_t index,
+    time_t mtime, uint64_t version, size_t size, u_char *data, size_t len, ngx_log_t *log)
+{
+#if (NGX_THREADS)
+    ngx_http_rados_disk_t *disk = zone->data;
+    ngx_http_rados_disk_node_t *dn;
+    ngx_http_rados_disk_task_t *ctx;
+    ngx_thread_task_t *t;
+    ngx_rbtree_node_t *node;
+    ngx_queue_t *q, *prev;
+    ngx_uint_t tries;
+
+    t = ngx_http_rados_disk_task(disk, log);
+    if (t == NULL) {
+        return;
+    }
+
+    ctx = t->ctx;
+    ngx_http_rados_disk_md5(disk, key, index, mtime, version, size, ctx->md5);
+
+    ngx_shmtx_lock(&disk->shpool->mutex);
+
+    if (ngx_http_rados_disk_lookup_locked(disk, ctx->md5) != NULL) {
+        ngx_shmtx_unlock(&disk->shpool->mutex);
+        ngx_free(t);
+        return;
+    }
+
+    disk->sh->size += len;
+
+    /* oldest complete chunks go first, their files are removed by the thread */
+    for (q = ngx_queue_last(&disk->sh->queue);
+         q != ngx_queue_sentinel(&disk->sh->queue)
+         && ctx->nevicted < NGX_HTTP_RADOS_DISK_EVICT
+         && disk->sh->size > disk->max_size;
+         q = prev)
+    {
+        prev = ngx_queue_prev(q);
+        dn = ngx_queue_data(q, ngx_http_rados_disk_node_t, queue);
+
+        if (!dn->ready) {
+            continue;
+        }
+
+        ngx_memcpy(ctx->evicted[ctx->nevicted++], dn->md5, NGX_HTTP_RADOS_DISK_MD5_LEN);
+        ngx_http_rados_disk_delete_locked(disk, dn);
+    }
+
+    for (tries = 0; ; tries++) {
+        node = ngx_slab_alloc_locked(disk->shpool,
+                                     offsetof(ngx_rbtree_node_t, color)
+                                     + sizeof(ngx_http_rados_disk_node_t));
+        if (node != NULL) {
+            break;
+        }
+
+        q = ngx_queue_last(&disk->sh->queue);
+
+        if (tries == NGX_HTTP_RADOS_DISK_EVICT || ctx->nevicted == NGX_HTTP_RADOS_DISK_EVICT
+            || q == ngx_queue_sentinel(&disk->sh->queue))
+        {
+            break;
+        }
+
+        dn = ngx_queue_data(q, ngx_http_rados_disk_node_t, queue);
+        if (!dn->ready) {
+            break;
+        }
+
+        ngx_memcpy(ctx->evicted[ctx->nevicted++], dn->md5, NGX_HTTP_RADOS_DISK_MD5_LEN);
+        ngx_http_rados_disk_delete_locked(disk, dn);
+    }
+
+    if (node == NULL) {
+        disk->sh->size -= len;
+        ngx_shmtx_unlock(&disk->shpool->mutex);
+
+        if (ctx->nevicted == 0) {
+            ngx_free(t);
+            return;
+        }
+
+        /* the thread still removes what was evicted */
+        len = 0;
+
+    } else {
+        ngx_memcpy((u_char *) &node->key, ctx->md5, sizeof(ngx_rbtree_key_t));
+
+        dn = (ngx_http_rados_disk_node_t *) &node->color;
+        dn->ready = 0;
+        dn->size = len;
+        ngx_memcpy(dn->md5, ctx->md5, NGX_HTTP_RADOS_DISK_MD5_LEN);
+
+        ngx_rbtree_insert(&disk->sh->rbtree, node);
+        ngx_queue_insert_head(&disk->sh->queue, &dn->queue);
+
+        ngx_shmtx_unlock(&disk->shpool->mutex);
+    }
+
+    if (len) {
+        ctx->buf = ngx_http_rados_buf_alloc(len, log);
+        if (ctx->buf != NULL) {
+            ngx_memcpy(ctx->buf, data, len);
+        }
+
+        ctx->size = len;
+        ctx->buf_size = len;
+    }
+
+    t->handler = ngx_http_rados_disk_write_thread;
+    t->event.handler = ngx_http_rados_disk_write_done;
+
+    if (ngx_thread_task_post(disk->thread_pool, t) != NGX_OK) {
+        ctx->rc = NGX_ERROR;
+        ngx_http_rados_disk_write_done(&t->event);
+    }
+#endif
+}
@@ -0,0 +1,51 @@
+#ifndef H_NGX_HTTP_RADOS_DISK
+#define H_NGX_HTTP_RADOS_DISK
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+/**
+* Called on the worker thread once a posted read is done, rc is NGX_OK when
+* the bytes are in the buffer
+*/
+typedef void (*ngx_http_rados_disk_handler_pt)(void *data, void *task, ngx_int_t rc);
+
+/**
+* Declares (or references, when size is 0) the shared index of a disk chunk cache
+*/
+ngx_shm_zone_t *ngx_http_rados_disk_add(ngx_conf_t *cf, ngx_str_t *name, size_t size);
+
+/**
+* Sets the directory, size cap, chunk size and thread pool of a declared cache
+*/
+char *ngx_http_rados_disk_set(ngx_conf_t *cf, ngx_shm_zone_t *zone, ngx_str_t *path,
+    off_t max_size, size_t chunk, ngx_str_t *threads);
+
+/**
+* Size of the chunks the cache holds, objects are cut at multiples of it
+*/
+size_t ngx_http_rados_disk_chunk(ngx_shm_zone_t *zone);
+
+/**
+* Reads len bytes at offset of a cached chunk of an object of the given size
+* into buf from a thread. Returns NGX_DECLINED when the chunk is not cached,
+* or NGX_OK once the read is posted and task identifies it to the handler
+*/
+ngx_int_t ngx_http_rados_disk_read(ngx_shm_zone_t *zone, ngx_str_t *key, off_t index,
+    time_t mtime, uint64_t version, size_t size, off_t offset, size_t len, u_char *buf,
+    ngx_http_rados_disk_handler_pt handler, void *data, ngx_log_t *log, void **task);
+
+/**
+* Gives up on a posted read, buf is freed with ngx_http_rados_buf_free once
+* the thread is done with it
+*/
+void ngx_http_rados_disk_abandon(void *task, u_char *buf, size_t size);
+
+/**
+* Writes a copy of a whole chunk to the cache from a thread, unless it is
+* cached or being written already
+*/
+void ngx_http_rados_disk_store(ngx_shm_zone_t *zone, ngx_str_t *key, off_t index,
+    time_t mtime, uint64_t version, size_t size, u_char *data, size_t len, ngx_log_t *log);
+
+#endif
@@ -0,0 +1,561 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_rados_limit.h"
+
+/* buckets freed at once when the zone runs out of memory */
+#define NGX_HTTP_RADOS_LIMIT_EVICT  8
+
+typedef struct {
+    ngx_rbtree_t rbtree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t queue; /* most recently charged first */
+} ngx_http_rados_limit_sh_t;
+
+typedef struct {
+    ngx_http_rados_limit_sh_t *sh;
+    ngx_slab_pool_t *shpool;
+    size_t rate;  /* bytes per second */
+    size_t burst; /* bytes a bucket holds when full */
+} ngx_http_rados_limit_t;
+
+/* lives in the rbtree node starting at its color field, like limit_req */
+typedef struct {
+    u_char color;
+    u_char dummy;
+    u_short len;
+    ngx_queue_t queue;
+    ngx_http_rados_bucket_t bucket;
+    u_char data[1];
+} ngx_http_rados_limit_node_t;
+
+
+ngx_msec_t
+ngx_http_rados_bucket_charge(ngx_http_rados_bucket_t *bucket, size_t rate,
+    size_t burst, size_t len)
+{
+    ngx_msec_int_t elapsed;
+    off_t needed;
+
+    elapsed = (ngx_msec_int_t) (ngx_current_msec - bucket->last);
+    bucket->last = ngx_current_msec;
+
+    if (elapsed > 0) {
+        /* compared first, an idle bucket would overflow the product */
+        needed = ((off_t) burst - bucket->tokens) * 1000 / (off_t) rate;
+
+        if (elapsed >= needed) {
+            bucket->tokens = burst;
+
+        } else {
+            bucket->tokens += (off_t) rate * elapsed / 1000;
+        }
+    }
+
+    bucket->tokens -= len;
+
+    if (bucket->tokens >= 0) {
+        return 0;
+    }
+
+    return (ngx_msec_t) (-bucket->tokens * 1000 / (off_t) rate);
+}
+
+
+static void
+ngx_http_rados_limit_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t **p;
+    ngx_http_rados_limit_node_t *ln, *lnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else {
+            ln = (ngx_http_rados_limit_node_t *) &node->color;
+            lnt = (ngx_http_rados_limit_node_t *) &temp->color;
+
+            p = (ngx_memn2cmp(ln->data, lnt->data, ln->len, lnt->len) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_int_t
+ngx_http_rados_limit_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_rados_limit_t *olimit = data;
+    ngx_http_rados_limit_t *limit;
+    size_t len;
+
+    limit = shm_zone->data;
+
+    if (olimit) {
+        limit->sh = olimit->sh;
+        limit->shpool = olimit->shpool;
+        return NGX_OK;
+    }
+
+    limit->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        limit->sh = limit->shpool->data;
+        return NGX_OK;
+    }
+
+    limit->sh = ngx_slab_alloc(limit->shpool, sizeof(ngx_http_rados_limit_sh_t));
+    if (limit->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    limit->shpool->data = limit->sh;
+
+    ngx_rbtree_init(&limit->sh->rbtree, &limit->sh->sentinel,
+                    ngx_http_rados_limit_rbtree_insert_value);
+
+    ngx_queue_init(&limit->sh->queue);
+
+    len = sizeof(" in rados limit zone \"\"") + shm_zone->shm.name.len;
+
+    limit->shpool->log_ctx = ngx_slab_alloc(limit->shpool, len);
+    if (limit->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(limit->shpool->log_ctx, " in rados limit zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    limit->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t ngx_http_rados_limit_tag;
+static ngx_uint_t ngx_http_rados_gate_tag;
+
+
+ngx_shm_zone_t *
+ngx_http_rados_limit_add(ngx_conf_t *cf, ngx_str_t *name, size_t size)
+{
+    ngx_shm_zone_t *shm_zone;
+    ngx_http_rados_limit_t *limit;
+
+    shm_zone = ngx_shared_memory_add(cf, name, size, &ngx_http_rados_limit_tag);
+    if (shm_zone == NULL) {
+        return NULL;
+    }
+
+    if (shm_zone->data == NULL) {
+        limit = ngx_pcalloc(cf->pool, sizeof(ngx_http_rados_limit_t));
+        if (limit == NULL) {
+            return NULL;
+        }
+
+        shm_zone->init = ngx_http_rados_limit_init_zone;
+        shm_zone->data = limit;
+    }
+
+    return shm_zone;
+}
+
+
+void
+ngx_http_rados_limit_set(ngx_shm_zone_t *zone, size_t rate, size_t burst)
+{
+    ngx_http_rados_limit_t *limit = zone->data;
+
+    limit->rate = rate;
+    limit->burst = burst;
+}
+
+
+static ngx_http_rados_limit_node_t *
+ngx_http_rados_limit_lookup_locked(ngx_http_rados_limit_t *limit,
+    ngx_str_t *key, uint32_t hash)
+{
+    ngx_int_t rc;
+    ngx_rbtree_node_t *node, *sentinel;
+    ngx_http_rados_limit_node_t *ln;
+
+    node = limit->sh->rbtree.root;
+    sentinel = limit->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        ln = (ngx_http_rados_limit_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(key->data, ln->data, key->len, (size_t) ln->len);
+
+        if (rc == 0) {
+            return ln;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_rados_limit_evict_locked(ngx_http_rados_limit_t *limit, ngx_uint_t n)
+{
+    ngx_queue_t *q;
+    ngx_rbtree_node_t *node;
+    ngx_http_rados_limit_node_t *ln;
+
+    while (n-- && !ngx_queue_empty(&limit->sh->queue)) {
+        q = ngx_queue_last(&limit->sh->queue);
+        ln = ngx_queue_data(q, ngx_http_rados_limit_node_t, queue);
+        node = (ngx_rbtree_node_t *) ((u_char *) ln - offsetof(ngx_rbtree_node_t, color));
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&limit->sh->rbtree, node);
+        ngx_slab_free_locked(limit->shpool, node);
+    }
+}
+
+
+ngx_msec_t
+ngx_http_rados_limit_take(ngx_shm_zone_t *zone, ngx_str_t *key, size_t len)
+{
+    uint32_t hash;
+    size_t size;
+    ngx_uint_t tries;
+    ngx_msec_t delay;
+    ngx_rbtree_node_t *node;
+    ngx_http_rados_limit_t *limit = zone->data;
+    ngx_http_rados_limit_node_t *ln;
+
+    hash = ngx_crc32_short(key->data, key->len);
+    delay = 0;
+
+    ngx_shmtx_lock(&limit->shpool->mutex);
+
+    ln = ngx_http_rados_limit_lookup_locked(limit, key, hash);
+
+    if (ln == NULL) {
+        size = offsetof(ngx_rbtree_node_t, color)
+               + offsetof(ngx_http_rados_limit_node_t, data)
+               + key->len;
+
+        for (tries = 0; ; tries++) {
+            node = ngx_slab_alloc_locked(limit->shpool, size);
+            if (node != NULL) {
+                break;
+            }
+
+            if (tries == 4 || ngx_queue_empty(&limit->sh->queue)) {
+                goto done;
+            }
+
+            ngx_http_rados_limit_evict_locked(limit, NGX_HTTP_RADOS_LIMIT_EVICT);
+        }
+
+        node->key = hash;
+
+        ln = (ngx_http_rados_limit_node_t *) &node->color;
+        ln->len = (u_short) key->len;
+        ln->bucket.tokens = limit->burst;
+        ln->bucket.last = ngx_current_msec;
+        ngx_memcpy(ln->data, key->data, key->len);
+
+        ngx_rbtree_insert(&limit->sh->rbtree, node);
+
+    } else {
+        ngx_queue_remove(&ln->queue);
+    }
+
+    ngx_queue_insert_head(&limit->sh->queue, &ln->queue);
+
+    delay = ngx_http_rados_bucket_charge(&ln->bucket, limit->rate, limit->burst, len);
+
+done:
+
+    ngx_shmtx_unlock(&limit->shpool->mutex);
+
+    return delay;
+}
+
+
+typedef struct {
+    uint32_t active;
+    uint32_t waiting;
+} ngx_http_rados_gate_slot_t;
+
+/* one per pool, pools are few so they are kept in a list */
+typedef struct {
+    ngx_queue_t queue;
+    ngx_uint_t active;    /* requests admitted, all workers */
+    ngx_uint_t waiting;   /* requests queued, all workers */
+    ngx_uint_t admitted;  /* totals since the zone was created */
+    ngx_uint_t queued;
+    ngx_uint_t timedout;
+    ngx_msec_t wait_time; /* summed over queued requests that got in */
+    ngx_http_rados_gate_slot_t slots[NGX_MAX_PROCESSES]; /* share of every process */
+    u_short len;
+    u_char data[1];
+} ngx_http_rados_gate_pool_t;
+
+typedef struct {
+    ngx_queue_t pools;
+} ngx_http_rados_gate_sh_t;
+
+typedef struct {
+    ngx_http_rados_gate_sh_t *sh;
+    ngx_slab_pool_t *shpool;
+} ngx_http_rados_gate_t;
+
+
+static ngx_int_t
+ngx_http_rados_gate_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_rados_gate_t *ogate = data;
+    ngx_http_rados_gate_t *gate;
+    size_t len;
+
+    gate = shm_zone->data;
+
+    if (ogate) {
+        gate->sh = ogate->sh;
+        gate->shpool = ogate->shpool;
+        return NGX_OK;
+    }
+
+    gate->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        gate->sh = gate->shpool->data;
+        return NGX_OK;
+    }
+
+    gate->sh = ngx_slab_alloc(gate->shpool, sizeof(ngx_http_rados_gate_sh_t));
+    if (gate->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    gate->shpool->data = gate->sh;
+
+    ngx_queue_init(&gate->sh->pools);
+
+    len = sizeof(" in rados inflight zone \"\"") + shm_zone->shm.name.len;
+
+    gate->shpool->log_ctx = ngx_slab_alloc(gate->shpool, len);
+    if (gate->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(gate->shpool->log_ctx, " in rados inflight zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+ngx_shm_zone_t *
+ngx_http_rados_gate_add(ngx_conf_t *cf, ngx_str_t *name, size_t size)
+{
+    ngx_shm_zone_t *shm_zone;
+    ngx_http_rados_gate_t *gate;
+
+    shm_zone = ngx_shared_memory_add(cf, name, size, &ngx_http_rados_gate_tag);
+    if (shm_zone == NULL) {
+        return NULL;
+    }
+
+    if (shm_zone->data == NULL) {
+        gate = ngx_pcalloc(cf->pool, sizeof(ngx_http_rados_gate_t));
+        if (gate == NULL) {
+            return NULL;
+        }
+
+        shm_zone->init = ngx_http_rados_gate_init_zone;
+        shm_zone->data = gate;
+    }
+
+    return shm_zone;
+}
+
+
+void
+ngx_http_rados_gate_reset(ngx_shm_zone_t *zone)
+{
+    ngx_queue_t *q;
+    ngx_http_rados_gate_t *gate = zone->data;
+    ngx_http_rados_gate_pool_t *gp;
+    ngx_http_rados_gate_slot_t *slot;
+
+    ngx_shmtx_lock(&gate->shpool->mutex);
+
+    for (q = ngx_queue_head(&gate->sh->pools);
+         q != ngx_queue_sentinel(&gate->sh->pools);
+         q = ngx_queue_next(q))
+    {
+        gp = ngx_queue_data(q, ngx_http_rados_gate_pool_t, queue);
+        slot = &gp->slots[ngx_process_slot];
+
+        gp->active -= slot->active;
+        gp->waiting -= slot->waiting;
+        slot->active = 0;
+        slot->waiting = 0;
+    }
+
+    ngx_shmtx_unlock(&gate->shpool->mutex);
+}
+
+
+void *
+ngx_http_rados_gate_pool(ngx_shm_zone_t *zone, ngx_str_t *key)
+{
+    ngx_queue_t *q;
+    ngx_http_rados_gate_t *gate = zone->data;
+    ngx_http_rados_gate_pool_t *gp;
+
+    ngx_shmtx_lock(&gate->shpool->mutex);
+
+    for (q = ngx_queue_head(&gate->sh->pools);
+         q != ngx_queue_sentinel(&gate->sh->pools);
+         q = ngx_queue_next(q))
+    {
+        gp = ngx_queue_data(q, ngx_http_rados_gate_pool_t, queue);
+
+        if (ngx_memn2cmp(key->data, gp->data, key->len, (size_t) gp->len) == 0) {
+            goto done;
+        }
+    }
+
+    gp = ngx_slab_calloc_locked(gate->shpool,
+                                offsetof(ngx_http_rados_gate_pool_t, data) + key->len);
+    if (gp == NULL) {
+        goto done;
+    }
+
+    gp->len = (u_short) key->len;
+    ngx_memcpy(gp->data, key->data, key->len);
+
+    ngx_queue_insert_tail(&gate->sh->pools, &gp->queue);
+
+done:
+
+    ngx_shmtx_unlock(&gate->shpool->mutex);
+
+    return gp;
+}
+
+
+ngx_int_t
+ngx_http_rados_gate_enter(ngx_shm_zone_t *zone, void *pool, ngx_uint_t max,
+    ngx_msec_t waited)
+{
+    ngx_int_t rc;
+    ngx_http_rados_gate_t *gate = zone->data;
+    ngx_http_rados_gate_pool_t *gp = pool;
+
+    rc = NGX_BUSY;
+
+    ngx_shmtx_lock(&gate->shpool->mutex);
+
+    /* newcomers queue up behind requests already waiting in any worker */
+    if (gp->active < max
+        && (waited != NGX_CONF_UNSET_MSEC || gp->waiting == 0))
+    {
+        gp->active++;
+        gp->slots[ngx_process_slot].active++;
+        gp->admitted++;
+
+        if (waited != NGX_CONF_UNSET_MSEC) {
+            gp->wait_time += waited;
+        }
+
+        rc = NGX_OK;
+    }
+
+    ngx_shmtx_unlock(&gate->shpool->mutex);
+
+    return rc;
+}
+
+
+void
+ngx_http_rados_gate_leave(ngx_shm_zone_t *zone, void *pool)
+{
+    ngx_http_rados_gate_t *gate = zone->data;
+    ngx_http_rados_gate_pool_t *gp = pool;
+
+    ngx_shmtx_lock(&gate->shpool->mutex);
+
+    gp->active--;
+    gp->slots[ngx_process_slot].active--;
+
+    ngx_shmtx_unlock(&gate->shpool->mutex);
+}
+
+
+void
+ngx_http_rados_gate_wait(ngx_shm_zone_t *zone, void *pool, ngx_int_t delta,
+    ngx_uint_t timedout)
+{
+    ngx_http_rados_gate_t *gate = zone->data;
+    ngx_http_rados_gate_pool_t *gp = pool;
+
+    ngx_shmtx_lock(&gate->shpool->mutex);
+
+    gp->waiting += delta;
+    gp->slots[ngx_process_slot].waiting += delta;
+
+    if (delta > 0) {
+        gp->queued++;
+    }
+
+    if (timedout) {
+        gp->timedout++;
+    }
+
+    ngx_shmtx_unlock(&gate->shpool->mutex);
+}
+
+
+void
+ngx_http_rados_gate_depth(ngx_shm_zone_t *zone, void *pool,
+    ngx_uint_t *active, ngx_uint_t *waiting)
+{
+    ngx_http_rados_gate_t *gate = zone->data;
+    ngx_http_rados_gate_pool_t *gp = pool;
+
+    ngx_shmtx_lock(&gate->shpool->mutex);
+
+    *active = gp->active;
+    *waiting = gp->waiting;
+
+    ngx_shmtx_unlock(&gate->shpool->mutex);
+}
@@ -0,0 +1,81 @@
+#ifndef H_NGX_HTTP_RADOS_LIMIT
+#define H_NGX_HTTP_RADOS_LIMIT
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+/**
+* Token bucket, bytes may be owed once a chunk larger than the tokens left is sent
+*/
+typedef struct {
+    off_t tokens;
+    ngx_msec_t last; /* when tokens were last refilled */
+} ngx_http_rados_bucket_t;
+
+/**
+* Charges len bytes to the bucket, returns how long to wait before sending more
+*/
+ngx_msec_t ngx_http_rados_bucket_charge(ngx_http_rados_bucket_t *bucket,
+    size_t rate, size_t burst, size_t len);
+
+/**
+* Declares (or references, when size is 0) a shared bandwidth limit zone
+*/
+ngx_shm_zone_t *ngx_http_rados_limit_add(ngx_conf_t *cf, ngx_str_t *name, size_t size);
+
+/**
+* Sets the rate and burst all buckets of a declared zone share
+*/
+void ngx_http_rados_limit_set(ngx_shm_zone_t *zone, size_t rate, size_t burst);
+
+/**
+* Charges len bytes to the zone's bucket for key, returns how long to wait
+* before sending more. Nothing is limited when the zone has no room for the key
+*/
+ngx_msec_t ngx_http_rados_limit_take(ngx_shm_zone_t *zone, ngx_str_t *key, size_t len);
+
+/**
+* Declares (or references, when size is 0) a zone counting the requests every
+* pool serves across all workers
+*/
+ngx_shm_zone_t *ngx_http_rados_gate_add(ngx_conf_t *cf, ngx_str_t *name, size_t size);
+
+/**
+* Drops what a process that died in this process slot left counted, called
+* when a worker starts
+*/
+void ngx_http_rados_gate_reset(ngx_shm_zone_t *zone);
+
+/**
+* Finds or creates the counters of a pool, NULL when the zone is full
+*/
+void *ngx_http_rados_gate_pool(ngx_shm_zone_t *zone, ngx_str_t *key);
+
+/**
+* Admits a request unless max requests are active or, for a new request
+* (waited == NGX_CONF_UNSET_MSEC), others are already waiting. A request that
+* waited is accounted with the time it spent queued. Returns NGX_BUSY when the
+* request has to wait
+*/
+ngx_int_t ngx_http_rados_gate_enter(ngx_shm_zone_t *zone, void *pool,
+    ngx_uint_t max, ngx_msec_t waited);
+
+/**
+* Releases an admitted request
+*/
+void ngx_http_rados_gate_leave(ngx_shm_zone_t *zone, void *pool);
+
+/**
+* Counts a request entering (delta 1) or leaving (delta -1) a queue,
+* timedout tells a request given up on
+*/
+void ngx_http_rados_gate_wait(ngx_shm_zone_t *zone, void *pool,
+    ngx_int_t delta, ngx_uint_t timedout);
+
+/**
+* Requests active and waiting for the pool across all workers
+*/
+void ngx_http_rados_gate_depth(ngx_shm_zone_t *zone, void *pool,
+    ngx_uint_t *active, ngx_uint_t *waiting);
+
+#endif
@@ -7,48 +7,186 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 #include <rados/librados.h>
+#if (NGX_HTTP_RADOS_STRIPER)
+#include <radosstriper/libradosstriper.h>
+#endif
 #include "ngx_http_rados_util.h"
+#include "ngx_http_rados_aio.h"
+#include "ngx_http_rados_cache.h"
+#include "ngx_http_rados_limit.h"
+#include "ngx_http_rados_disk.h"
+#include "ngx_http_rados_stats.h"
 
 #ifndef DDEBUG
-#define DDEBUG 1
+#define DDEBUG 0
 #endif
 #include "ddebug.h"
 
-#define BUF_LEN 1048576;
+#define NGX_HTTP_RADOS_DEFAULT_CHUNK   1048576
+#define NGX_HTTP_RADOS_MIN_CHUNK       65536
+#define NGX_HTTP_RADOS_ADAPTIVE_MAX    4194304
 
-static char* ngx_http_rados(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+/* above the NGX_HTTP_* method bits, masked out once merged */
+#define NGX_HTTP_RADOS_UPLOAD_OFF      0x40000000
+#define NGX_HTTP_RADOS_UPLOAD_METHODS  (NGX_HTTP_PUT|NGX_HTTP_POST)
+
+/* adaptive mode sizes reads so that one takes about this long */
+#define NGX_HTTP_RADOS_ADAPTIVE_LATENCY  50
+
+/*
+* Queued requests check this often whether another worker made room, nginx has
+* no way for workers to wake each other. The README states this bound.
+*/
+#define NGX_HTTP_RADOS_GATE_POLL  10
 
+/* room for the xattrs kept per request, larger ones are skipped */
+#define NGX_HTTP_RADOS_XATTRS_MAX  4096
+
+/* idle ioctxs a handle keeps for namespaces, locators and snapshots */
+#define NGX_HTTP_RADOS_IOCTX_CACHE  64
+
+/* a snapshot that was not found answers 404 this long before it is looked up again */
+#define NGX_HTTP_RADOS_SNAP_MISS  1000
+
+static char* ngx_http_rados(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_rados_buffer_size(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_rados_key(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_rados_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_rados_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_rados_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_rados_inflight_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_rados_max_inflight(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_rados_disk_cache_path(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_rados_disk_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_rados_xattr(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_rados_stats_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_rados_stats(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+static char* ngx_http_rados_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
+
+static ngx_int_t ngx_http_rados_add_variables(ngx_conf_t *cf);
 static void* ngx_http_rados_create_loc_conf(ngx_conf_t *cf);
 static char* ngx_http_rados_merge_loc_conf(ngx_conf_t *cf,
     void *parent, void *child);
 static void* ngx_http_rados_create_main_conf(ngx_conf_t* directive);
 static ngx_int_t ngx_http_rados_init_worker(ngx_cycle_t* cycle);
-static void on_aio_complete_body(rados_completion_t cb, void *arg);
+static void ngx_http_rados_exit_worker(ngx_cycle_t* cycle);
+static void on_aio_complete_body(ngx_http_rados_op_t *op);
+static void on_aio_complete_stat_read(ngx_http_rados_op_t *op);
+static void on_aio_complete_write(ngx_http_rados_op_t *op);
+static void on_aio_complete_upload(ngx_http_rados_op_t *op);
 
 typedef struct {
     ngx_array_t loc_confs; /* ngx_http_gridfs_loc_conf_t */
 } ngx_http_rados_main_conf_t;
 
+/* an ioctx of a handle bound to a namespace, locator key and snapshot */
+typedef struct {
+    ngx_str_node_t sn;   /* keyed by the three, NUL separated, see rados_ioctx_acquire */
+    ngx_queue_t queue;   /* least recently used first */
+    rados_ioctx_t io;
+#if (NGX_HTTP_RADOS_STRIPER)
+    rados_striper_t striper;
+#endif
+    ngx_uint_t refs;     /* requests using it */
+    ngx_uint_t inflight; /* ops of this worker still pending on it */
+    ngx_msec_t missed;   /* when the snapshot was not found, io is NULL then */
+} ngx_http_rados_ioctx_t;
+
+typedef struct {
+    ngx_rbtree_t tree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t lru;
+    ngx_uint_t n;
+} ngx_http_rados_ioctxs_t;
+
 typedef struct {
     rados_t cluster;
     rados_ioctx_t io;
+#if (NGX_HTTP_RADOS_STRIPER)
+    rados_striper_t striper; /* set up when a location reads striped objects */
+#endif
+    ngx_uint_t inflight; /* ops of this worker still pending on the handle */
+    ngx_http_rados_ioctxs_t *ioctxs; /* created on first use */
+} ngx_http_rados_handle_t;
+
+typedef struct {
+    ngx_str_node_t sn; /* keyed by conf_path and pool, see ngx_http_rados_connection_key */
     ngx_str_t pool;
+    size_t chunk; /* adaptive read size learned from completed reads */
+    ngx_array_t handles; /* ngx_http_rados_handle_t, rados_connections of them */
+    ngx_uint_t next; /* round robin start among equally loaded handles */
+    ngx_queue_t waiting; /* ngx_http_rados_ctx_t queued for rados_max_inflight */
+    ngx_event_t gate_ev; /* admits queued requests */
 } ngx_http_rados_connection_t;
 
-static ngx_http_rados_connection_t* ngx_http_get_rados_connection( ngx_str_t name );
+static ngx_http_rados_handle_t* ngx_http_rados_pick_handle(ngx_http_rados_connection_t* rados_conn);
+
+typedef struct {
+    ngx_str_t name;   /* xattr of the object */
+    ngx_str_t header; /* response header it is sent as, empty for variables only */
+} ngx_http_rados_xattr_t;
 
 typedef struct {
     ngx_str_t pool;
     ngx_str_t conf_path;
+    ngx_http_complex_value_t *key;     /* object key, the URI after the location when NULL */
+    ngx_flag_t key_decode;             /* key is percent-decoded, set along with key */
+    ngx_http_complex_value_t *nspace;  /* per request, the pool's default when empty */
+    ngx_http_complex_value_t *locator;
+    ngx_http_complex_value_t *snap;    /* snapshot name, the head when empty */
     ngx_flag_t enable;
-    size_t rados_throttle;
+    ngx_http_complex_value_t *rados_throttle; /* per request rate, may come from variables */
+    size_t throttle_burst;
+    ngx_shm_zone_t *limit_zone; /* buckets shared by all workers */
+    ngx_http_complex_value_t *limit_key; /* bucket of the zone, one for the zone when NULL */
+    ngx_uint_t readahead;
+    size_t buffer_size;
+    ngx_flag_t buffer_adaptive;
+    ngx_shm_zone_t *stat_cache;
+    time_t stat_cache_valid;
+    time_t stat_cache_invalid;
+    ngx_shm_zone_t *content_cache;
+    size_t cache_max_object;
+    ngx_shm_zone_t *disk_cache; /* chunks kept on local disk */
+    ngx_flag_t striper;
+    ngx_flag_t coalesce;
+    ngx_uint_t read_policy; /* librados operation flags of reads */
+    ngx_array_t *xattrs; /* ngx_http_rados_xattr_t, read along with the stat */
+    ngx_uint_t upload;
+    ngx_bufs_t upload_buffers;
+    ngx_uint_t connections;
+    ngx_shm_zone_t *gate_zone; /* counts requests per pool across workers */
+    ngx_uint_t max_inflight;
+    ngx_msec_t queue_timeout;
+    ngx_shm_zone_t *stats_zone; /* counters and histograms of all workers */
+    ngx_shm_zone_t *status_zone; /* rendered by rados_status */
+    ngx_http_rados_connection_t *conn; /* resolved when the worker starts */
+    void *stats; /* record of the pool in stats_zone, resolved when the worker starts */
 } ngx_http_rados_loc_conf_t;
 
 static ngx_int_t ngx_http_rados_init(ngx_http_rados_loc_conf_t *cf);
 
-ngx_array_t ngx_http_rados_connections;
+/* per worker, one connection for every distinct cluster config and pool */
+static ngx_rbtree_t ngx_http_rados_connections;
+static ngx_rbtree_node_t ngx_http_rados_connections_sentinel;
 
 static ngx_int_t ngx_http_rados_add_connection(ngx_cycle_t* cycle, ngx_http_rados_loc_conf_t* rados_loc_conf);
+static ngx_int_t ngx_http_rados_add_handle(ngx_cycle_t* cycle, ngx_http_rados_connection_t* rados_conn, ngx_http_rados_loc_conf_t* rados_loc_conf);
+static ngx_int_t ngx_http_rados_add_striper(ngx_cycle_t* cycle, ngx_http_rados_handle_t* handle, ngx_http_rados_loc_conf_t* rados_loc_conf);
+
+static ngx_conf_bitmask_t  ngx_http_rados_upload_methods_mask[] = {
+    { ngx_string("off"), NGX_HTTP_RADOS_UPLOAD_OFF },
+    { ngx_string("put"), NGX_HTTP_PUT },
+    { ngx_string("post"), NGX_HTTP_POST },
+    { ngx_null_string, 0 }
+};
+
+static ngx_conf_enum_t  ngx_http_rados_read_policies[] = {
+    { ngx_string("primary"), LIBRADOS_OPERATION_NOFLAG },
+    { ngx_string("balance"), LIBRADOS_OPERATION_BALANCE_READS },
+    { ngx_string("localize"), LIBRADOS_OPERATION_LOCALIZE_READS },
+    { ngx_null_string, 0 }
+};
 
 static ngx_command_t  ngx_http_rados_commands[] = {
     { ngx_string("rados"),
@@ -59,12 +197,215 @@ static ngx_command_t  ngx_http_rados_commands[] = {
       NULL },
 
     { ngx_string("rados_throttle"),
-      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
-      ngx_conf_set_size_slot,
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_size_slot,
       NGX_HTTP_LOC_CONF_OFFSET,
       offsetof(ngx_http_rados_loc_conf_t, rados_throttle),
       NULL },
 
+    { ngx_string("rados_throttle_burst"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rados_loc_conf_t, throttle_burst),
+      NULL },
+
+    { ngx_string("rados_limit_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3|NGX_CONF_TAKE4,
+      ngx_http_rados_limit_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("rados_limit"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_rados_limit,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("rados_readahead"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rados_loc_conf_t, readahead),
+      NULL },
+
+    { ngx_string("rados_buffer_size"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_rados_buffer_size,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("rados_stat_cache_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_rados_cache_zone,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rados_loc_conf_t, stat_cache),
+      NULL },
+
+    { ngx_string("rados_stat_cache_valid"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rados_loc_conf_t, stat_cache_valid),
+      NULL },
+
+    { ngx_string("rados_stat_cache_invalid"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rados_loc_conf_t, stat_cache_invalid),
+      NULL },
+
+    { ngx_string("rados_cache_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_rados_cache_zone,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rados_loc_conf_t, content_cache),
+      NULL },
+
+    { ngx_string("rados_cache_max_object"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rados_loc_conf_t, cache_max_object),
+      NULL },
+
+    { ngx_string("rados_disk_cache_path"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
+      ngx_http_rados_disk_cache_path,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("rados_disk_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_rados_disk_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rados_loc_conf_t, disk_cache),
+      NULL },
+
+    { ngx_string("rados_striper"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rados_loc_conf_t, striper),
+      NULL },
+
+    { ngx_string("rados_coalesce"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rados_loc_conf_t, coalesce),
+      NULL },
+
+    { ngx_string("rados_read_policy"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_enum_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rados_loc_conf_t, read_policy),
+      &ngx_http_rados_read_policies },
+
+    { ngx_string("rados_xattr"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_rados_xattr,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("rados_upload"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_1MORE,
+      ngx_conf_set_bitmask_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rados_loc_conf_t, upload),
+      &ngx_http_rados_upload_methods_mask },
+
+    { ngx_string("rados_upload_buffers"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      ngx_conf_set_bufs_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rados_loc_conf_t, upload_buffers),
+      NULL },
+
+    { ngx_string("rados_connections"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rados_loc_conf_t, connections),
+      NULL },
+
+    { ngx_string("rados_inflight_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+      ngx_http_rados_inflight_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("rados_max_inflight"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_rados_max_inflight,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("rados_queue_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rados_loc_conf_t, queue_timeout),
+      NULL },
+
+    { ngx_string("rados_key"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_rados_key,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("rados_namespace"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rados_loc_conf_t, nspace),
+      NULL },
+
+    { ngx_string("rados_locator"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rados_loc_conf_t, locator),
+      NULL },
+
+    { ngx_string("rados_snap"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_set_complex_value_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rados_loc_conf_t, snap),
+      NULL },
+
+    { ngx_string("rados_stats_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE2,
+      ngx_http_rados_stats_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("rados_stats"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_rados_stats,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_rados_loc_conf_t, stats_zone),
+      NULL },
+
+    { ngx_string("rados_status"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_rados_status,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("rados_pool"),
       NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_str_slot,
@@ -82,7 +423,7 @@ static ngx_command_t  ngx_http_rados_commands[] = {
 };
 
 static ngx_http_module_t  ngx_http_rados_module_ctx = {
-    NULL,                          /* preconfiguration */
+    ngx_http_rados_add_variables,  /* preconfiguration */
     NULL,           /* postconfiguration */
 
     ngx_http_rados_create_main_conf,                          /* create main configuration */
@@ -105,7 +446,7 @@ ngx_module_t  ngx_http_rados_module = {
     ngx_http_rados_init_worker,   /* init process */
     NULL,                          /* init thread */
     NULL,                          /* exit thread */
-    NULL,                          /* exit process */
+    ngx_http_rados_exit_worker,   /* exit process */
     NULL,                          /* exit master */
     NGX_MODULE_V1_PADDING
 };
@@ -136,491 +477,3918 @@ static void send_status_and_finish_connection(ngx_http_request_t *request, ngx_u
     ngx_http_finalize_request(request, ngx_code);
 }
 
+enum {
+    RADOS_SLOT_FREE = 0,
+    RADOS_SLOT_READING,
+    RADOS_SLOT_READY,
+    RADOS_SLOT_SENDING,
+    RADOS_SLOT_WRITING
+};
+
+enum {
+    RADOS_FLIGHT_READ = 0,
+    RADOS_FLIGHT_STRIPED_READ,
+    RADOS_FLIGHT_STAT_READ,
+    RADOS_FLIGHT_STAT_XATTRS_READ
+};
+
+/*
+* A read other requests of the worker may join instead of asking the cluster
+* for the same bytes again, see rados_coalesce.
+*/
+typedef struct ngx_http_rados_flight_s  ngx_http_rados_flight_t;
+
+struct ngx_http_rados_flight_s {
+    ngx_str_node_t sn;       /* identity, in ngx_http_rados_flights while leading */
+    ngx_http_rados_op_t *op; /* the read, while leading */
+    ngx_queue_t followers;   /* flights of requests waiting for its result */
+    ngx_queue_t link;        /* in the leader's followers */
+    ngx_http_rados_flight_t *leader;
+    void *data;              /* ngx_http_rados_ctx_t */
+    void *slot;              /* ngx_http_rados_slot_t, NULL for the stat read */
+    unsigned leading:1;
+};
+
+/* what makes two reads interchangeable, followed by the object key */
+typedef struct {
+    void *conn;
+    off_t offset;
+    size_t len;
+    size_t size; /* buffer capacity, a follower may take over the leader's buffer */
+    ngx_uint_t kind;
+} ngx_http_rados_flight_id_t;
+
+/* per worker, reads that can still be joined */
+static ngx_rbtree_t ngx_http_rados_flights;
+static ngx_rbtree_node_t ngx_http_rados_flights_sentinel;
+
+/*
+* One read-ahead buffer. Slots are filled and sent strictly in ring order, a
+* slot is refilled only after nginx consumed everything it handed out.
+*/
+typedef struct {
+    u_char *data;
+    size_t size;      /* capacity of data, as allocated */
+    ngx_buf_t buf;
+    ngx_chain_t link;
+    ngx_http_rados_op_t *op;
+    off_t offset;
+    size_t len;
+    ngx_msec_t start;
+    ngx_uint_t state;
+    ngx_http_rados_range_t *part; /* range this slot starts, its header goes first */
+    ngx_http_rados_flight_t flight;
+    void *disk;       /* read from the disk cache in progress */
+} ngx_http_rados_slot_t;
+
 typedef struct  {
     ngx_http_request_t *request;
     size_t size;
     time_t mtime;
+    uint64_t version; /* object version the ETag is made of, 0 when unknown */
+    ngx_str_t xattrs; /* read along with the stat, see rados_xattrs_collect */
     char *key;
+    ngx_str_t object;    /* key, after namespace, locator and snapshot if any are set */
+    ngx_str_t cache_key; /* conf_path, NUL, pool, NUL, 's' or 'o' for striped or not, object; with a stat, content or disk cache */
     ngx_http_rados_connection_t *rados_conn;
+    ngx_http_rados_handle_t *handle; /* cluster handle all ops of the request use */
+    ngx_http_rados_ioctx_t *ioctx;   /* of the handle, NULL for its default ioctx */
+    rados_ioctx_t io;
+#if (NGX_HTTP_RADOS_STRIPER)
+    rados_striper_t striper;
+#endif
 
-    char *iobuffer;
-    size_t buf_len;
-    size_t offset;
-
-    size_t total_read;
+    ngx_http_rados_slot_t *slots;
+    ngx_uint_t nslots;
+    ngx_uint_t fill_slot;
+    ngx_uint_t send_slot;
+    size_t chunk;     /* read size, reads are aligned to it */
+    size_t buf_len;   /* slot size, never more than the body */
+
+    ngx_array_t ranges; /* ngx_http_rados_range_t, in the order they are sent */
+    ngx_uint_t range;   /* range being read */
+    off_t offset;       /* next byte to read */
+    off_t end;          /* one past the last byte of the current range */
+    off_t sent;         /* body bytes handed to the output chain */
+    off_t total;        /* body bytes of all ranges */
+    ngx_str_t boundary; /* closing multipart boundary, empty for one range */
 
-    uint64_t range_start;
-    uint64_t range_end;
     ngx_event_t wev;
-    ngx_msec_t throttle;
-    //ngx_buf_t *buffer;
-    ngx_chain_t chain_link;
-
-    rados_completion_t cb;
-    ngx_uint_t cb_allocated;
+    size_t limit_rate;
+    ngx_http_rados_bucket_t bucket; /* limit_rate tokens of this response */
+    ngx_shm_zone_t *limit_zone;     /* shared limit, NULL if the key was empty */
+    ngx_str_t limit_key;
+    ngx_uint_t readahead;
+    size_t chunk_max;
+
+    u_char *prefetch;     /* first chunk read along with the stat */
+    size_t prefetch_size; /* its buffer size, the read size it was fetched with */
+    int read_flags;       /* rados_read_policy */
+
+    ngx_shm_zone_t *cache_zone; /* content cache the body is sent from */
+    void *cache_pin;            /* its entry, kept in the zone until cleanup */
+
+    ngx_queue_t ops; /* ngx_http_rados_op_t still owned by librados */
+    unsigned done:1;
+    unsigned adaptive:1;
+    unsigned cache_fill:1; /* whole object is read at once to be cached */
+    unsigned striped:1;    /* key names a libradosstriper object */
+    unsigned coalesce:1;   /* reads may be shared with other requests */
+    unsigned want_xattrs:1; /* the stat has to bring the xattrs along */
+    ngx_http_rados_flight_t flight; /* the stat read */
+
+    /* upload: body bytes waiting for a free slot, slots double as write buffers */
+    ngx_chain_t *in;
+    ngx_uint_t inflight;
+    unsigned finishing:1;
+
+    /* rados_max_inflight admission */
+    ngx_shm_zone_t *gate_zone;
+    void *gate;             /* counters of the pool */
+    ngx_uint_t max_inflight;
+    ngx_queue_t gate_link;  /* in rados_conn->waiting while queued */
+    ngx_event_t gate_ev;    /* queue timeout */
+    ngx_msec_t queued_at;
+    ngx_msec_t queue_time;
+    unsigned admitted:1;
+    unsigned waiting:1;
+
+    /* stage timings for logs and rados_stats, in milliseconds */
+    void *stats;            /* record of the pool, NULL without rados_stats */
+    ngx_msec_t start;       /* the request went to the cluster or a cache */
+    ngx_msec_t stat_time;
+    ngx_msec_t first_byte_time;
+    ngx_msec_t read_time;   /* all body reads together */
+    ngx_msec_t read_time_max;
+    ngx_msec_t throttle_time;
+    ngx_uint_t reads;
+    unsigned started:1;
+    unsigned stat_timed:1;
+    unsigned first_byte_timed:1;
 } ngx_http_rados_ctx_t;
 
+static void on_rados_header(ngx_http_rados_ctx_t *state, int success);
+static ngx_int_t rados_start(ngx_http_rados_ctx_t *state);
+static void rados_gate_leave(ngx_http_rados_ctx_t *state);
+static void ngx_http_rados_pump(ngx_http_rados_ctx_t *state);
+static ngx_int_t rados_wait_for_client(ngx_http_request_t *r);
+static void rados_content_cache_store(ngx_http_rados_ctx_t *state, ngx_http_rados_slot_t *slot);
+static void rados_disk_store(ngx_http_rados_ctx_t *state, ngx_http_rados_slot_t *slot);
+static void rados_read_done(ngx_http_rados_ctx_t *state, ngx_http_rados_slot_t *slot,
+    int read, ngx_uint_t lead);
+static size_t rados_chunk_size(ngx_http_rados_ctx_t *state, off_t length);
+static void rados_upload_done(ngx_http_rados_ctx_t *state, int rc);
+
 
-static void free_cb(ngx_http_rados_ctx_t *state) {
-    if(state->cb_allocated) {
-        rados_aio_release(state->cb);
-        state->cb_allocated = 0;
+static ngx_http_rados_op_t *create_op(ngx_http_rados_op_handler_pt handler, ngx_http_rados_ctx_t *state) {
+    ngx_http_rados_op_t *op;
+
+    op = ngx_http_rados_op_create(state->request->connection->log, handler, state);
+    if(op == NULL) {
+        return NULL;
+    }
+
+    op->pending = &state->handle->inflight;
+    state->handle->inflight++;
+
+    if (state->ioctx) {
+        op->io_pending = &state->ioctx->inflight;
+        state->ioctx->inflight++;
     }
+
+    ngx_queue_insert_tail(&state->ops, &op->queue);
+    return op;
 }
 
-static rados_completion_t *create_cb(void (*onCompleteFunction)(rados_completion_t cb, void *arg), ngx_http_rados_ctx_t *state) {
-    free_cb(state);
-    state->cb_allocated = 1;
-    int err = rados_aio_create_completion(state, onCompleteFunction, NULL, &state->cb);
-    if(err < 0) {
-        state->cb_allocated = 0;
-        return NULL;
+static void free_op(ngx_http_rados_op_t *op) {
+    ngx_queue_remove(&op->queue);
+    ngx_http_rados_op_free(op);
+}
+
+/*
+* Destroys least recently used ioctxs that neither a request nor an op uses
+* until the handle is back to NGX_HTTP_RADOS_IOCTX_CACHE of them.
+*/
+static void rados_ioctx_evict(ngx_http_rados_ioctxs_t *ioctxs) {
+    ngx_http_rados_ioctx_t *ioctx;
+    ngx_queue_t *q, *next;
+
+    for (q = ngx_queue_head(&ioctxs->lru);
+         q != ngx_queue_sentinel(&ioctxs->lru) && ioctxs->n > NGX_HTTP_RADOS_IOCTX_CACHE;
+         q = next)
+    {
+        next = ngx_queue_next(q);
+        ioctx = ngx_queue_data(q, ngx_http_rados_ioctx_t, queue);
+
+        if (ioctx->refs || ioctx->inflight) {
+            continue;
+        }
+
+        ngx_queue_remove(q);
+        ngx_rbtree_delete(&ioctxs->tree, &ioctx->sn.node);
+        ioctxs->n--;
+
+#if (NGX_HTTP_RADOS_STRIPER)
+        if (ioctx->striper) {
+            rados_striper_destroy(ioctx->striper);
+        }
+#endif
+        if (ioctx->io) {
+            rados_ioctx_destroy(ioctx->io);
+        }
+
+        ngx_free(ioctx);
     }
-    return state->cb;
 }
 
-static
-void rados_reading_callback(ngx_event_t *wev)
-{
-    dd("IN rados_reading_callback");
+/*
+* Namespace, locator key and snapshot are properties of an ioctx, not of an
+* op, so requests that set any of them use an ioctx of their handle bound to
+* those values. Handles keep such ioctxs for the requests that follow.
+* Returns NGX_HTTP_NOT_FOUND for an unknown snapshot.
+*/
+static ngx_int_t rados_ioctx_acquire(ngx_http_rados_ctx_t *state, ngx_http_rados_loc_conf_t *rados_conf) {
+    ngx_http_request_t *r = state->request;
+    ngx_http_rados_handle_t *handle = state->handle;
+    ngx_http_rados_ioctxs_t *ioctxs;
+    ngx_http_rados_ioctx_t *ioctx;
+    ngx_str_t nspace, locator, snap, key;
+    rados_snap_t snap_id;
+    uint32_t hash;
+    size_t len;
+    u_char *p;
     int err;
-    ngx_http_rados_ctx_t *state = (ngx_http_rados_ctx_t *) wev->data;
 
-    free_cb(state);
+    state->io = handle->io;
+#if (NGX_HTTP_RADOS_STRIPER)
+    state->striper = handle->striper;
+#endif
 
-    if(state->request->connection->write->error) {
-        dd("Connection has been reset by peer");
-        ngx_http_finalize_request(state->request, NGX_DONE);
-        return;
+    len = ngx_strlen(state->key);
+    state->object.data = (u_char *) state->key;
+    state->object.len = len;
+
+    ngx_str_null(&nspace);
+    ngx_str_null(&locator);
+    ngx_str_null(&snap);
+
+    if ((rados_conf->nspace && ngx_http_complex_value(r, rados_conf->nspace, &nspace) != NGX_OK)
+        || (rados_conf->locator && ngx_http_complex_value(r, rados_conf->locator, &locator) != NGX_OK)
+        || (rados_conf->snap && ngx_http_complex_value(r, rados_conf->snap, &snap) != NGX_OK))
+    {
+        return NGX_ERROR;
     }
 
-    rados_completion_t *comp = create_cb(on_aio_complete_body, state);
-    if (comp == NULL) {
-            ngx_log_error(NGX_LOG_DEBUG, state->request->connection->log, 0,
-                                          "Could not create aio completition");
-            ngx_http_finalize_request(state->request, NGX_ERROR);
-            return;
+    if (nspace.len == 0 && locator.len == 0 && snap.len == 0) {
+        return NGX_OK;
     }
 
-    dd("Spawning async rados_aio_read offset: %zd", state->total_read);
-    err = rados_aio_read(state->rados_conn->io, state->key, comp, state->iobuffer, state->buf_len, state->offset);
-    if (err < 0) {
-        free_cb(state);
+    /* librados takes C strings, the NULs also separate the parts of the key */
+    if (ngx_strlchr(nspace.data, nspace.data + nspace.len, '\0')
+        || ngx_strlchr(locator.data, locator.data + locator.len, '\0')
+        || ngx_strlchr(snap.data, snap.data + snap.len, '\0'))
+    {
+        return NGX_HTTP_BAD_REQUEST;
+    }
 
-        ngx_log_error(NGX_LOG_DEBUG, state->request->connection->log, 0,
-                                  "rados_aio_read Failed");
-        ngx_http_finalize_request(state->request, NGX_ERROR);
-        return;
+    /* snapshots are read only */
+    if (snap.len && (r->method & NGX_HTTP_RADOS_UPLOAD_METHODS & rados_conf->upload)) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    key.len = nspace.len + 1 + locator.len + 1 + snap.len;
+    key.data = ngx_pnalloc(r->pool, key.len);
+    if (key.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(key.data, nspace.data, nspace.len);
+    *p++ = '\0';
+    p = ngx_cpymem(p, locator.data, locator.len);
+    *p++ = '\0';
+    ngx_memcpy(p, snap.data, snap.len);
+
+    /* caches and shared reads tell objects apart by this, a key never starts with a NUL */
+    state->object.len = 1 + key.len + 1 + len;
+    state->object.data = ngx_pnalloc(r->pool, state->object.len);
+    if (state->object.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = state->object.data;
+    *p++ = '\0';
+    p = ngx_cpymem(p, key.data, key.len);
+    *p++ = '\0';
+    ngx_memcpy(p, state->key, len);
+
+    ioctxs = handle->ioctxs;
+
+    if (ioctxs == NULL) {
+        ioctxs = ngx_alloc(sizeof(ngx_http_rados_ioctxs_t), ngx_cycle->log);
+        if (ioctxs == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_rbtree_init(&ioctxs->tree, &ioctxs->sentinel, ngx_str_rbtree_insert_value);
+        ngx_queue_init(&ioctxs->lru);
+        ioctxs->n = 0;
+
+        handle->ioctxs = ioctxs;
+    }
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    ioctx = (ngx_http_rados_ioctx_t *) ngx_str_rbtree_lookup(&ioctxs->tree, &key, hash);
+
+    /* the snapshot may exist by now */
+    if (ioctx != NULL && ioctx->io == NULL
+        && ngx_current_msec - ioctx->missed >= NGX_HTTP_RADOS_SNAP_MISS)
+    {
+        ngx_queue_remove(&ioctx->queue);
+        ngx_rbtree_delete(&ioctxs->tree, &ioctx->sn.node);
+        ioctxs->n--;
+        ngx_free(ioctx);
+        ioctx = NULL;
+    }
+
+    if (ioctx != NULL) {
+        ngx_queue_remove(&ioctx->queue);
+
+        if (ioctx->io == NULL) {
+            ngx_queue_insert_tail(&ioctxs->lru, &ioctx->queue);
+            return NGX_HTTP_NOT_FOUND;
+        }
+
+    } else {
+        /* the key is kept NUL terminated so that its parts are C strings */
+        ioctx = ngx_alloc(sizeof(ngx_http_rados_ioctx_t) + key.len + 1, ngx_cycle->log);
+        if (ioctx == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(ioctx, sizeof(ngx_http_rados_ioctx_t));
+
+        ioctx->sn.node.key = hash;
+        ioctx->sn.str.len = key.len;
+        ioctx->sn.str.data = (u_char *) (ioctx + 1);
+        ngx_memcpy(ioctx->sn.str.data, key.data, key.len);
+        ioctx->sn.str.data[key.len] = '\0';
+
+        err = rados_ioctx_create(handle->cluster, (const char *) rados_conf->pool.data, &ioctx->io);
+        if (err < 0) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "Cannot open rados pool %V: %d", &rados_conf->pool, err);
+            ngx_free(ioctx);
+            return NGX_ERROR;
+        }
+
+        p = ioctx->sn.str.data;
+
+        if (nspace.len) {
+            rados_ioctx_set_namespace(ioctx->io, (const char *) p);
+        }
+
+        p += nspace.len + 1;
+
+        if (locator.len) {
+            rados_ioctx_locator_set_key(ioctx->io, (const char *) p);
+        }
+
+        p += locator.len + 1;
+
+        if (snap.len) {
+            err = rados_ioctx_snap_lookup(ioctx->io, (const char *) p, &snap_id);
+            if (err < 0) {
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                              "Snapshot \"%V\" not found in pool %V: %d", &snap, &rados_conf->pool, err);
+                rados_ioctx_destroy(ioctx->io);
+
+                /* kept so that requests naming it do not each look it up again */
+                ioctx->io = NULL;
+                ioctx->missed = ngx_current_msec;
+
+                ngx_rbtree_insert(&ioctxs->tree, &ioctx->sn.node);
+                ngx_queue_insert_tail(&ioctxs->lru, &ioctx->queue);
+                ioctxs->n++;
+
+                rados_ioctx_evict(ioctxs);
+                return NGX_HTTP_NOT_FOUND;
+            }
+
+            rados_ioctx_snap_set_read(ioctx->io, snap_id);
+        }
+
+        ngx_rbtree_insert(&ioctxs->tree, &ioctx->sn.node);
+        ioctxs->n++;
     }
 
+    ngx_queue_insert_tail(&ioctxs->lru, &ioctx->queue);
 
+    ioctx->refs++;
+    state->ioctx = ioctx;
+    state->io = ioctx->io;
+
+    rados_ioctx_evict(ioctxs);
+
+#if (NGX_HTTP_RADOS_STRIPER)
+    if (rados_conf->striper && ioctx->striper == NULL) {
+        err = rados_striper_create(ioctx->io, &ioctx->striper);
+        if (err < 0) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "Cannot create rados striper for pool %V: %d", &rados_conf->pool, err);
+            ioctx->striper = NULL;
+            return NGX_ERROR;
+        }
+    }
+
+    state->striper = ioctx->striper;
+#endif
+
+    return NGX_OK;
 }
 
+/*
+* Striped objects go through libradosstriper, which splits a read into
+* stripe units and fetches them from their objects in parallel.
+* rados_aio_read takes no flags, a read that may go to a replica is
+* sent as a read op, see rados_read_result.
+*/
+static int rados_read(ngx_http_rados_ctx_t *state, ngx_http_rados_op_t *op, u_char *buf, size_t len, off_t offset) {
+#if (NGX_HTTP_RADOS_STRIPER)
+    if (state->striped) {
+        return rados_striper_aio_read(state->striper, state->key, op->completion, (char *) buf, len, offset);
+    }
+#endif
 
-static void on_aio_complete_body(rados_completion_t cb, void *arg){
-    ngx_int_t err;
+    if (state->read_flags == LIBRADOS_OPERATION_NOFLAG) {
+        return rados_aio_read(state->io, state->key, op->completion, (char *) buf, len, offset);
+    }
 
-    ngx_http_rados_ctx_t *state = (ngx_http_rados_ctx_t *) arg;
-    free_cb(state);
+    op->read_op = rados_create_read_op();
+    if (op->read_op == NULL) {
+        return -ENOMEM;
+    }
 
-    ngx_buf_t *buffer;
-    ngx_chain_t out;
+    rados_read_op_read(op->read_op, offset, len, (char *) buf, &op->nread, &op->read_rc);
 
-    if(state->request->connection->write->error) {
-        dd("Connection has been reset by peer");
-        ngx_http_finalize_request(state->request, NGX_DONE);
-        return;
+    return rados_aio_read_op_operate(op->read_op, state->io, op->completion, state->key,
+                                     state->read_flags);
+}
+
+/*
+* Bytes read or the error, whichever way rados_read sent the read.
+*/
+static int rados_read_result(ngx_http_rados_op_t *op) {
+    if (op->read_op == NULL || op->rc < 0) {
+        return op->rc;
     }
 
-    int read = rados_aio_get_return_value(cb);
-    if(read <= 0) {
-        ngx_log_error(NGX_LOG_DEBUG, state->request->connection->log, 0,
-                                      "Rados AIO Read failed");
-        ngx_http_finalize_request(state->request, NGX_ERROR);
-        return;
+    return op->read_rc < 0 ? op->read_rc : (int) op->nread;
+}
+
+static int rados_stat(ngx_http_rados_ctx_t *state, ngx_http_rados_op_t *op) {
+#if (NGX_HTTP_RADOS_STRIPER)
+    if (state->striped) {
+        return rados_striper_aio_stat(state->striper, state->key, op->completion, &op->size, &op->mtime);
+    }
+#endif
+
+    if (!state->want_xattrs && state->read_flags == LIBRADOS_OPERATION_NOFLAG) {
+        return rados_aio_stat(state->io, state->key, op->completion, &op->size, &op->mtime);
+    }
+
+    op->read_op = rados_create_read_op();
+    if (op->read_op == NULL) {
+        return -ENOMEM;
     }
 
-    //dd("on_aio_complete_body returned: %u bytes, current offset: %zd, total_read: %zd, total_size: %zd", read, state->offset, state->total_read, state->size);
+    rados_read_op_stat(op->read_op, &op->size, &op->mtime, NULL);
 
-    /* Allocate a new buffer for sending out the reply. */
-    if(state->chain_link.buf != NULL ){
-        out = state->chain_link;
+    if (state->want_xattrs) {
+        rados_read_op_getxattrs(op->read_op, &op->xattrs, &op->xattrs_rc);
     }
-    if(state->chain_link.buf != NULL) {
-        buffer = state->chain_link.buf;
-    }else {
-        state->chain_link.buf = (ngx_buf_t *) ngx_pcalloc(state->request->pool, sizeof(ngx_buf_t));
-        buffer = state->chain_link.buf;
+
+    return rados_aio_read_op_operate(op->read_op, state->io, op->completion, state->key,
+                                     state->read_flags);
+}
+
+/*
+* Packs the xattrs a stat brought along as 2 byte big endian name length, name,
+* 2 byte value length, value, up to NGX_HTTP_RADOS_XATTRS_MAX bytes.
+*/
+static void rados_xattrs_collect(ngx_http_rados_ctx_t *state, ngx_http_rados_op_t *op) {
+    const char *name, *val;
+    size_t len, name_len;
+    u_char *p, *last;
+
+    if (op->xattrs == NULL || op->xattrs_rc < 0) {
+        return;
     }
-    if(buffer == NULL) {
-        ngx_log_error(NGX_LOG_DEBUG, state->request->connection->log, 0,
-                                      "Could not allocate read buffer");
-        ngx_http_finalize_request(state->request, NGX_ERROR);
+
+    p = ngx_pnalloc(state->request->pool, NGX_HTTP_RADOS_XATTRS_MAX);
+    if (p == NULL) {
         return;
     }
 
-    state->offset += read;
-    state->total_read += read;
+    state->xattrs.data = p;
+    last = p + NGX_HTTP_RADOS_XATTRS_MAX;
+
+    while (rados_getxattrs_next(op->xattrs, &name, &val, &len) == 0 && name != NULL) {
+        name_len = ngx_strlen(name);
+
+        if (4 + name_len + len > (size_t) (last - p)) {
+            ngx_log_error(NGX_LOG_WARN, state->request->connection->log, 0,
+                          "xattr \"%s\" of %s skipped, %uz bytes", name, state->key, len);
+            continue;
+        }
+
+        *p++ = (u_char) (name_len >> 8);
+        *p++ = (u_char) name_len;
+        p = ngx_cpymem(p, name, name_len);
+
+        *p++ = (u_char) (len >> 8);
+        *p++ = (u_char) len;
+        p = ngx_cpymem(p, val, len);
+    }
+
+    state->xattrs.len = p - state->xattrs.data;
+}
+
+/*
+* Finds an xattr read along with the stat. A variable name matches
+* case-insensitively with dashes taken as underscores, like $http_ does.
+*/
+static ngx_int_t rados_xattr_find(ngx_http_rados_ctx_t *state, ngx_str_t *name,
+    ngx_uint_t variable, ngx_str_t *value)
+{
+    u_char *p, *last, c;
+    size_t name_len, i;
+
+    p = state->xattrs.data;
+    last = p + state->xattrs.len;
+
+    while (p < last) {
+        name_len = (p[0] << 8) | p[1];
+        p += 2;
+
+        value->len = (p[name_len] << 8) | p[name_len + 1];
+        value->data = p + name_len + 2;
+
+        if (name_len == name->len) {
+            for (i = 0; i < name_len; i++) {
+                c = p[i];
+
+                if (variable) {
+                    c = ngx_tolower(c);
+                    c = (c == '-') ? '_' : c;
+                }
+
+                if (c != name->data[i]) {
+                    break;
+                }
+            }
+
+            if (i == name_len) {
+                return NGX_OK;
+            }
+        }
+
+        p = value->data + value->len;
+    }
+
+    return NGX_DECLINED;
+}
+
+/*
+* Sends the xattrs a location maps to response headers.
+*/
+static ngx_int_t rados_xattr_headers(ngx_http_rados_ctx_t *state) {
+    ngx_http_request_t *r = state->request;
+    ngx_http_rados_loc_conf_t *rados_conf;
+    ngx_http_rados_xattr_t *xattr;
+    ngx_table_elt_t *h;
+    ngx_str_t value;
+    ngx_uint_t i;
+
+    rados_conf = ngx_http_get_module_loc_conf(r, ngx_http_rados_module);
+
+    if (rados_conf->xattrs == NULL) {
+        return NGX_OK;
+    }
+
+    xattr = rados_conf->xattrs->elts;
+
+    for (i = 0; i < rados_conf->xattrs->nelts; i++) {
+        if (xattr[i].header.len == 0
+            || rados_xattr_find(state, &xattr[i].name, 0, &value) != NGX_OK
+            || value.len == 0)
+        {
+            continue;
+        }
+
+        /* stored by whoever wrote the object, nothing may end the header early */
+        if (ngx_strlchr(value.data, value.data + value.len, '\r')
+            || ngx_strlchr(value.data, value.data + value.len, '\n')
+            || ngx_strlchr(value.data, value.data + value.len, '\0'))
+        {
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                          "xattr \"%V\" of %s is not a valid header value", &xattr[i].name, state->key);
+            continue;
+        }
+
+        if (xattr[i].header.len == sizeof("Content-Type") - 1
+            && ngx_strncasecmp(xattr[i].header.data, (u_char *) "Content-Type", xattr[i].header.len) == 0)
+        {
+            r->headers_out.content_type = value;
+            r->headers_out.content_type_len = value.len;
+            r->headers_out.content_type_lowcase = NULL;
+            continue;
+        }
+
+        h = ngx_list_push(&r->headers_out.headers);
+        if (h == NULL) {
+            return NGX_ERROR;
+        }
+
+        h->hash = 1;
+        h->key = xattr[i].header;
+        h->value = value;
+
+        /* gzip and friends leave an encoded body alone */
+        if (xattr[i].header.len == sizeof("Content-Encoding") - 1
+            && ngx_strncasecmp(xattr[i].header.data, (u_char *) "Content-Encoding", xattr[i].header.len) == 0)
+        {
+            r->headers_out.content_encoding = h;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/*
+* Sets the identity of a read, its key buffer is allocated on first use.
+*/
+static ngx_int_t rados_flight_id(ngx_http_rados_ctx_t *state, ngx_http_rados_flight_t *flight,
+    ngx_uint_t kind, off_t offset, size_t len, size_t size)
+{
+    ngx_http_rados_flight_id_t id;
+
+    if (flight->sn.str.data == NULL) {
+        flight->sn.str.len = sizeof(ngx_http_rados_flight_id_t) + state->object.len;
+        flight->sn.str.data = ngx_pnalloc(state->request->pool, flight->sn.str.len);
+        if (flight->sn.str.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memcpy(flight->sn.str.data + sizeof(ngx_http_rados_flight_id_t),
+                   state->object.data, state->object.len);
+        flight->data = state;
+    }
+
+    /* padding takes part in the comparison */
+    ngx_memzero(&id, sizeof(ngx_http_rados_flight_id_t));
+    id.conn = state->rados_conn;
+    id.offset = offset;
+    id.len = len;
+    id.size = size;
+    id.kind = kind;
+
+    ngx_memcpy(flight->sn.str.data, &id, sizeof(ngx_http_rados_flight_id_t));
+    flight->sn.node.key = ngx_crc32_short(flight->sn.str.data, flight->sn.str.len);
+
+    return NGX_OK;
+}
+
+/*
+* Waits for an identical read already in flight, NGX_DECLINED if there is none.
+*/
+static ngx_int_t rados_flight_join(ngx_http_rados_flight_t *flight) {
+    ngx_http_rados_flight_t *leader;
+
+    leader = (ngx_http_rados_flight_t *) ngx_str_rbtree_lookup(&ngx_http_rados_flights,
+                                                               &flight->sn.str, flight->sn.node.key);
+    if (leader == NULL) {
+        return NGX_DECLINED;
+    }
+
+    flight->leader = leader;
+    ngx_queue_insert_tail(&leader->followers, &flight->link);
+
+    return NGX_OK;
+}
+
+static void rados_flight_lead(ngx_http_rados_flight_t *flight, ngx_http_rados_op_t *op) {
+    flight->op = op;
+    flight->leading = 1;
+    ngx_queue_init(&flight->followers);
+    ngx_rbtree_insert(&ngx_http_rados_flights, &flight->sn.node);
+}
+
+/*
+* The read completed, its followers are moved to the caller's queue.
+*/
+static void rados_flight_land(ngx_http_rados_flight_t *flight, ngx_queue_t *followers) {
+    ngx_queue_t *q;
+    ngx_http_rados_flight_t *f;
+
+    ngx_rbtree_delete(&ngx_http_rados_flights, &flight->sn.node);
+    flight->leading = 0;
+    flight->op = NULL;
+
+    ngx_queue_init(followers);
+
+    if (!ngx_queue_empty(&flight->followers)) {
+        ngx_queue_add(followers, &flight->followers);
+    }
+
+    for (q = ngx_queue_head(followers); q != ngx_queue_sentinel(followers); q = ngx_queue_next(q)) {
+        f = ngx_queue_data(q, ngx_http_rados_flight_t, link);
+        f->leader = NULL;
+    }
+}
+
+/*
+* A request goes away while in a flight. When it led one others wait on, the
+* first of them takes over the op and is returned.
+*/
+static ngx_http_rados_flight_t *rados_flight_leave(ngx_http_rados_flight_t *flight) {
+    ngx_http_rados_flight_t *heir, *f;
+    ngx_http_rados_ctx_t *state;
+    ngx_http_rados_op_t *op;
+    ngx_queue_t *q;
+
+    if (flight->leader != NULL) {
+        ngx_queue_remove(&flight->link);
+        flight->leader = NULL;
+        return NULL;
+    }
+
+    if (!flight->leading) {
+        return NULL;
+    }
+
+    ngx_rbtree_delete(&ngx_http_rados_flights, &flight->sn.node);
+    flight->leading = 0;
+
+    op = flight->op;
+    flight->op = NULL;
+
+    if (ngx_queue_empty(&flight->followers)) {
+        return NULL;
+    }
+
+    q = ngx_queue_head(&flight->followers);
+    ngx_queue_remove(q);
+    heir = ngx_queue_data(q, ngx_http_rados_flight_t, link);
+    heir->leader = NULL;
+
+    rados_flight_lead(heir, op);
+
+    while (!ngx_queue_empty(&flight->followers)) {
+        q = ngx_queue_head(&flight->followers);
+        ngx_queue_remove(q);
+
+        f = ngx_queue_data(q, ngx_http_rados_flight_t, link);
+        f->leader = heir;
+        ngx_queue_insert_tail(&heir->followers, q);
+    }
+
+    state = heir->data;
+    op->data = state;
+    ngx_queue_remove(&op->queue);
+    ngx_queue_insert_tail(&state->ops, &op->queue);
+
+    return heir;
+}
+
+/*
+* Asks the cluster for a positioned slot, or joins a read of the same bytes
+* another request of the worker already has in flight.
+*/
+static ngx_int_t rados_read_slot(ngx_http_rados_ctx_t *state, ngx_http_rados_slot_t *slot) {
+    ngx_http_rados_op_t *op;
+    int err;
+
+    if (state->coalesce) {
+        if (rados_flight_id(state, &slot->flight,
+                            state->striped ? RADOS_FLIGHT_STRIPED_READ : RADOS_FLIGHT_READ,
+                            slot->offset, slot->len, slot->size)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        slot->flight.slot = slot;
+
+        if (rados_flight_join(&slot->flight) == NGX_OK) {
+            dd("Joined read of %s offset: %zd len: %zd", state->key, (size_t) slot->offset, slot->len);
+            return NGX_OK;
+        }
+    }
+
+    op = create_op(on_aio_complete_body, state);
+    if (op == NULL) {
+        ngx_log_error(NGX_LOG_DEBUG, state->request->connection->log, 0,
+                                      "Could not create aio completition");
+        return NGX_ERROR;
+    }
+
+    dd("Spawning async rados_aio_read offset: %zd len: %zd", (size_t) slot->offset, slot->len);
+    err = rados_read(state, op, slot->data, slot->len, slot->offset);
+    if (err < 0) {
+        free_op(op);
+        ngx_log_error(NGX_LOG_DEBUG, state->request->connection->log, 0,
+                                  "rados_aio_read Failed");
+        return NGX_ERROR;
+    }
+
+    slot->op = op;
+
+    if (state->coalesce) {
+        rados_flight_lead(&slot->flight, op);
+    }
+
+    return NGX_OK;
+}
+
+/*
+* A read from the disk cache finished, a chunk that could not be read there
+* is fetched from the cluster.
+*/
+static void rados_disk_read_done(void *data, void *task, ngx_int_t rc) {
+    ngx_http_rados_ctx_t *state = data;
+    ngx_connection_t *c = state->request->connection;
+    ngx_http_rados_slot_t *slot = NULL;
+    ngx_uint_t i;
+
+    for (i = 0; i < state->nslots; i++) {
+        if (state->slots[i].disk == task) {
+            slot = &state->slots[i];
+            break;
+        }
+    }
+
+    if (slot == NULL) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0, "Rados disk cache read completed without a slot");
+        ngx_http_finalize_request(state->request, NGX_ERROR);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    slot->disk = NULL;
+
+    if (rc == NGX_OK) {
+        rados_read_done(state, slot, (int) slot->len, 0);
+        return;
+    }
+
+    if (rados_read_slot(state, slot) != NGX_OK) {
+        ngx_http_finalize_request(state->request, NGX_ERROR);
+        ngx_http_run_posted_requests(c);
+    }
+}
+
+static ngx_int_t spawn_read(ngx_http_rados_ctx_t *state, ngx_http_rados_slot_t *slot) {
+    ngx_http_rados_range_t *range = state->ranges.elts;
+    ngx_http_rados_loc_conf_t *rados_conf;
+    size_t chunk;
+    ngx_int_t rc;
+
+    /* keep reads chunk aligned, so only the first read of a range is short */
+    slot->offset = state->offset;
+    slot->len = state->chunk - (size_t) (state->offset % state->chunk);
+    slot->len = ngx_min((off_t) slot->len, state->end - state->offset);
+    slot->start = ngx_current_msec;
+    slot->part = NULL;
+
+    if (slot->offset == range[state->range].start && range[state->range].header.len) {
+        slot->part = &range[state->range];
+    }
+
+    /* the slot of a prefetched first chunk is smaller than the others */
+    if (slot->size < state->buf_len) {
+        ngx_http_rados_buf_free(slot->data, slot->size);
+
+        slot->size = state->buf_len;
+        slot->data = ngx_http_rados_buf_alloc(slot->size, state->request->connection->log);
+        if (slot->data == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    slot->state = RADOS_SLOT_READING;
+    state->offset += slot->len;
+
+    rados_conf = ngx_http_get_module_loc_conf(state->request, ngx_http_rados_module);
+
+    /* reads are cut at the disk cache's chunks, a slot never spans two of them */
+    if (rados_conf->disk_cache) {
+        chunk = ngx_http_rados_disk_chunk(rados_conf->disk_cache);
+
+        rc = ngx_http_rados_disk_read(rados_conf->disk_cache, &state->cache_key,
+                                      slot->offset / chunk, state->mtime, state->version,
+                                      state->size, slot->offset % chunk, slot->len, slot->data,
+                                      rados_disk_read_done, state,
+                                      state->request->connection->log, &slot->disk);
+        if (rc == NGX_OK) {
+            dd("Reading %s offset: %zd len: %zd from disk", state->key, (size_t) slot->offset, slot->len);
+            return NGX_OK;
+        }
+
+        if (rc == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+    }
+
+    return rados_read_slot(state, slot);
+}
+
+/*
+* Plain GETs fetch the metadata and the first chunk in a single round trip,
+* objects up to one chunk need nothing more from the cluster.
+*/
+static ngx_int_t spawn_stat_read(ngx_http_rados_ctx_t *state) {
+    ngx_http_rados_op_t *op;
+    int err;
+
+    /* the size is not known yet, a small object must not pin a whole chunk */
+    state->prefetch_size = NGX_HTTP_RADOS_MIN_CHUNK;
+
+    if (state->coalesce) {
+        if (rados_flight_id(state, &state->flight,
+                            state->want_xattrs ? RADOS_FLIGHT_STAT_XATTRS_READ : RADOS_FLIGHT_STAT_READ,
+                            0, state->prefetch_size, state->prefetch_size)
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        if (rados_flight_join(&state->flight) == NGX_OK) {
+            dd("Joined stat and read of %s", state->key);
+            return NGX_OK;
+        }
+    }
+
+    op = create_op(on_aio_complete_stat_read, state);
+    if (op == NULL) {
+        ngx_log_error(NGX_LOG_DEBUG, state->request->connection->log, 0,
+                                      "Could not create aio completition");
+        return NGX_ERROR;
+    }
+
+    op->buf = ngx_http_rados_buf_alloc(state->prefetch_size, state->request->connection->log);
+    op->buf_size = state->prefetch_size;
+    op->read_op = rados_create_read_op();
+    if (op->buf == NULL || op->read_op == NULL) {
+        ngx_http_rados_buf_free(op->buf, op->buf_size);
+        free_op(op);
+        return NGX_ERROR;
+    }
+
+    rados_read_op_stat(op->read_op, &op->size, &op->mtime, NULL);
+    rados_read_op_read(op->read_op, 0, state->prefetch_size, (char *) op->buf, &op->nread, &op->read_rc);
+
+    if (state->want_xattrs) {
+        rados_read_op_getxattrs(op->read_op, &op->xattrs, &op->xattrs_rc);
+    }
+
+    dd("Spawning async stat and read of %zd bytes", state->prefetch_size);
+    err = rados_aio_read_op_operate(op->read_op, state->io, op->completion, state->key,
+                                    state->read_flags);
+    if (err < 0) {
+        ngx_http_rados_buf_free(op->buf, op->buf_size);
+        free_op(op);
+        ngx_log_error(NGX_LOG_DEBUG, state->request->connection->log, 0,
+                                  "rados_aio_read_op_operate Failed");
+        return NGX_ERROR;
+    }
+
+    if (state->coalesce) {
+        rados_flight_lead(&state->flight, op);
+    }
+
+    return NGX_OK;
+}
+
+/*
+* Arms the client write event while nginx still holds unsent data, and
+* drops the send timeout once everything has left.
+*/
+static ngx_int_t rados_wait_for_client(ngx_http_request_t *r) {
+    ngx_connection_t *c = r->connection;
+    ngx_event_t *wev = c->write;
+    ngx_http_core_loc_conf_t *clcf;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (r->buffered || r->postponed || c->buffered) {
+        if (!wev->delayed) {
+            ngx_add_timer(wev, clcf->send_timeout);
+        }
+
+        return ngx_handle_write_event(wev, clcf->send_lowat);
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    return NGX_OK;
+}
+
+/*
+* Charges a chunk handed to the client to the response's own bucket and to
+* the shared one, returns how long the next chunk has to wait.
+*/
+static ngx_msec_t rados_throttle(ngx_http_rados_ctx_t *state, size_t len) {
+    ngx_http_rados_loc_conf_t *rados_conf;
+    ngx_msec_t delay, shared;
+
+    rados_conf = ngx_http_get_module_loc_conf(state->request, ngx_http_rados_module);
+
+    delay = 0;
+
+    if (state->limit_rate) {
+        delay = ngx_http_rados_bucket_charge(&state->bucket, state->limit_rate,
+                                             rados_conf->throttle_burst, len);
+    }
+
+    if (state->limit_zone) {
+        shared = ngx_http_rados_limit_take(state->limit_zone, &state->limit_key, len);
+        delay = ngx_max(delay, shared);
+    }
+
+    return delay;
+}
+
+/*
+* Picks the read size for a body of the given length: fixed, or derived from
+* what the cluster delivered recently and spread over the read-ahead ring.
+*/
+static size_t rados_chunk_size(ngx_http_rados_ctx_t *state, off_t length) {
+    ngx_http_rados_loc_conf_t *rados_conf;
+    size_t chunk, spread;
+
+    rados_conf = ngx_http_get_module_loc_conf(state->request, ngx_http_rados_module);
+
+    chunk = rados_conf->buffer_size;
+    state->chunk_max = rados_conf->buffer_size;
+    state->adaptive = rados_conf->buffer_adaptive;
+
+    /* an object headed for the content cache is fetched with a single read */
+    if (state->cache_fill) {
+        state->adaptive = 0;
+        return ngx_align((size_t) length, NGX_HTTP_RADOS_MIN_CHUNK);
+    }
+
+    /* the disk cache stores fixed chunks, reads have to line up with them */
+    if (rados_conf->disk_cache) {
+        state->adaptive = 0;
+        return ngx_http_rados_disk_chunk(rados_conf->disk_cache);
+    }
+
+    if (state->adaptive) {
+        chunk = state->rados_conn->chunk ? state->rados_conn->chunk : NGX_HTTP_RADOS_DEFAULT_CHUNK;
+
+        spread = ngx_align((size_t) (length / state->readahead), NGX_HTTP_RADOS_MIN_CHUNK);
+        chunk = ngx_min(chunk, spread);
+
+        chunk = ngx_max(chunk, NGX_HTTP_RADOS_MIN_CHUNK);
+        chunk = ngx_min(chunk, state->chunk_max);
+    }
+
+    return chunk;
+}
+
+/*
+* Steers the connection's read size towards one whose reads complete in
+* NGX_HTTP_RADOS_ADAPTIVE_LATENCY at the throughput just measured.
+*/
+static void rados_adapt_chunk(ngx_http_rados_ctx_t *state, ngx_http_rados_slot_t *slot) {
+    ngx_http_rados_connection_t *rados_conn = state->rados_conn;
+    ngx_msec_int_t latency;
+    size_t rate, chunk;
+
+    /* short reads at the edges of a range say little about the cluster */
+    if (!state->adaptive || slot->len < state->chunk) {
+        return;
+    }
+
+    latency = (ngx_msec_int_t) (ngx_current_msec - slot->start);
+    if (latency < 1) {
+        latency = 1;
+    }
+
+    rate = slot->len / latency;
+    chunk = rados_conn->chunk ? rados_conn->chunk : NGX_HTTP_RADOS_DEFAULT_CHUNK;
+    chunk = (chunk * 3 + rate * NGX_HTTP_RADOS_ADAPTIVE_LATENCY) / 4;
+
+    chunk = ngx_align(chunk, NGX_HTTP_RADOS_MIN_CHUNK);
+    chunk = ngx_max(chunk, NGX_HTTP_RADOS_MIN_CHUNK);
+    rados_conn->chunk = ngx_min(chunk, state->chunk_max);
+
+    dd("read of %zd bytes took %zdms, next chunk %zd", slot->len, (size_t) latency, rados_conn->chunk);
+}
+
+static ngx_int_t alloc_slots(ngx_http_rados_ctx_t *state) {
+    ngx_uint_t i, chunks;
+    ngx_http_rados_slot_t *slot;
+    ngx_http_rados_range_t *range = state->ranges.elts;
+
+    /* reads never cross a range, so every range takes its own chunks */
+    chunks = 0;
+    for (i = 0; i < state->ranges.nelts; i++) {
+        chunks += (range[i].end - range[i].start + state->chunk - 1) / state->chunk
+                  + (range[i].start % state->chunk ? 1 : 0);
+    }
+    state->nslots = ngx_min(state->readahead, chunks);
+
+    state->slots = ngx_pcalloc(state->request->pool, sizeof(ngx_http_rados_slot_t) * state->nslots);
+    if (state->slots == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < state->nslots; i++) {
+        slot = &state->slots[i];
+
+        slot->buf.memory = 1;
+        slot->link.buf = &slot->buf;
+
+        if (i == 0 && state->prefetch != NULL) {
+            /* the first chunk arrived together with the stat */
+            slot->data = state->prefetch;
+            slot->size = state->prefetch_size;
+            slot->offset = 0;
+            slot->len = (size_t) ngx_min((off_t) state->prefetch_size, state->end);
+            slot->state = RADOS_SLOT_READY;
+
+            state->prefetch = NULL;
+            state->offset = slot->len;
+            state->fill_slot = 1 % state->nslots;
+
+            if (state->cache_fill) {
+                rados_content_cache_store(state, slot);
+            }
+
+            rados_disk_store(state, slot);
+
+            continue;
+        }
+
+        /* worker memory, an orphaned read may still land here after the request is gone */
+        slot->size = state->buf_len;
+        slot->data = ngx_http_rados_buf_alloc(slot->size, state->request->connection->log);
+        if (slot->data == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/*
+* Client write event: flush what nginx still holds and, once slots become
+* free again, let the pump refill them. Mirrors ngx_http_writer().
+*/
+static void
+rados_write_handler(ngx_http_request_t *r)
+{
+    ngx_http_rados_ctx_t *state = ngx_http_get_module_ctx(r, ngx_http_rados_module);
+    ngx_connection_t *c = r->connection;
+    ngx_event_t *wev = c->write;
+    ngx_http_core_loc_conf_t *clcf;
+
+    dd("IN rados_write_handler");
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        c->timedout = 1;
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    if (wev->delayed) {
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+        }
+        return;
+    }
+
+    if (ngx_http_output_filter(r, NULL) == NGX_ERROR) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+        return;
+    }
+
+    if (rados_wait_for_client(r) != NGX_OK) {
+        ngx_http_finalize_request(r, NGX_ERROR);
+        return;
+    }
+
+    ngx_http_rados_pump(state);
+}
+
+static
+void rados_reading_callback(ngx_event_t *wev)
+{
+    dd("IN rados_reading_callback");
+    ngx_http_rados_ctx_t *state = (ngx_http_rados_ctx_t *) wev->data;
+    ngx_connection_t *c = state->request->connection;
+
+    ngx_http_rados_pump(state);
+    ngx_http_run_posted_requests(c);
+}
+
+/*
+* Appends a multipart header or the closing boundary to an output chain.
+*/
+static ngx_int_t rados_chain_str(ngx_http_request_t *r, ngx_chain_t ***ll, ngx_str_t *str, ngx_uint_t last) {
+    ngx_buf_t *b;
+    ngx_chain_t *cl;
+
+    b = ngx_calloc_buf(r->pool);
+    cl = ngx_alloc_chain_link(r->pool);
+    if (b == NULL || cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    b->pos = str->data;
+    b->last = str->data + str->len;
+    b->memory = 1;
+    b->last_buf = last;
+
+    cl->buf = b;
+    cl->next = NULL;
+    **ll = cl;
+    *ll = &cl->next;
+
+    return NGX_OK;
+}
+
+/*
+* Tells whether every read of the body has completed.
+*/
+static ngx_uint_t rados_reads_done(ngx_http_rados_ctx_t *state) {
+    ngx_uint_t i;
+
+    if (state->offset < state->end || state->range + 1 < state->ranges.nelts) {
+        return 0;
+    }
+
+    for (i = 0; i < state->nslots; i++) {
+        if (state->slots[i].state == RADOS_SLOT_READING) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+* Tells whether bytes remain to be requested, stepping into the next range
+* once the current one is fully in flight.
+*/
+static ngx_uint_t rados_next_read(ngx_http_rados_ctx_t *state) {
+    ngx_http_rados_range_t *range = state->ranges.elts;
+
+    if (state->offset < state->end) {
+        return 1;
+    }
+
+    if (state->range + 1 >= state->ranges.nelts) {
+        return 0;
+    }
+
+    state->range++;
+    state->offset = range[state->range].start;
+    state->end = range[state->range].end;
+
+    return 1;
+}
+
+/*
+* Moves the body forward: recycles slots nginx has finished with, hands
+* completed slots to the output chain in order and keeps the ring full.
+*/
+static void ngx_http_rados_pump(ngx_http_rados_ctx_t *state) {
+    ngx_http_request_t *r = state->request;
+    ngx_http_rados_slot_t *slot;
+    ngx_chain_t *out, **ll;
+    ngx_int_t rc;
+
+    if (state->done) {
+        return;
+    }
+
+    if(r->connection->write->error) {
+        dd("Connection has been reset by peer");
+        ngx_http_finalize_request(r, NGX_HTTP_CLIENT_CLOSED_REQUEST);
+        return;
+    }
+
+    out = NULL;
+    ll = &out;
+
+    for ( ;; ) {
+        slot = &state->slots[state->send_slot];
+
+        if (slot->state == RADOS_SLOT_SENDING && ngx_buf_size(&slot->buf) == 0) {
+            slot->state = RADOS_SLOT_FREE;
+        }
+
+        if (slot->state != RADOS_SLOT_READY || state->wev.timer_set) {
+            break;
+        }
+
+        if (slot->part != NULL) {
+            if (rados_chain_str(r, &ll, &slot->part->header, 0) != NGX_OK) {
+                ngx_http_finalize_request(r, NGX_ERROR);
+                return;
+            }
+        }
+
+        slot->buf.pos = slot->data;
+        slot->buf.last = slot->data + slot->len;
+        slot->buf.flush = 1;
+
+        if (!state->first_byte_timed) {
+            state->first_byte_time = ngx_current_msec - state->start;
+            state->first_byte_timed = 1;
+        }
+
+        state->sent += slot->len;
+        slot->buf.last_buf = (state->sent == state->total && state->boundary.len == 0);
+
+        slot->link.next = NULL;
+        *ll = &slot->link;
+        ll = &slot->link.next;
+
+        if (state->sent == state->total && state->boundary.len) {
+            if (rados_chain_str(r, &ll, &state->boundary, 1) != NGX_OK) {
+                ngx_http_finalize_request(r, NGX_ERROR);
+                return;
+            }
+        }
+
+        slot->state = RADOS_SLOT_SENDING;
+        state->send_slot = (state->send_slot + 1) % state->nslots;
+
+        ngx_msec_t throttle = rados_throttle(state, slot->len);
+        if (throttle > 0) {
+            dd("Adding Reading timer, throttling for %zd", (size_t) throttle);
+            state->throttle_time += throttle;
+            ngx_add_timer(&state->wev, throttle);
+        }
+    }
+
+    if (out != NULL) {
+        dd("Writing to http out %zd of %zd", (size_t) state->sent, state->size);
+        rc = ngx_http_output_filter(r, out);
+
+        if (rc == NGX_ERROR) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+            return;
+        }
+
+        if (state->sent == state->total) {
+            dd("Transfer from rados completed");
+            rados_gate_leave(state);
+            state->done = 1;
+            ngx_http_finalize_request(r, rc);
+            return;
+        }
+
+        if (rados_wait_for_client(r) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+            return;
+        }
+    }
+
+    /* slots handed out in earlier rounds may have been sent meanwhile */
+    while (rados_next_read(state)) {
+        slot = &state->slots[state->fill_slot];
+
+        if (slot->state == RADOS_SLOT_SENDING && ngx_buf_size(&slot->buf) == 0) {
+            slot->state = RADOS_SLOT_FREE;
+        }
+
+        if (slot->state != RADOS_SLOT_FREE) {
+            break;
+        }
+
+        if (spawn_read(state, slot) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+            return;
+        }
+
+        state->fill_slot = (state->fill_slot + 1) % state->nslots;
+    }
+
+    /* the rest is up to the client, make room for a queued request */
+    if (state->admitted && rados_reads_done(state)) {
+        rados_gate_leave(state);
+    }
+}
+
+
+static void rados_content_cache_store(ngx_http_rados_ctx_t *state, ngx_http_rados_slot_t *slot) {
+    ngx_http_rados_loc_conf_t *rados_conf;
+    ngx_http_rados_stat_t st;
+
+    rados_conf = ngx_http_get_module_loc_conf(state->request, ngx_http_rados_module);
+
+    ngx_memzero(&st, sizeof(ngx_http_rados_stat_t));
+    st.size = state->size;
+    st.mtime = state->mtime;
+    st.version = state->version;
+
+    ngx_http_rados_content_cache_put(rados_conf->content_cache, &state->cache_key, &st, slot->data, slot->len);
+}
+
+/*
+* Copies a slot holding a whole chunk of the object to the disk cache.
+*/
+static void rados_disk_store(ngx_http_rados_ctx_t *state, ngx_http_rados_slot_t *slot) {
+    ngx_http_rados_loc_conf_t *rados_conf;
+    size_t chunk;
+
+    rados_conf = ngx_http_get_module_loc_conf(state->request, ngx_http_rados_module);
+
+    if (rados_conf->disk_cache == NULL) {
+        return;
+    }
+
+    chunk = ngx_http_rados_disk_chunk(rados_conf->disk_cache);
+
+    if (slot->offset % chunk
+        || (off_t) slot->len != ngx_min((off_t) chunk, (off_t) state->size - slot->offset))
+    {
+        return;
+    }
+
+    ngx_http_rados_disk_store(rados_conf->disk_cache, &state->cache_key, slot->offset / chunk,
+                              state->mtime, state->version, state->size, slot->data, slot->len,
+                              state->request->connection->log);
+}
+
+/*
+* Serves the requested bytes from the content cache when it holds the current
+* version of the object, returns NGX_DECLINED when librados has to be asked.
+*/
+static ngx_int_t rados_content_cache_send(ngx_http_rados_ctx_t *state) {
+    ngx_http_request_t *r = state->request;
+    ngx_http_rados_loc_conf_t *rados_conf;
+    ngx_http_rados_stat_t st;
+    ngx_chain_t out;
+    ngx_buf_t *b;
+    u_char *body;
+    void *pin;
+    ngx_int_t rc;
+
+    rados_conf = ngx_http_get_module_loc_conf(r, ngx_http_rados_module);
+
+    if (rados_conf->content_cache == NULL || state->size > rados_conf->cache_max_object
+        || state->ranges.nelts > 1)
+    {
+        return NGX_DECLINED;
+    }
+
+    ngx_memzero(&st, sizeof(ngx_http_rados_stat_t));
+    st.size = state->size;
+    st.mtime = state->mtime;
+    st.version = state->version;
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL) {
+        return NGX_ERROR;
+    }
+
+    rc = ngx_http_rados_content_cache_pin(rados_conf->content_cache, &state->cache_key, &st,
+                                          state->offset, state->end - state->offset, &body, &pin);
+    if (rc == NGX_DECLINED) {
+        /* only a full read can populate the cache */
+        state->cache_fill = (state->offset == 0 && state->end == (off_t) state->size);
+        return NGX_DECLINED;
+    }
+
+    dd("content cache hit for %s", state->key);
+
+    /* the body goes out of the shared zone itself, cleanup releases the entry */
+    state->cache_zone = rados_conf->content_cache;
+    state->cache_pin = pin;
+
+    b->pos = body;
+    b->last = body + (state->end - state->offset);
+    b->memory = 1;
+    b->last_buf = 1;
+
+    out.buf = b;
+    out.next = NULL;
+
+    state->first_byte_time = ngx_current_msec - state->start;
+    state->first_byte_timed = 1;
+    state->sent = state->end - state->offset;
+    state->done = 1;
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK) {
+        ngx_http_finalize_request(r, rc);
+        return NGX_OK;
+    }
+
+    ngx_http_finalize_request(r, ngx_http_output_filter(r, &out));
+    return NGX_OK;
+}
+
+/*
+* Accounts a completed body read, whether from the cluster, the disk cache or
+* another request's read.
+*/
+static void rados_read_timed(ngx_http_rados_ctx_t *state, ngx_http_rados_slot_t *slot) {
+    ngx_msec_t latency;
+
+    latency = ngx_current_msec - slot->start;
+
+    state->reads++;
+    state->read_time += latency;
+    state->read_time_max = ngx_max(state->read_time_max, latency);
+
+    if (state->stats) {
+        ngx_http_rados_stats_count(state->stats, NGX_HTTP_RADOS_STATS_READS, 1);
+        ngx_http_rados_stats_count(state->stats, NGX_HTTP_RADOS_STATS_READ_BYTES, slot->len);
+        ngx_http_rados_stats_time(state->stats, NGX_HTTP_RADOS_STATS_READ, latency);
+    }
+}
+
+/*
+* A slot's read completed, lead tells whether this worker asked the cluster
+* for it or took the bytes from another request's read.
+*/
+static void rados_read_done(ngx_http_rados_ctx_t *state, ngx_http_rados_slot_t *slot,
+    int read, ngx_uint_t lead)
+{
+    ngx_connection_t *c = state->request->connection;
+
+    if(read < 0 || (size_t) read != slot->len) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "Rados AIO Read failed: %d of %uz bytes at %O", read, slot->len, slot->offset);
+        ngx_http_finalize_request(state->request, NGX_ERROR);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    slot->state = RADOS_SLOT_READY;
+
+    rados_read_timed(state, slot);
+
+    if (lead) {
+        rados_adapt_chunk(state, slot);
+        rados_disk_store(state, slot);
+    }
+
+    if (state->cache_fill) {
+        rados_content_cache_store(state, slot);
+    }
+
+    ngx_http_rados_pump(state);
+    ngx_http_run_posted_requests(c);
+}
+
+static void on_aio_complete_body(ngx_http_rados_op_t *op){
+    ngx_http_rados_ctx_t *state = (ngx_http_rados_ctx_t *) op->data;
+    ngx_connection_t *c = state->request->connection;
+    ngx_http_rados_slot_t *slot = NULL, *fslot;
+    ngx_http_rados_flight_t *f;
+    ngx_queue_t followers, *q;
+    ngx_uint_t i;
+    int read = rados_read_result(op);
+
+    for (i = 0; i < state->nslots; i++) {
+        if (state->slots[i].op == op) {
+            slot = &state->slots[i];
+            break;
+        }
+    }
+
+    free_op(op);
+
+    if (slot == NULL) {
+        ngx_log_error(NGX_LOG_ALERT, c->log, 0, "Rados AIO Read completed without a slot");
+        ngx_http_finalize_request(state->request, NGX_ERROR);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    slot->op = NULL;
+
+    if (!slot->flight.leading) {
+        rados_read_done(state, slot, read, 1);
+        return;
+    }
+
+    rados_flight_land(&slot->flight, &followers);
+
+    /* copied before any request gets to refill the buffer */
+    if (read == (int) slot->len) {
+        for (q = ngx_queue_head(&followers);
+             q != ngx_queue_sentinel(&followers);
+             q = ngx_queue_next(q))
+        {
+            f = ngx_queue_data(q, ngx_http_rados_flight_t, link);
+            fslot = f->slot;
+            ngx_memcpy(fslot->data, slot->data, slot->len);
+        }
+    }
+
+    rados_read_done(state, slot, read, 1);
+
+    while (!ngx_queue_empty(&followers)) {
+        q = ngx_queue_head(&followers);
+        ngx_queue_remove(q);
+
+        f = ngx_queue_data(q, ngx_http_rados_flight_t, link);
+        rados_read_done(f->data, f->slot, read, 0);
+    }
+}
+
+static void rados_stat_cache_update(ngx_http_rados_ctx_t *state, int success) {
+    ngx_http_rados_loc_conf_t *rados_conf;
+    ngx_http_rados_stat_t st;
+
+    rados_conf = ngx_http_get_module_loc_conf(state->request, ngx_http_rados_module);
+
+    if (rados_conf->stat_cache == NULL) {
+        return;
+    }
+
+    ngx_memzero(&st, sizeof(ngx_http_rados_stat_t));
+
+    if (success == -ENOENT) {
+        if (rados_conf->stat_cache_invalid == 0) {
+            return;
+        }
+
+        st.negative = 1;
+        st.xattrs = state->want_xattrs;
+        ngx_http_rados_stat_cache_put(rados_conf->stat_cache, &state->cache_key, &st,
+                                      &state->xattrs, rados_conf->stat_cache_invalid);
+        return;
+    }
+
+    /* transient cluster errors are not worth remembering */
+    if (success < 0 || rados_conf->stat_cache_valid == 0) {
+        return;
+    }
+
+    st.size = state->size;
+    st.mtime = state->mtime;
+    st.version = state->version;
+    st.xattrs = state->want_xattrs;
+    ngx_http_rados_stat_cache_put(rados_conf->stat_cache, &state->cache_key, &st,
+                                  &state->xattrs, rados_conf->stat_cache_valid);
+}
+
+static void on_aio_complete_header(ngx_http_rados_op_t *op){
+    int success;
+    ngx_http_rados_ctx_t *state;
+    ngx_connection_t *c;
+
+    state = (ngx_http_rados_ctx_t *) op->data;
+    c = state->request->connection;
+    success = op->rc;
+    state->size = op->size;
+    state->mtime = op->mtime;
+
+    /* the first stripe's version says nothing about writes to the others */
+    if (!state->striped) {
+        state->version = rados_aio_get_version(op->completion);
+    }
+
+    rados_xattrs_collect(state, op);
+    free_op(op);
+
+    rados_stat_cache_update(state, success);
+    on_rados_header(state, success);
+    ngx_http_run_posted_requests(c);
+}
+
+/*
+* Sets Content-Range for a single range, or the part headers, the closing
+* boundary and the content type of a multipart/byteranges response.
+*/
+static ngx_int_t rados_range_headers(ngx_http_rados_ctx_t *state) {
+    ngx_http_request_t *r = state->request;
+    ngx_http_rados_range_t *range = state->ranges.elts;
+    ngx_table_elt_t *content_range;
+    ngx_atomic_uint_t boundary;
+    ngx_str_t content_type;
+    ngx_uint_t i;
+    size_t len;
+    off_t size;
+
+    if (state->ranges.nelts == 1) {
+        content_range = ngx_list_push(&r->headers_out.headers);
+        if (content_range == NULL) {
+            return NGX_ERROR;
+        }
+
+        r->headers_out.content_range = content_range;
+        content_range->hash = 1;
+        ngx_str_set(&content_range->key, "Content-Range");
+
+        content_range->value.data = ngx_pnalloc(r->pool, sizeof("bytes -/") - 1 + 3 * NGX_OFF_T_LEN);
+        if (content_range->value.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        content_range->value.len = ngx_sprintf(content_range->value.data, "bytes %O-%O/%O",
+                                               range[0].start, range[0].end - 1, (off_t) state->size)
+                                   - content_range->value.data;
+
+        r->headers_out.content_length_n = range[0].end - range[0].start;
+        return NGX_OK;
+    }
+
+    content_type = r->headers_out.content_type;
+    boundary = ngx_next_temp_number(0);
+    size = 0;
+
+    for (i = 0; i < state->ranges.nelts; i++) {
+        len = sizeof(CRLF "--") - 1 + NGX_ATOMIC_T_LEN
+              + sizeof(CRLF "Content-Type: ") - 1 + content_type.len
+              + sizeof(CRLF "Content-Range: bytes -/" CRLF CRLF) - 1 + 3 * NGX_OFF_T_LEN;
+
+        range[i].header.data = ngx_pnalloc(r->pool, len);
+        if (range[i].header.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        u_char *p = ngx_sprintf(range[i].header.data, CRLF "--%0muA", boundary);
+        if (content_type.len) {
+            p = ngx_sprintf(p, CRLF "Content-Type: %V", &content_type);
+        }
+        p = ngx_sprintf(p, CRLF "Content-Range: bytes %O-%O/%O" CRLF CRLF,
+                        range[i].start, range[i].end - 1, (off_t) state->size);
+
+        range[i].header.len = p - range[i].header.data;
+        size += range[i].header.len + range[i].end - range[i].start;
+    }
+
+    state->boundary.data = ngx_pnalloc(r->pool, sizeof(CRLF "--" "--" CRLF) - 1 + NGX_ATOMIC_T_LEN);
+    r->headers_out.content_type.data = ngx_pnalloc(r->pool,
+                                           sizeof("multipart/byteranges; boundary=") - 1 + NGX_ATOMIC_T_LEN);
+    if (state->boundary.data == NULL || r->headers_out.content_type.data == NULL) {
+        return NGX_ERROR;
+    }
+
+    state->boundary.len = ngx_sprintf(state->boundary.data, CRLF "--%0muA--" CRLF, boundary)
+                          - state->boundary.data;
+
+    r->headers_out.content_type_lowcase = NULL;
+    r->headers_out.content_type.len = ngx_sprintf(r->headers_out.content_type.data,
+                                                  "multipart/byteranges; boundary=%0muA", boundary)
+                                      - r->headers_out.content_type.data;
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    r->headers_out.content_length_n = size + state->boundary.len;
+    return NGX_OK;
+}
+
+/*
+* Works out which bytes to send: the whole object, one range, or several
+* ranges sent as multipart/byteranges.
+*/
+static ngx_int_t rados_parse_ranges(ngx_http_rados_ctx_t *state) {
+    ngx_http_request_t *r = state->request;
+    ngx_http_core_loc_conf_t *clcf;
+    ngx_http_rados_range_t *range;
+    ngx_int_t rc;
+    ngx_uint_t i;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (ngx_array_init(&state->ranges, r->pool, 1, sizeof(ngx_http_rados_range_t)) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    rc = NGX_DECLINED;
+
+    /* a resumed download of a changed object gets the whole new one */
+    if (r->headers_in.range && clcf->max_ranges
+        && (r->headers_in.if_range == NULL || ngx_http_test_if_range(r)))
+    {
+        rc = http_parse_range(r, &r->headers_in.range->value, (off_t) state->size,
+                              clcf->max_ranges, &state->ranges);
+    }
+
+    if (rc == NGX_HTTP_RANGE_NOT_SATISFIABLE) {
+        ngx_table_elt_t *content_range = ngx_list_push(&r->headers_out.headers);
+        if (content_range == NULL) {
+            return NGX_ERROR;
+        }
+
+        content_range->hash = 1;
+        ngx_str_set(&content_range->key, "Content-Range");
+
+        content_range->value.data = ngx_pnalloc(r->pool, sizeof("bytes */") - 1 + NGX_OFF_T_LEN);
+        if (content_range->value.data == NULL) {
+            return NGX_ERROR;
+        }
+
+        content_range->value.len = ngx_sprintf(content_range->value.data, "bytes */%O", (off_t) state->size)
+                                   - content_range->value.data;
+        r->headers_out.content_range = content_range;
+        return rc;
+    }
+
+    if (rc == NGX_ERROR) {
+        return rc;
+    }
+
+    if (rc == NGX_DECLINED) {
+        state->ranges.nelts = 0;
+
+        range = ngx_array_push(&state->ranges);
+        if (range == NULL) {
+            return NGX_ERROR;
+        }
+
+        range->start = 0;
+        range->end = state->size;
+        ngx_str_null(&range->header);
+
+        state->total = state->size;
+        r->headers_out.status = NGX_HTTP_OK;
+        r->headers_out.content_length_n = state->size;
+        return NGX_OK;
+    }
+
+    range = state->ranges.elts;
+    for (i = 0; i < state->ranges.nelts; i++) {
+        state->total += range[i].end - range[i].start;
+    }
+
+    dd("Doing range request, %d ranges, %ld bytes", (int) state->ranges.nelts, (long) state->total);
+    r->headers_out.status = NGX_HTTP_PARTIAL_CONTENT;
+
+    return rados_range_headers(state);
+}
+
+/*
+* Slots need to hold the longest single read, reads stay within one chunk
+* and one range.
+*/
+static size_t rados_slot_size(ngx_http_rados_ctx_t *state) {
+    ngx_http_rados_range_t *range = state->ranges.elts;
+    off_t len;
+    ngx_uint_t i;
+
+    len = 0;
+    for (i = 0; i < state->ranges.nelts; i++) {
+        len = ngx_max(len, range[i].end - range[i].start);
+    }
+
+    return (size_t) ngx_min((off_t) state->chunk, len);
+}
+
+/*
+* Takes the stat and the first chunk from a completed stat read, buf is where
+* the chunk landed or NULL for a request that joined the read.
+*/
+static void rados_stat_read_result(ngx_http_rados_ctx_t *state, ngx_http_rados_op_t *op, u_char *buf) {
+    ngx_connection_t *c = state->request->connection;
+
+    state->size = op->size;
+    state->mtime = op->mtime;
+    state->version = rados_aio_get_version(op->completion);
+
+    if (op->rc >= 0 && op->read_rc >= 0
+        && op->nread == ngx_min(state->prefetch_size, state->size))
+    {
+        /* without a copy the chunk is simply read again */
+        if (buf == NULL) {
+            buf = ngx_http_rados_buf_alloc(state->prefetch_size, c->log);
+            if (buf != NULL) {
+                ngx_memcpy(buf, op->buf, op->nread);
+            }
+        }
+
+        state->prefetch = buf;
+
+    } else {
+        if (op->rc >= 0 && buf != NULL) {
+            ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                          "Rados combined read of %s returned %uz bytes, reading again", state->key, op->nread);
+        }
+        ngx_http_rados_buf_free(buf, state->prefetch_size);
+    }
+}
+
+/*
+* Gives a request that joined a stat read the xattrs its leader collected.
+*/
+static void rados_xattrs_copy(ngx_http_rados_ctx_t *state, ngx_str_t *xattrs) {
+    if (xattrs->len == 0) {
+        return;
+    }
+
+    state->xattrs.data = ngx_pstrdup(state->request->pool, xattrs);
+    state->xattrs.len = (state->xattrs.data != NULL) ? xattrs->len : 0;
+}
+
+static void rados_stat_read_done(ngx_http_rados_ctx_t *state, int success) {
+    ngx_connection_t *c = state->request->connection;
+
+    rados_stat_cache_update(state, success);
+    on_rados_header(state, success);
+    ngx_http_run_posted_requests(c);
+}
+
+/*
+* Stat and first chunk issued as one read op: the chunk is kept for the body
+* unless the read came back shorter than the object promised.
+*/
+static void on_aio_complete_stat_read(ngx_http_rados_op_t *op){
+    int success;
+    ngx_http_rados_ctx_t *state;
+    ngx_http_rados_flight_t *f;
+    ngx_queue_t followers, *q;
+    u_char *buf;
+
+    state = (ngx_http_rados_ctx_t *) op->data;
+    success = op->rc;
+
+    ngx_queue_init(&followers);
+
+    if (state->flight.leading) {
+        rados_flight_land(&state->flight, &followers);
+    }
+
+    rados_xattrs_collect(state, op);
+
+    /* followers copy the chunk before the leader may refill its buffer */
+    for (q = ngx_queue_head(&followers);
+         q != ngx_queue_sentinel(&followers);
+         q = ngx_queue_next(q))
+    {
+        f = ngx_queue_data(q, ngx_http_rados_flight_t, link);
+        rados_stat_read_result(f->data, op, NULL);
+        rados_xattrs_copy(f->data, &state->xattrs);
+    }
+
+    buf = op->buf;
+    op->buf = NULL;
+
+    rados_stat_read_result(state, op, buf);
+    free_op(op);
+
+    rados_stat_read_done(state, success);
+
+    while (!ngx_queue_empty(&followers)) {
+        q = ngx_queue_head(&followers);
+        ngx_queue_remove(q);
+
+        f = ngx_queue_data(q, ngx_http_rados_flight_t, link);
+        rados_stat_read_done(f->data, success);
+    }
+}
+
+/*
+* Strong ETag of the object version and size. Without a version, as for
+* striped objects, it is made of mtime and size like nginx does for files.
+*/
+static ngx_int_t rados_set_etag(ngx_http_rados_ctx_t *state) {
+    ngx_http_request_t *r = state->request;
+    ngx_http_core_loc_conf_t *clcf;
+    ngx_table_elt_t *etag;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (!clcf->etag) {
+        return NGX_OK;
+    }
+
+    etag = ngx_list_push(&r->headers_out.headers);
+    if (etag == NULL) {
+        return NGX_ERROR;
+    }
+
+    etag->hash = 1;
+    ngx_str_set(&etag->key, "ETag");
+
+    etag->value.data = ngx_pnalloc(r->pool, NGX_OFF_T_LEN + 1 + NGX_INT64_LEN + 2);
+    if (etag->value.data == NULL) {
+        etag->hash = 0;
+        return NGX_ERROR;
+    }
+
+    if (state->version) {
+        etag->value.len = ngx_sprintf(etag->value.data, "\"%xL-%xO\"",
+                                      state->version, (off_t) state->size)
+                          - etag->value.data;
+
+    } else {
+        etag->value.len = ngx_sprintf(etag->value.data, "\"%xT-%xO\"",
+                                      state->mtime, (off_t) state->size)
+                          - etag->value.data;
+    }
+
+    r->headers_out.etag = etag;
+
+    return NGX_OK;
+}
+
+/*
+* Answers a revalidation that found the client's copy current.
+*/
+static void rados_not_modified(ngx_http_rados_ctx_t *state) {
+    ngx_http_request_t *r = state->request;
+
+    r->headers_out.status = NGX_HTTP_NOT_MODIFIED;
+    ngx_http_clear_content_length(r);
+    ngx_http_clear_accept_ranges(r);
+
+    ngx_http_send_header(r); /* Send the headers */
+    ngx_http_finalize_request(r, NGX_OK);
+}
+
+static void on_rados_header(ngx_http_rados_ctx_t *state, int success) {
+    ngx_http_rados_loc_conf_t *rados_conf;
+    ngx_http_request_t *r = state->request;
+
+    rados_conf = ngx_http_get_module_loc_conf(state->request, ngx_http_rados_module);
+
+    state->stat_time = ngx_current_msec - state->start;
+    state->stat_timed = 1;
+
+    if(success < 0 || !state->size || !state->mtime) {
+        ngx_log_error(NGX_LOG_ERR, state->request->connection->log, 0,
+                                  "File not found in rados: %s", state->key);
+        ngx_str_t error_message = ngx_string("File not found\n");
+        send_status_and_finish_connection(state->request, NGX_HTTP_NOT_FOUND, &error_message, NGX_OK);
+        return;
+    }
+
+    dd("Recieved callback for %s, size: %zd, mtime: %zd\n", state->key, state->size, state->mtime);
+    state->request->headers_out.status = NGX_HTTP_OK;
+    state->request->headers_out.content_length_n = state->size;
+    state->request->headers_out.last_modified_time = state->mtime;
+
+    if (rados_set_etag(state) != NGX_OK || rados_xattr_headers(state) != NGX_OK) {
+        send_status_and_finish_connection(r, NGX_HTTP_INTERNAL_SERVER_ERROR, NULL, NGX_ERROR);
+        return;
+    }
+
+    if (r->headers_in.if_match && !ngx_http_test_if_match(r, r->headers_in.if_match, 0)) {
+        ngx_str_t error_message = ngx_string("Precondition failed\n");
+        send_status_and_finish_connection(r, NGX_HTTP_PRECONDITION_FAILED, &error_message, NGX_OK);
+        return;
+    }
+
+    /* If-None-Match takes precedence, the mtime only has one second resolution */
+    if (r->headers_in.if_none_match) {
+        if (ngx_http_test_if_match(r, r->headers_in.if_none_match, 1)) {
+            rados_not_modified(state);
+            return;
+        }
+
+    } else if (r->headers_in.if_modified_since && !ngx_http_test_if_modified(r)) {
+        rados_not_modified(state);
+        return;
+    }
+
+    if(state->request->method == NGX_HTTP_HEAD) {
+        send_status_and_finish_connection(state->request, NGX_HTTP_OK, NULL, NGX_OK);
+        return;
+    }
+    if(state->request->method != NGX_HTTP_GET) {
+        ngx_str_t error_message = ngx_string("Method not implemented\n");
+        send_status_and_finish_connection(state->request, NGX_HTTP_NOT_IMPLEMENTED, &error_message, NGX_OK);
+        return;
+    }
+
+    switch (rados_parse_ranges(state)) {
+    case NGX_OK:
+        break;
+    case NGX_HTTP_RANGE_NOT_SATISFIABLE: {
+        ngx_log_error(NGX_LOG_INFO, state->request->connection->log, 0,
+                      "Invalid range requested: \"%V\"", &state->request->headers_in.range->value);
+        ngx_str_t error_message = ngx_string("Invalid range in range request\n");
+        send_status_and_finish_connection(state->request, NGX_HTTP_RANGE_NOT_SATISFIABLE, &error_message, NGX_OK);
+        return;
+    }
+    default: {
+        ngx_log_error(NGX_LOG_ERR, state->request->connection->log, 0,
+                      "Failure to allocate memory");
+        ngx_str_t error_message = ngx_string("Failure to allocate memory\n");
+        send_status_and_finish_connection(state->request, NGX_HTTP_INTERNAL_SERVER_ERROR, &error_message, NGX_ERROR);
+        return;
+    }
+    }
+
+    ngx_http_rados_range_t *range = state->ranges.elts;
+
+    state->range = 0;
+    state->offset = range[0].start;
+    state->end = range[0].end;
+
+    /*
+    * A larger object headed for the content cache is read whole, and one the
+    * disk cache keeps is read in its chunks, the first chunk is of no use then.
+    */
+    if (state->prefetch != NULL && state->size > state->prefetch_size
+        && (rados_conf->disk_cache != NULL
+            || (rados_conf->content_cache != NULL
+                && state->size <= rados_conf->cache_max_object)))
+    {
+        ngx_http_rados_buf_free(state->prefetch, state->prefetch_size);
+        state->prefetch = NULL;
+    }
+
+    if (state->prefetch != NULL) {
+        state->cache_fill = (rados_conf->content_cache != NULL
+                             && state->size <= rados_conf->cache_max_object
+                             && state->size <= state->prefetch_size);
+        state->chunk = rados_chunk_size(state, state->end - state->offset);
+
+    } else {
+        switch (rados_content_cache_send(state)) {
+        case NGX_OK:
+            return;
+        case NGX_ERROR:
+            send_status_and_finish_connection(state->request, NGX_HTTP_INTERNAL_SERVER_ERROR, NULL, NGX_ERROR);
+            return;
+        }
+
+        state->chunk = rados_chunk_size(state, state->end - state->offset);
+    }
+    state->buf_len = rados_slot_size(state);
+
+    if(alloc_slots(state) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ALERT, state->request->connection->log, 0,
+                                  "Could not allocate result buffer");
+        ngx_str_t error_message = ngx_string("Could not allocate result buffer\n");
+        send_status_and_finish_connection(state->request, NGX_HTTP_INTERNAL_SERVER_ERROR, &error_message, NGX_ERROR);
+        return;
+    }
+
+    ngx_http_send_header(state->request); /* Send the headers */
+
+    /* notice clients that go away while reads are still in flight */
+    state->request->read_event_handler = ngx_http_test_reading;
+    state->request->write_event_handler = rados_write_handler;
+    ngx_http_rados_pump(state);
+}
+
+/*
+* Uploads: the request body is read unbuffered and copied into slots which
+* are written with rados_aio_write at increasing offsets, at most
+* rados_upload_buffers of them in flight. Reading from the client stops
+* while all slots are busy. Once every write is acknowledged a final write
+* op truncates the object to the uploaded size and stamps its mtime.
+*/
+static void rados_upload_fail(ngx_http_rados_ctx_t *state, ngx_int_t rc) {
+    state->done = 1;
+    ngx_http_finalize_request(state->request, rc);
+}
+
+static ngx_int_t spawn_write(ngx_http_rados_ctx_t *state, ngx_http_rados_slot_t *slot) {
+    ngx_http_rados_op_t *op;
+    int err;
+
+    op = create_op(on_aio_complete_write, state);
+    if (op == NULL) {
+        ngx_log_error(NGX_LOG_DEBUG, state->request->connection->log, 0,
+                                      "Could not create aio completition");
+        return NGX_ERROR;
+    }
+
+    slot->offset = state->offset;
+    slot->start = ngx_current_msec;
+
+    dd("Spawning async rados_aio_write offset: %zd len: %zd", (size_t) slot->offset, slot->len);
+#if (NGX_HTTP_RADOS_STRIPER)
+    if (state->striped) {
+        err = rados_striper_aio_write(state->striper, state->key, op->completion,
+                                      (char *) slot->data, slot->len, slot->offset);
+    } else
+#endif
+    err = rados_aio_write(state->io, state->key, op->completion,
+                          (char *) slot->data, slot->len, slot->offset);
+    if (err < 0) {
+        free_op(op);
+        ngx_log_error(NGX_LOG_ERR, state->request->connection->log, 0,
+                                  "rados_aio_write Failed: %d", err);
+        return NGX_ERROR;
+    }
+
+    slot->op = op;
+    slot->state = RADOS_SLOT_WRITING;
+    state->offset += slot->len;
+    state->inflight++;
+    state->fill_slot = (state->fill_slot + 1) % state->nslots;
+
+    return NGX_OK;
+}
+
+static ngx_int_t spawn_upload_finish(ngx_http_rados_ctx_t *state) {
+    ngx_http_rados_op_t *op;
+    int err;
+
+    state->finishing = 1;
+
+#if (NGX_HTTP_RADOS_STRIPER)
+    /* the striped object was removed up front, the writes left it complete */
+    if (state->striped) {
+        rados_upload_done(state, 0);
+        return NGX_OK;
+    }
+#endif
+
+    op = create_op(on_aio_complete_upload, state);
+    if (op == NULL) {
+        return NGX_ERROR;
+    }
+
+    op->write_op = rados_create_write_op();
+    if (op->write_op == NULL) {
+        free_op(op);
+        return NGX_ERROR;
+    }
+
+    /* an overwritten object may have been longer than the upload */
+    rados_write_op_create(op->write_op, LIBRADOS_CREATE_IDEMPOTENT, NULL);
+    rados_write_op_truncate(op->write_op, state->offset);
+    op->mtime = ngx_time();
+
+    err = rados_aio_write_op_operate(op->write_op, state->io, op->completion, state->key, &op->mtime, 0);
+    if (err < 0) {
+        free_op(op);
+        ngx_log_error(NGX_LOG_ERR, state->request->connection->log, 0,
+                                  "rados_aio_write_op_operate Failed: %d", err);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+static void rados_upload_pump(ngx_http_rados_ctx_t *state) {
+    ngx_http_request_t *r = state->request;
+    ngx_http_rados_slot_t *slot;
+    ngx_buf_t *b;
+    ngx_int_t rc;
+    size_t n;
+
+    if (state->done || state->finishing) {
+        return;
+    }
+
+    for ( ;; ) {
+        while (state->in) {
+            slot = &state->slots[state->fill_slot];
+
+            if (slot->state != RADOS_SLOT_FREE) {
+                break;
+            }
+
+            b = state->in->buf;
+
+            if (b->in_file && !ngx_buf_in_memory(b)) {
+                ngx_log_error(NGX_LOG_ALERT, r->connection->log, 0,
+                              "Rados upload got a request body buffered to file");
+                rados_upload_fail(state, NGX_HTTP_INTERNAL_SERVER_ERROR);
+                return;
+            }
+
+            n = ngx_min((size_t) (b->last - b->pos), state->buf_len - slot->len);
+            ngx_memcpy(slot->data + slot->len, b->pos, n);
+            slot->len += n;
+            b->pos += n;
+
+            if (b->pos == b->last) {
+                state->in = state->in->next;
+            }
+
+            if (slot->len == state->buf_len && spawn_write(state, slot) != NGX_OK) {
+                rados_upload_fail(state, NGX_HTTP_INTERNAL_SERVER_ERROR);
+                return;
+            }
+        }
+
+        if (state->in) {
+            /* every slot is being written, the client waits for the cluster */
+            if (r->connection->read->timer_set) {
+                ngx_del_timer(r->connection->read);
+            }
+            return;
+        }
+
+        if (!r->reading_body) {
+            break;
+        }
+
+        rc = ngx_http_read_unbuffered_request_body(r);
+        if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+            rados_upload_fail(state, rc);
+            return;
+        }
+
+        state->in = r->request_body->bufs;
+        r->request_body->bufs = NULL;
+
+        if (state->in == NULL) {
+            return;
+        }
+    }
+
+    /* the whole body is in slots, write out the last partial one */
+    slot = &state->slots[state->fill_slot];
+
+    if (slot->state == RADOS_SLOT_FREE && slot->len) {
+        if (spawn_write(state, slot) != NGX_OK) {
+            rados_upload_fail(state, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+    }
+
+    if (state->inflight == 0 && spawn_upload_finish(state) != NGX_OK) {
+        rados_upload_fail(state, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    }
+}
+
+static void on_aio_complete_write(ngx_http_rados_op_t *op) {
+    ngx_http_rados_ctx_t *state = (ngx_http_rados_ctx_t *) op->data;
+    ngx_connection_t *c = state->request->connection;
+    ngx_http_rados_slot_t *slot = NULL;
+    ngx_uint_t i;
+    int rc = op->rc;
+
+    for (i = 0; i < state->nslots; i++) {
+        if (state->slots[i].op == op) {
+            slot = &state->slots[i];
+            break;
+        }
+    }
+
+    free_op(op);
+    state->inflight--;
+
+    if (slot == NULL || rc < 0) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0, "Rados AIO Write failed: %d", rc);
+        rados_upload_fail(state, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    slot->op = NULL;
+    slot->len = 0;
+    slot->state = RADOS_SLOT_FREE;
+
+    rados_upload_pump(state);
+    ngx_http_run_posted_requests(c);
+}
+
+static void on_aio_complete_upload(ngx_http_rados_op_t *op) {
+    ngx_http_rados_ctx_t *state = (ngx_http_rados_ctx_t *) op->data;
+    ngx_connection_t *c = state->request->connection;
+    int rc = op->rc;
+
+    free_op(op);
+
+    rados_upload_done(state, rc);
+    ngx_http_run_posted_requests(c);
+}
+
+static void rados_upload_done(ngx_http_rados_ctx_t *state, int rc) {
+    ngx_http_request_t *r = state->request;
+    ngx_http_rados_loc_conf_t *rados_conf;
+
+    if (rc < 0) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "Rados upload of %s could not be completed: %d", state->key, rc);
+        rados_upload_fail(state, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    rados_conf = ngx_http_get_module_loc_conf(r, ngx_http_rados_module);
+
+    if (rados_conf->stat_cache) {
+        ngx_http_rados_cache_delete(rados_conf->stat_cache, &state->cache_key);
+    }
+
+    if (rados_conf->content_cache) {
+        ngx_http_rados_cache_delete(rados_conf->content_cache, &state->cache_key);
+    }
+
+    dd("Upload of %s completed, %zd bytes", state->key, (size_t) state->offset);
+    state->done = 1;
+
+    r->headers_out.content_length_n = 0;
+    ngx_http_finalize_request(r, NGX_HTTP_CREATED);
+}
+
+static void rados_upload_read_handler(ngx_http_request_t *r) {
+    rados_upload_pump(ngx_http_get_module_ctx(r, ngx_http_rados_module));
+}
+
+static void rados_upload_body_handler(ngx_http_request_t *r) {
+    ngx_http_rados_ctx_t *state = ngx_http_get_module_ctx(r, ngx_http_rados_module);
+
+    r->read_event_handler = rados_upload_read_handler;
+
+    state->in = r->request_body ? r->request_body->bufs : NULL;
+    if (r->request_body) {
+        r->request_body->bufs = NULL;
+    }
+
+    rados_upload_pump(state);
+}
+
+static ngx_int_t rados_upload_body(ngx_http_rados_ctx_t *state) {
+    ngx_int_t rc;
+
+    state->request->request_body_no_buffering = 1;
+
+    rc = ngx_http_read_client_request_body(state->request, rados_upload_body_handler);
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        return rc;
+    }
+
+    return NGX_DONE;
+}
+
+#if (NGX_HTTP_RADOS_STRIPER)
+
+static void on_aio_complete_remove(ngx_http_rados_op_t *op) {
+    ngx_http_rados_ctx_t *state = (ngx_http_rados_ctx_t *) op->data;
+    ngx_http_request_t *r = state->request;
+    ngx_connection_t *c = r->connection;
+    int rc = op->rc;
+
+    free_op(op);
+
+    if (rc < 0 && rc != -ENOENT) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0, "Rados striper could not replace %s: %d", state->key, rc);
+        ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+        ngx_http_run_posted_requests(c);
+        return;
+    }
+
+    /* drops the reference taken while the remove was in flight */
+    ngx_http_finalize_request(r, rados_upload_body(state));
+    ngx_http_run_posted_requests(c);
+}
+
+#endif
+
+static ngx_int_t rados_upload_start(ngx_http_rados_ctx_t *state) {
+    ngx_http_request_t *r = state->request;
+    ngx_http_rados_loc_conf_t *rados_conf;
+    ngx_uint_t i;
+
+    rados_conf = ngx_http_get_module_loc_conf(r, ngx_http_rados_module);
+
+    state->buf_len = rados_conf->upload_buffers.size;
+    state->nslots = rados_conf->upload_buffers.num;
+
+    state->slots = ngx_pcalloc(r->pool, sizeof(ngx_http_rados_slot_t) * state->nslots);
+    if (state->slots == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    for (i = 0; i < state->nslots; i++) {
+        /* worker memory, an orphaned write may still read it after the request is gone */
+        state->slots[i].size = state->buf_len;
+        state->slots[i].data = ngx_http_rados_buf_alloc(state->buf_len, r->connection->log);
+        if (state->slots[i].data == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+    }
+
+#if (NGX_HTTP_RADOS_STRIPER)
+    /* striped objects cannot be truncated asynchronously, start afresh instead */
+    if (state->striped) {
+        ngx_http_rados_op_t *op = create_op(on_aio_complete_remove, state);
+        if (op == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        if (rados_striper_aio_remove(state->striper, state->key, op->completion) < 0) {
+            free_op(op);
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        r->main->count++;
+        return NGX_DONE;
+    }
+#endif
+
+    return rados_upload_body(state);
+}
+
+static void
+ngx_http_rados_cleanup(void *data)
+{
+    ngx_http_rados_ctx_t *state = (ngx_http_rados_ctx_t *) data;
+
+    ngx_queue_t *q;
+    ngx_http_rados_op_t *op;
+    ngx_http_rados_slot_t *slot, *fslot;
+    ngx_http_rados_flight_t *heir;
+    ngx_uint_t i;
+    u_char *buf;
+
+    dd("RUNNING CLEANUP FUNCTION");
+
+    if (state->flight.leader != NULL || state->flight.leading) {
+        (void) rados_flight_leave(&state->flight);
+    }
+
+    /* a read still owned by librados takes its buffer along */
+    for (i = 0; i < state->nslots; i++) {
+        slot = &state->slots[i];
+
+        if (slot->disk != NULL) {
+            ngx_http_rados_disk_abandon(slot->disk, slot->data, slot->size);
+            slot->disk = NULL;
+            slot->data = NULL;
+            continue;
+        }
+
+        if (slot->flight.leader != NULL || slot->flight.leading) {
+            heir = rados_flight_leave(&slot->flight);
+
+            /* the request taking over the read trades buffers, both are slot->size */
+            if (heir != NULL) {
+                fslot = heir->slot;
+                fslot->op = slot->op;
+                slot->op = NULL;
+
+                buf = fslot->data;
+                fslot->data = slot->data;
+                slot->data = buf;
+            }
+        }
+
+        if (slot->op != NULL) {
+            slot->op->buf = slot->data;
+            slot->op->buf_size = slot->size;
+
+        } else {
+            ngx_http_rados_buf_free(slot->data, slot->size);
+        }
+
+        slot->data = NULL;
+        slot->op = NULL;
+    }
+
+    if (state->prefetch != NULL) {
+        ngx_http_rados_buf_free(state->prefetch, state->prefetch_size);
+        state->prefetch = NULL;
+    }
+
+    if (state->cache_pin != NULL) {
+        ngx_http_rados_content_cache_unpin(state->cache_zone, state->cache_pin);
+        state->cache_pin = NULL;
+    }
+
+    /* librados still owns these, completions are dropped by the worker */
+    while (!ngx_queue_empty(&state->ops)) {
+        q = ngx_queue_head(&state->ops);
+        ngx_queue_remove(q);
+
+        op = ngx_queue_data(q, ngx_http_rados_op_t, queue);
+        op->data = NULL;
+    }
+
+    if(state->wev.timer_set) {
+        dd("Deleting timer");
+        ngx_del_timer(&state->wev);
+    }
+
+    if (state->waiting) {
+        ngx_queue_remove(&state->gate_link);
+        ngx_http_rados_gate_wait(state->gate_zone, state->gate, -1, 0);
+        state->waiting = 0;
+    }
+
+    if (state->gate_ev.timer_set) {
+        ngx_del_timer(&state->gate_ev);
+    }
+
+    rados_gate_leave(state);
+
+    /* ops still pending on the ioctx keep it from being destroyed */
+    if (state->ioctx) {
+        state->ioctx->refs--;
+        state->ioctx = NULL;
+    }
+
+    if (state->stats && state->started) {
+        ngx_http_rados_stats_count(state->stats, NGX_HTTP_RADOS_STATS_REQUESTS, 1);
+        ngx_http_rados_stats_count(state->stats, NGX_HTTP_RADOS_STATS_BYTES_SENT, state->sent);
+        ngx_http_rados_stats_count(state->stats, NGX_HTTP_RADOS_STATS_THROTTLE_MS,
+                                   state->throttle_time);
+        ngx_http_rados_stats_count(state->stats, NGX_HTTP_RADOS_STATS_QUEUE_MS, state->queue_time);
+
+        if (state->stat_timed) {
+            ngx_http_rados_stats_time(state->stats, NGX_HTTP_RADOS_STATS_STAT, state->stat_time);
+        }
+
+        if (state->first_byte_timed) {
+            ngx_http_rados_stats_time(state->stats, NGX_HTTP_RADOS_STATS_FIRST_BYTE,
+                                      state->first_byte_time);
+        }
+    }
+}
+
+ngx_http_rados_ctx_t *
+ngx_http_rados_create_ctx(ngx_http_request_t *r)
+{
+    ngx_http_rados_ctx_t         *ctx;
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_rados_ctx_t));
+    if (ctx == NULL) {
+        return NULL;
+    }
+
+    ctx->wev.handler   = rados_reading_callback;
+    ctx->wev.data      = ctx;
+    ctx->wev.log       = r->connection->log;
+
+    ngx_queue_init(&ctx->ops);
+    ngx_http_set_ctx(r, ctx, ngx_http_rados_module);
+
+    ngx_http_cleanup_t *cln = ngx_http_cleanup_add(r, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+    cln->handler = ngx_http_rados_cleanup;
+    cln->data = ctx;
+
+    return ctx;
+}
+
+/*
+* Queued requests of the pool are let in, oldest first, as long as there is
+* room. Runs off a timer while any wait, since room made by other workers
+* is not signalled.
+*/
+static void
+rados_gate_admit(ngx_http_rados_connection_t *rados_conn)
+{
+    ngx_queue_t *q;
+    ngx_http_rados_ctx_t *state;
+    ngx_http_request_t *r;
+    ngx_connection_t *c;
+    ngx_msec_t waited;
+
+    while (!ngx_queue_empty(&rados_conn->waiting)) {
+        q = ngx_queue_head(&rados_conn->waiting);
+        state = ngx_queue_data(q, ngx_http_rados_ctx_t, gate_link);
+
+        waited = ngx_current_msec - state->queued_at;
+
+        if (ngx_http_rados_gate_enter(state->gate_zone, state->gate, state->max_inflight, waited)
+            != NGX_OK)
+        {
+            break;
+        }
+
+        ngx_queue_remove(q);
+        ngx_http_rados_gate_wait(state->gate_zone, state->gate, -1, 0);
+
+        if (state->gate_ev.timer_set) {
+            ngx_del_timer(&state->gate_ev);
+        }
+
+        state->waiting = 0;
+        state->admitted = 1;
+        state->queue_time = waited;
+
+        r = state->request;
+        c = r->connection;
+
+        dd("admitted %s after %ums in queue", state->key, (unsigned) waited);
+
+        ngx_http_finalize_request(r, rados_start(state));
+        ngx_http_run_posted_requests(c);
+    }
+
+    if (!ngx_queue_empty(&rados_conn->waiting) && !rados_conn->gate_ev.timer_set) {
+        ngx_add_timer(&rados_conn->gate_ev, NGX_HTTP_RADOS_GATE_POLL);
+    }
+}
+
+static void
+rados_gate_poll(ngx_event_t *ev)
+{
+    rados_gate_admit(ev->data);
+}
+
+static void
+rados_gate_timeout(ngx_event_t *ev)
+{
+    ngx_http_rados_ctx_t *state = ev->data;
+    ngx_http_request_t *r = state->request;
+    ngx_connection_t *c = r->connection;
+
+    ngx_queue_remove(&state->gate_link);
+    ngx_http_rados_gate_wait(state->gate_zone, state->gate, -1, 1);
+
+    state->waiting = 0;
+    state->queue_time = ngx_current_msec - state->queued_at;
+
+    ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                  "rados request for \"%s\" gave up after %M ms in queue",
+                  state->key, state->queue_time);
+
+    ngx_http_finalize_request(r, NGX_HTTP_SERVICE_UNAVAILABLE);
+    ngx_http_run_posted_requests(c);
+}
+
+/*
+* Returns NGX_OK when the request may go to the cluster right away, NGX_DONE
+* when it was queued, or the status to answer with.
+*/
+static ngx_int_t
+rados_gate(ngx_http_rados_ctx_t *state)
+{
+    ngx_http_request_t *r = state->request;
+    ngx_http_rados_loc_conf_t *rados_conf;
+    ngx_http_rados_connection_t *rados_conn = state->rados_conn;
+
+    rados_conf = ngx_http_get_module_loc_conf(r, ngx_http_rados_module);
+
+    state->gate = ngx_http_rados_gate_pool(rados_conf->gate_zone, &rados_conn->sn.str);
+    if (state->gate == NULL) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "rados inflight zone is full, pool \"%V\" is not limited", &rados_conn->pool);
+        return NGX_OK;
+    }
+
+    state->gate_zone = rados_conf->gate_zone;
+    state->max_inflight = rados_conf->max_inflight;
+
+    if (ngx_http_rados_gate_enter(state->gate_zone, state->gate, state->max_inflight,
+                                  NGX_CONF_UNSET_MSEC)
+        == NGX_OK)
+    {
+        state->admitted = 1;
+        return NGX_OK;
+    }
+
+    if (rados_conf->queue_timeout == 0) {
+        ngx_http_rados_gate_wait(state->gate_zone, state->gate, 0, 1);
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    ngx_http_rados_gate_wait(state->gate_zone, state->gate, 1, 0);
+
+    state->waiting = 1;
+    state->queued_at = ngx_current_msec;
+    ngx_queue_insert_tail(&rados_conn->waiting, &state->gate_link);
+
+    state->gate_ev.handler = rados_gate_timeout;
+    state->gate_ev.data = state;
+    state->gate_ev.log = r->connection->log;
+    ngx_add_timer(&state->gate_ev, rados_conf->queue_timeout);
+
+    if (!rados_conn->gate_ev.timer_set) {
+        ngx_add_timer(&rados_conn->gate_ev, NGX_HTTP_RADOS_GATE_POLL);
+    }
+
+    r->main->count++;
+    return NGX_DONE;
+}
+
+/*
+* Gives the request's place back once it no longer needs the cluster, queued
+* requests are let in from a posted event rather than from under the caller.
+*/
+static void
+rados_gate_leave(ngx_http_rados_ctx_t *state)
+{
+    if (!state->admitted) {
+        return;
+    }
+
+    state->admitted = 0;
+    ngx_http_rados_gate_leave(state->gate_zone, state->gate);
+
+    if (!ngx_queue_empty(&state->rados_conn->waiting)) {
+        ngx_post_event(&state->rados_conn->gate_ev, &ngx_posted_events);
+    }
+}
+
+static ngx_int_t
+ngx_http_rados_handler(ngx_http_request_t *request)
+{
+
+    request->request_body_no_buffering = 1;
+    request->buffered = 0;
+
+    ngx_http_rados_loc_conf_t* rados_conf;
+    char* value = NULL;
+    ngx_http_rados_connection_t *rados_conn;
+
+    ngx_int_t rc = NGX_OK;
+
+    rados_conf = ngx_http_get_module_loc_conf(request, ngx_http_rados_module);
+
+    if (!(request->method & NGX_HTTP_RADOS_UPLOAD_METHODS & rados_conf->upload)) {
+        rc = ngx_http_discard_request_body(request);
+        if (rc != NGX_OK)
+            return rc;
+    }
+
+    rados_conn = rados_conf->conn;
+    if(rados_conn == NULL || rados_conn->handles.nelts == 0) {
+        ngx_log_error(NGX_LOG_DEBUG, request->connection->log, 0,
+                          "Rados Connection not found: \"%s\"", &rados_conf->pool);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    rc = nginx_http_get_rados_key(request, rados_conf->key, rados_conf->key_decode, &value);
+    if(rc != NGX_OK)
+        return rc;
+
+    ngx_log_error(NGX_LOG_DEBUG, request->connection->log, 0,
+                              "Request key: \"%s\"", value);
+
+    ngx_http_rados_ctx_t *state = ngx_http_rados_create_ctx(request);
+    if(state == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    state->request = request;
+    state->key = value;
+    state->rados_conn = rados_conn;
+    state->handle = ngx_http_rados_pick_handle(rados_conn);
+    state->readahead = rados_conf->readahead;
+    state->striped = rados_conf->striper;
+    state->coalesce = rados_conf->coalesce;
+    state->read_flags = (int) rados_conf->read_policy;
+    state->stats = rados_conf->stats;
+
+    /* libradosstriper has no asynchronous way to read xattrs */
+    state->want_xattrs = (rados_conf->xattrs != NULL && !rados_conf->striper);
+
+    if (rados_conf->rados_throttle) {
+        state->limit_rate = ngx_http_complex_value_size(request, rados_conf->rados_throttle, 0);
+        state->bucket.tokens = rados_conf->throttle_burst;
+        state->bucket.last = ngx_current_msec;
+    }
+
+    if (rados_conf->limit_zone) {
+        if (rados_conf->limit_key
+            && ngx_http_complex_value(request, rados_conf->limit_key, &state->limit_key) != NGX_OK)
+        {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        /* like limit_req, an empty key leaves the request alone */
+        if (rados_conf->limit_key == NULL
+            || (state->limit_key.len && state->limit_key.len <= 65535))
+        {
+            state->limit_zone = rados_conf->limit_zone;
+        }
+    }
+
+    rc = rados_ioctx_acquire(state, rados_conf);
+    if (rc != NGX_OK) {
+        return rc == NGX_ERROR ? NGX_HTTP_INTERNAL_SERVER_ERROR : rc;
+    }
+
+    if (rados_conf->stat_cache || rados_conf->content_cache || rados_conf->disk_cache) {
+        /*
+         * Zones may be shared by locations of different clusters, and by a
+         * striped and a plain location of one pool, which name different data.
+         */
+        state->cache_key.len = rados_conf->conf_path.len + 1 + rados_conf->pool.len + 1 + 1 + state->object.len;
+        state->cache_key.data = ngx_pnalloc(request->pool, state->cache_key.len);
+        if (state->cache_key.data == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        u_char *p = ngx_cpymem(state->cache_key.data, rados_conf->conf_path.data, rados_conf->conf_path.len);
+        *p++ = '\0';
+        p = ngx_cpymem(p, rados_conf->pool.data, rados_conf->pool.len);
+        *p++ = '\0';
+        *p++ = state->striped ? 's' : 'o';
+        ngx_memcpy(p, state->object.data, state->object.len);
+    }
+
+    if (rados_conf->gate_zone) {
+        rc = rados_gate(state);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
+
+    return rados_start(state);
+}
+
+/*
+* Hands an admitted request to the cluster, returns like a content handler.
+*/
+static ngx_int_t
+rados_start(ngx_http_rados_ctx_t *state)
+{
+    ngx_http_request_t *request = state->request;
+    ngx_http_rados_loc_conf_t *rados_conf;
+
+    rados_conf = ngx_http_get_module_loc_conf(request, ngx_http_rados_module);
+
+    if (request->method & NGX_HTTP_RADOS_UPLOAD_METHODS & rados_conf->upload) {
+        return rados_upload_start(state);
+    }
+
+    state->start = ngx_current_msec;
+    state->started = 1;
+
+    if (rados_conf->stat_cache) {
+        ngx_http_rados_stat_t st;
+        ngx_int_t rc;
+
+        rc = ngx_http_rados_stat_cache_get(rados_conf->stat_cache, &state->cache_key, &st,
+                                           request->pool, &state->xattrs);
+        if (rc == NGX_ERROR) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        /* an entry stored without the xattrs this location sends is no hit */
+        if (rc == NGX_OK && (st.xattrs || !state->want_xattrs)) {
+            dd("stat cache hit for %s", state->key);
+            state->size = st.size;
+            state->mtime = st.mtime;
+            state->version = st.version;
+
+            request->main->count++;
+            on_rados_header(state, st.negative ? -ENOENT : 0);
+            return NGX_DONE;
+        }
+
+        ngx_str_null(&state->xattrs);
+    }
+
+    /*
+    * A striped object spans several rados objects, no single read op covers it.
+    * An object the content cache may hold only needs the stat to be checked.
+    */
+    if (request->method == NGX_HTTP_GET
+        && !state->striped
+        && request->headers_in.range == NULL
+        && request->headers_in.if_modified_since == NULL
+        && request->headers_in.if_none_match == NULL
+        && (rados_conf->content_cache == NULL
+            || ngx_http_rados_content_cache_find(rados_conf->content_cache, &state->cache_key)
+               != NGX_OK))
+    {
+        if (spawn_stat_read(state) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        request->main->count++;
+        return NGX_DONE;
+    }
+
+    ngx_http_rados_op_t *op = create_op(on_aio_complete_header, state);
+    if (op == NULL) {
+            ngx_log_error(NGX_LOG_DEBUG, request->connection->log, 0,
+                                      "Could not create aio completition");
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (rados_stat(state, op) < 0) {
+        free_op(op);
+        ngx_log_error(NGX_LOG_DEBUG, request->connection->log, 0,
+                                  "rados_aio_stat Failed");
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    request->main->count++;
+
+    return NGX_DONE;
+}
+
+
+static ngx_int_t
+ngx_http_rados_handle_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_rados_ctx_t *state;
+    ngx_http_rados_handle_t *handles;
+    ngx_uint_t value;
+    u_char *p;
+
+    state = ngx_http_get_module_ctx(r, ngx_http_rados_module);
+    if (state == NULL || state->handle == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    if (data) {
+        value = state->handle->inflight;
+
+    } else {
+        handles = state->rados_conn->handles.elts;
+        value = state->handle - handles;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%ui", value) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_rados_gate_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_rados_ctx_t *state;
+    ngx_uint_t value, active, waiting;
+    u_char *p;
+
+    state = ngx_http_get_module_ctx(r, ngx_http_rados_module);
+    if (state == NULL || state->gate == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    if (data == 0) {
+        value = state->waiting ? ngx_current_msec - state->queued_at : state->queue_time;
+
+    } else {
+        ngx_http_rados_gate_depth(state->gate_zone, state->gate, &active, &waiting);
+        value = (data == 1) ? waiting : active;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_INT_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    v->len = ngx_sprintf(p, "%ui", value) - p;
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_rados_xattr_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_rados_ctx_t *state;
+    ngx_str_t *name = (ngx_str_t *) data;
+    ngx_str_t xattr, value;
+
+    state = ngx_http_get_module_ctx(r, ngx_http_rados_module);
+    if (state == NULL) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    xattr.len = name->len - (sizeof("rados_xattr_") - 1);
+    xattr.data = name->data + sizeof("rados_xattr_") - 1;
+
+    if (rados_xattr_find(state, &xattr, 1, &value) != NGX_OK) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    v->len = value.len;
+    v->valid = 1;
+    v->no_cacheable = 1;
+    v->not_found = 0;
+    v->data = value.data;
+
+    return NGX_OK;
+}
+
+static ngx_int_t
+ngx_http_rados_time_variable(ngx_http_request_t *r,
+    ngx_http_variable_value_t *v, uintptr_t data)
+{
+    ngx_http_rados_ctx_t *state;
+    ngx_msec_t value;
+    off_t bytes;
+    u_char *p;
+
+    state = ngx_http_get_module_ctx(r, ngx_http_rados_module);
+    if (state == NULL || !state->started) {
+        v->not_found = 1;
+        return NGX_OK;
+    }
+
+    value = 0;
+    bytes = 0;
+
+    switch (data) {
+
+    case 0:
+        if (!state->stat_timed) {
+            v->not_found = 1;
+            return NGX_OK;
+        }
+        value = state->stat_time;
+        break;
+
+    case 1:
+        if (!state->first_byte_timed) {
+            v->not_found = 1;
+            return NGX_OK;
+        }
+        value = state->first_byte_time;
+        break;
+
+    case 2:
+        value = state->reads;
+        break;
+
+    case 3:
+        value = state->reads ? state->read_time / state->reads : 0;
+        break;
+
+    case 4:
+        value = state->read_time_max;
+        break;
+
+    case 5:
+        value = state->throttle_time;
+        break;
+
+    default: /* 6 */
+        bytes = state->sent;
+        break;
+    }
+
+    p = ngx_pnalloc(r->pool, NGX_OFF_T_LEN);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (data == 6) {
+        v->len = ngx_sprintf(p, "%O", bytes) - p;
+
+    } else {
+        v->len = ngx_sprintf(p, "%M", value) - p;
+    }
+
+    v->valid = 1;
+    v->no_cacheable = 0;
+    v->not_found = 0;
+    v->data = p;
+
+    return NGX_OK;
+}
+
+static ngx_http_variable_t  ngx_http_rados_vars[] = {
+
+    /* index of the cluster handle serving the request */
+    { ngx_string("rados_handle"), NULL, ngx_http_rados_handle_variable,
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    /* ops in flight on that handle in this worker, read when logged */
+    { ngx_string("rados_handle_inflight"), NULL, ngx_http_rados_handle_variable,
+      1, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    /* milliseconds the request waited for rados_max_inflight */
+    { ngx_string("rados_queue_time"), NULL, ngx_http_rados_gate_variable,
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    /* requests of the pool waiting and admitted in all workers */
+    { ngx_string("rados_queue_depth"), NULL, ngx_http_rados_gate_variable,
+      1, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("rados_inflight"), NULL, ngx_http_rados_gate_variable,
+      2, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    /* milliseconds from the start to the metadata and to the first body bytes */
+    { ngx_string("rados_stat_time"), NULL, ngx_http_rados_time_variable,
+      0, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("rados_first_byte_time"), NULL, ngx_http_rados_time_variable,
+      1, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    /* body reads, their mean and longest latency in milliseconds */
+    { ngx_string("rados_reads"), NULL, ngx_http_rados_time_variable,
+      2, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("rados_read_time"), NULL, ngx_http_rados_time_variable,
+      3, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    { ngx_string("rados_read_time_max"), NULL, ngx_http_rados_time_variable,
+      4, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    /* milliseconds the body was held back by rados_throttle and rados_limit */
+    { ngx_string("rados_throttle_time"), NULL, ngx_http_rados_time_variable,
+      5, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    /* body bytes handed to the output chain, headers and boundaries aside */
+    { ngx_string("rados_bytes_sent"), NULL, ngx_http_rados_time_variable,
+      6, NGX_HTTP_VAR_NOCACHEABLE, 0 },
+
+    /* $rados_xattr_name, an xattr read along with the stat */
+    { ngx_string("rados_xattr_"), NULL, ngx_http_rados_xattr_variable,
+      0, NGX_HTTP_VAR_NOCACHEABLE|NGX_HTTP_VAR_PREFIX, 0 },
+
+      ngx_http_null_variable
+};
+
+static ngx_int_t
+ngx_http_rados_add_variables(ngx_conf_t *cf)
+{
+    ngx_http_variable_t *var, *v;
+
+    for (v = ngx_http_rados_vars; v->name.len; v++) {
+        var = ngx_http_add_variable(cf, &v->name, v->flags);
+        if (var == NULL) {
+            return NGX_ERROR;
+        }
+
+        var->get_handler = v->get_handler;
+        var->data = v->data;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_rados_init_worker(ngx_cycle_t* cycle) {
+
+    ngx_http_rados_main_conf_t* rados_main_conf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_rados_module);
+    ngx_http_rados_loc_conf_t** rados_loc_confs;
+    ngx_uint_t i;
+
+    /* the cache loader started for rados_disk_cache_path runs this too */
+    if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE) {
+        return NGX_OK;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    if (ngx_http_rados_aio_init(cycle) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    rados_loc_confs = rados_main_conf->loc_confs.elts;
+    ngx_rbtree_init(&ngx_http_rados_connections, &ngx_http_rados_connections_sentinel,
+                    ngx_str_rbtree_insert_value);
+    ngx_rbtree_init(&ngx_http_rados_flights, &ngx_http_rados_flights_sentinel,
+                    ngx_str_rbtree_insert_value);
+
+    /* a location whose cluster is unreachable answers 500, the others keep working */
+    for (i = 0; i < rados_main_conf->loc_confs.nelts; i++) {
+        (void) ngx_http_rados_add_connection(cycle, rados_loc_confs[i]);
+
+        if (rados_loc_confs[i]->gate_zone) {
+            ngx_http_rados_gate_reset(rados_loc_confs[i]->gate_zone);
+        }
+
+        if (rados_loc_confs[i]->content_cache) {
+            ngx_http_rados_content_cache_reset(rados_loc_confs[i]->content_cache);
+        }
+
+        /* a full zone only costs the counters of the location */
+        if (rados_loc_confs[i]->stats_zone) {
+            rados_loc_confs[i]->stats = ngx_http_rados_stats_record(rados_loc_confs[i]->stats_zone,
+                                                                    &rados_loc_confs[i]->pool);
+        }
+    }
+
+    return NGX_OK;
+}
+
+static void ngx_http_rados_exit_worker(ngx_cycle_t* cycle) {
+    ngx_http_rados_aio_done(cycle);
+}
+
+static char *
+ngx_http_rados(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+    ngx_http_rados_loc_conf_t *cglcf = conf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_rados_handler;
+
+    cglcf->enable = 1;
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_rados_buffer_size(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_rados_loc_conf_t *rlcf = conf;
+    ngx_str_t *value;
+    ssize_t size;
+
+    if (rlcf->buffer_size != NGX_CONF_UNSET_SIZE) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+    rlcf->buffer_adaptive = 0;
+
+    if (ngx_strcmp(value[1].data, "auto") == 0) {
+        rlcf->buffer_adaptive = 1;
+
+        if (cf->args->nelts == 2) {
+            rlcf->buffer_size = NGX_HTTP_RADOS_ADAPTIVE_MAX;
+            return NGX_CONF_OK;
+        }
+
+        value++;
+
+    } else if (cf->args->nelts != 2) {
+        return "takes a size or \"auto [max]\"";
+    }
+
+    size = ngx_parse_size(&value[1]);
+    if (size == NGX_ERROR || size < NGX_HTTP_RADOS_MIN_CHUNK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid rados_buffer_size \"%V\", at least 64k is required", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    rlcf->buffer_size = size;
+
+    return NGX_CONF_OK;
+}
+
+/*
+* rados_key value [decode]
+*/
+static char *
+ngx_http_rados_key(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_rados_loc_conf_t *rlcf = conf;
+    ngx_str_t *value;
+    ngx_http_compile_complex_value_t ccv;
+
+    if (rlcf->key != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 3) {
+        if (ngx_strcmp(value[2].data, "decode") != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        rlcf->key_decode = 1;
+    }
+
+    rlcf->key = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+    if (rlcf->key == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[1];
+    ccv.complex_value = rlcf->key;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static char *
+ngx_http_rados_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_shm_zone_t **zone = (ngx_shm_zone_t **) ((char *) conf + cmd->offset);
+    ngx_str_t *value;
+    ssize_t size;
+
+    if (*zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        *zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    size = 0;
+
+    if (cf->args->nelts == 3) {
+        size = ngx_parse_size(&value[2]);
+        if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid %V size \"%V\"", &cmd->name, &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    *zone = ngx_http_rados_cache_add(cf, &value[1], size,
+                                     cmd->offset == offsetof(ngx_http_rados_loc_conf_t, content_cache));
+    if (*zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/*
+* rados_limit_zone name size rate=rate [burst=size]
+*/
+static char *
+ngx_http_rados_limit_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_shm_zone_t *zone;
+    ngx_str_t *value, s;
+    ngx_uint_t i;
+    ssize_t size, rate, burst;
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[2]);
+    if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid %V size \"%V\"", &cmd->name, &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    rate = 0;
+    burst = NGX_ERROR;
+
+    for (i = 3; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "rate=", 5) == 0) {
+            s.data = value[i].data + 5;
+            s.len = value[i].len - 5;
+
+            rate = ngx_parse_size(&s);
+            if (rate == NGX_ERROR || rate == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "burst=", 6) == 0) {
+            s.data = value[i].data + 6;
+            s.len = value[i].len - 6;
+
+            burst = ngx_parse_size(&s);
+            if (burst == NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (rate == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "%V \"%V\" must have \"rate\" parameter", &cmd->name, &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    zone = ngx_http_rados_limit_add(cf, &value[1], size);
+    if (zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* a full bucket lets a second worth of data through at once by default */
+    ngx_http_rados_limit_set(zone, rate, (burst == NGX_ERROR) ? (size_t) rate : (size_t) burst);
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
+
+/*
+* rados_limit name [key] | off
+*/
+static char *
+ngx_http_rados_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_rados_loc_conf_t *rlcf = conf;
+    ngx_str_t *value;
+    ngx_http_compile_complex_value_t ccv;
+
+    if (rlcf->limit_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    rlcf->limit_key = NULL;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        rlcf->limit_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    rlcf->limit_zone = ngx_http_rados_limit_add(cf, &value[1], 0);
+    if (rlcf->limit_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts == 3) {
+        rlcf->limit_key = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+        if (rlcf->limit_key == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+        ccv.cf = cf;
+        ccv.value = &value[2];
+        ccv.complex_value = rlcf->limit_key;
+
+        if (ngx_http_compile_complex_value(&ccv) != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+/*
+* rados_inflight_zone name size
+*/
+static char *
+ngx_http_rados_inflight_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t *value;
+    ssize_t size;
+
+    value = cf->args->elts;
+
+    size = ngx_parse_size(&value[2]);
+    if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid %V size \"%V\"", &cmd->name, &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_rados_gate_add(cf, &value[1], size) == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/*
+* rados_max_inflight zone number | off
+*/
+static char *
+ngx_http_rados_max_inflight(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_rados_loc_conf_t *rlcf = conf;
+    ngx_str_t *value;
+    ngx_int_t n;
+
+    if (rlcf->gate_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (cf->args->nelts == 2) {
+        if (ngx_strcmp(value[1].data, "off") != 0) {
+            return "takes a zone and a number, or \"off\"";
+        }
+
+        rlcf->gate_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    n = ngx_atoi(value[2].data, value[2].len);
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid %V number \"%V\"", &cmd->name, &value[2]);
+        return NGX_CONF_ERROR;
+    }
+
+    rlcf->gate_zone = ngx_http_rados_gate_add(cf, &value[1], 0);
+    if (rlcf->gate_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    rlcf->max_inflight = n;
+
+    return NGX_CONF_OK;
+}
+
+/*
+* rados_disk_cache_path path keys_zone=name:size max_size=size [chunk=size] [threads=pool]
+*/
+static char *
+ngx_http_rados_disk_cache_path(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_shm_zone_t *zone;
+    ngx_str_t *value, s, name, *threads;
+    ngx_uint_t i;
+    ssize_t size, chunk;
+    off_t max_size;
+    u_char *p;
 
-    buffer->pos = (u_char*)state->iobuffer;
-    buffer->last = (u_char*)state->iobuffer + read;
+    value = cf->args->elts;
 
-    buffer->memory = 1;
-    buffer->flush = 1;
+    ngx_str_null(&name);
+    size = 0;
+    max_size = NGX_ERROR;
+    chunk = NGX_HTTP_RADOS_DEFAULT_CHUNK;
+    threads = NULL;
 
-    buffer->last_buf = (state->range_end == state->total_read);
+    for (i = 2; i < cf->args->nelts; i++) {
 
-    out.buf = buffer;
-    out.next = NULL;
+        if (ngx_strncmp(value[i].data, "keys_zone=", 10) == 0) {
+            name.data = value[i].data + 10;
 
-    if(!buffer->last_buf) {
-        dd("Allocating next buffer");
-        ngx_chain_t* out2 = (ngx_chain_t *) ngx_pcalloc(state->request->pool, sizeof(ngx_chain_t));;
-        ngx_buf_t* buf2 = (ngx_buf_t *) ngx_pcalloc(state->request->pool, sizeof(ngx_buf_t));
-        buf2->memory = 1;
-        buf2->flush = 1;
-        out2->buf = buf2;
-        //out.next = out2;
-        state->chain_link = *out2;
-        dd("After");
-    }
+            p = (u_char *) ngx_strchr(name.data, ':');
+            if (p == NULL) {
+                goto invalid;
+            }
 
-    dd("Writing to htt pout %zd of %zd", state->total_read, state->size);
-    printf("================= ngx_http_output_filter ============== \n");
-    ngx_http_output_filter(state->request, &out);
+            name.len = p - name.data;
 
-    if(buffer->last_buf) {
-        dd("Transfer from rados completed");
-        ngx_http_finalize_request(state->request, NGX_OK);
-        return;
-    }else{
-        dd("Transfering from rados: %zd bytes from %zd offset", state->buf_len, state->offset);
-        //call another async, doing async recursion
-        rados_completion_t *comp = create_cb(on_aio_complete_body, state);
-        if (comp == NULL) {
-            ngx_log_error(NGX_LOG_DEBUG, state->request->connection->log, 0,
-                                          "Could not create aio completition");
-            ngx_http_finalize_request(state->request, NGX_ERROR);
-            return;
-        }
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
 
+            size = ngx_parse_size(&s);
+            if (name.len == 0 || size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+                goto invalid;
+            }
 
-        //    /**
-        //    TIMEER TEST
-        //    */
+            continue;
+        }
 
-        if(state->throttle > 0) {
-            dd("Adding Reading timer, throttling to sleep per buffer: %zd", state->throttle);
-               if(state->wev.timer_set) {
-                    dd("Deleting timer");
-                    ngx_del_timer(&state->wev);
-                }
+        if (ngx_strncmp(value[i].data, "max_size=", 9) == 0) {
+            s.data = value[i].data + 9;
+            s.len = value[i].len - 9;
 
-            ngx_add_timer(&state->wev, (ngx_msec_t)state->throttle);
-        } else {
-            dd("Spawning async rados_aio_read offset: %zd", state->total_read);
-            err = rados_aio_read(state->rados_conn->io, state->key, comp, state->iobuffer, state->buf_len, state->offset);
-            if (err < 0) {
-                    free_cb(state);
-                    ngx_log_error(NGX_LOG_DEBUG, state->request->connection->log, 0,
-                                                  "rados_aio_read Failed");
-                    ngx_http_finalize_request(state->request, NGX_ERROR);
-                    return;
+            max_size = ngx_parse_offset(&s);
+            if (max_size < 0) {
+                goto invalid;
             }
+
+            continue;
         }
 
-    }
-}
+        if (ngx_strncmp(value[i].data, "chunk=", 6) == 0) {
+            s.data = value[i].data + 6;
+            s.len = value[i].len - 6;
 
-static void on_aio_complete_header(rados_completion_t cb, void *arg){
-    ngx_int_t err;
-    int success;
-    ngx_http_rados_ctx_t *state;
+            chunk = ngx_parse_size(&s);
+            if (chunk == NGX_ERROR || chunk < NGX_HTTP_RADOS_MIN_CHUNK) {
+                goto invalid;
+            }
 
-    state = (ngx_http_rados_ctx_t *) arg;
-    success = rados_aio_get_return_value(cb);
+            continue;
+        }
 
-    free_cb(state);
+        if (ngx_strncmp(value[i].data, "threads=", 8) == 0) {
+            threads = ngx_palloc(cf->pool, sizeof(ngx_str_t));
+            if (threads == NULL) {
+                return NGX_CONF_ERROR;
+            }
 
-    if(success < 0 || !state->size || !state->mtime) {
-        ngx_log_error(NGX_LOG_ERR, state->request->connection->log, 0,
-                                  "File not found in rados: %s", state->key);
-        ngx_str_t error_message = ngx_string("File not found\n");
-        send_status_and_finish_connection(state->request, NGX_HTTP_NOT_FOUND, &error_message, NGX_OK);
-        return;
-    }
+            threads->data = value[i].data + 8;
+            threads->len = value[i].len - 8;
 
-    dd("Recieved callback for %s, size: %zd, mtime: %zd\n", state->key, state->size, state->mtime);
-    state->request->headers_out.status = NGX_HTTP_OK;
-    state->request->headers_out.content_length_n = state->size;
-    state->request->headers_out.last_modified_time = state->mtime;
+            continue;
+        }
 
-    if(state->request->headers_in.if_modified_since && !ngx_http_test_if_modified(state->request)) {
-        state->request->headers_out.status = NGX_HTTP_NOT_MODIFIED;
-        ngx_http_send_header(state->request); /* Send the headers */
-        ngx_http_finalize_request(state->request, NGX_OK);
-        return;
+        goto invalid;
     }
 
-    if(state->request->method == NGX_HTTP_HEAD) {
-        send_status_and_finish_connection(state->request, NGX_HTTP_OK, NULL, NGX_OK);
-        return;
-    }
-    if(state->request->method != NGX_HTTP_GET) {
-        ngx_str_t error_message = ngx_string("Method not implemented\n");
-        send_status_and_finish_connection(state->request, NGX_HTTP_NOT_IMPLEMENTED, &error_message, NGX_OK);
-        return;
+    if (name.len == 0 || max_size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "%V \"%V\" must have \"keys_zone\" and \"max_size\" parameters",
+                           &cmd->name, &value[1]);
+        return NGX_CONF_ERROR;
     }
 
-    //XXX Range request
-    state->range_start = 0;
-    state->range_end = 0;
-    if (state->request->headers_in.range) {
-        http_parse_range(state->request, &state->request->headers_in.range->value, &state->range_start, &state->range_end, state->size);
+    zone = ngx_http_rados_disk_add(cf, &name, size);
+    if (zone == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    if (state->range_start == 0 && state->range_end == 0) {
-        state->request->headers_out.status = NGX_HTTP_OK;
-        state->request->headers_out.content_length_n = state->size;
-    } else if(state->range_start >= state->size || state->range_end > state->size || state->range_end < state->range_start){
-         ngx_log_error(NGX_LOG_ERR, state->request->connection->log, 0,
-                       "Invalid range requested start: %i end: %i", state->range_start, state->range_end);
-        ngx_str_t error_message = ngx_string("Invalid range in range request\n");
-        send_status_and_finish_connection(state->request, NGX_HTTP_RANGE_NOT_SATISFIABLE, &error_message, NGX_OK);
-        return;
-     } else {
-        dd("Doing range request, range: %ld-%ld", (long)state->range_start, (long)state->range_end);
-
-        state->request->headers_out.status = NGX_HTTP_PARTIAL_CONTENT;
-        state->request->headers_out.content_length_n = state->size;
-
-        ngx_table_elt_t   *content_range = ngx_list_push(&state->request->headers_out.headers);
-        if (content_range == NULL) {
-                 ngx_log_error(NGX_LOG_ERR, state->request->connection->log, 0,
-                               "Failure to do ngx_list_push");
-            ngx_str_t error_message = ngx_string("Failure to do ngx_list_push\n");
-            send_status_and_finish_connection(state->request, NGX_HTTP_BAD_REQUEST, &error_message, NGX_ERROR);
-            return;
-        }
+    /* page multiples, chunks land in the page aligned read buffers */
+    return ngx_http_rados_disk_set(cf, zone, &value[1], max_size,
+                                   ngx_align((size_t) chunk, ngx_pagesize), threads);
 
+invalid:
 
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
 
-        state->request->headers_out.content_range = content_range;
-        content_range->hash = 1;
-        ngx_str_set(&content_range->key, "Content-Range");
-        content_range->value.data = ngx_pnalloc(state->request->pool,sizeof("bytes -/") - 1 + 3 * NGX_OFF_T_LEN);
+/*
+* rados_xattr name [header]
+*/
+static char *
+ngx_http_rados_xattr(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_rados_loc_conf_t *rlcf = conf;
+    ngx_http_rados_xattr_t *xattr;
+    ngx_str_t *value;
 
+    value = cf->args->elts;
 
-        if (content_range->value.data == NULL) {
-                         ngx_log_error(NGX_LOG_ERR, state->request->connection->log, 0,
-                                       "Failure to allocate memory");
-            ngx_str_t error_message = ngx_string("Failure to allocate memory\n");
-            send_status_and_finish_connection(state->request, NGX_HTTP_INTERNAL_SERVER_ERROR, &error_message, NGX_ERROR);
-            return;
+    if (rlcf->xattrs == NULL) {
+        rlcf->xattrs = ngx_array_create(cf->pool, 4, sizeof(ngx_http_rados_xattr_t));
+        if (rlcf->xattrs == NULL) {
+            return NGX_CONF_ERROR;
         }
-        content_range->value.len = ngx_sprintf(content_range->value.data,
-                                             "bytes %O-%O/%O",
-                                             state->range_start, state->range_end,
-                                             state->request->headers_out.content_length_n) - content_range->value.data;
+    }
 
-        state->request->headers_out.content_length_n = state->range_end - state->range_start + 1;
+    xattr = ngx_array_push(rlcf->xattrs);
+    if (xattr == NULL) {
+        return NGX_CONF_ERROR;
     }
 
-    rados_completion_t *comp = create_cb(on_aio_complete_body, state);
-    if (comp == NULL) {
-        free_cb(state);
+    xattr->name = value[1];
 
-        ngx_log_error(NGX_LOG_DEBUG, state->request->connection->log, 0,
-                                  "Could not allocate completition");
-        ngx_str_t error_message = ngx_string("Could not allocate completition\n");
-        send_status_and_finish_connection(state->request, NGX_HTTP_INTERNAL_SERVER_ERROR, &error_message, NGX_ERROR);
-        return;
+    if (cf->args->nelts == 3) {
+        xattr->header = value[2];
+
+    } else {
+        ngx_str_null(&xattr->header);
     }
 
-    state->offset = state->range_start;
-    state->total_read = 0;
-    if(state->range_end == 0 ) state->range_end = state->size;
-    state->buf_len = BUF_LEN;
+    return NGX_CONF_OK;
+}
+
+/*
+* rados_disk_cache name | off
+*/
+static char *
+ngx_http_rados_disk_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_rados_loc_conf_t *rlcf = conf;
+    ngx_str_t *value;
 
-    if(state->size < state->buf_len) {
-        state->buf_len = state->size;
+    if (rlcf->disk_cache != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
     }
 
-    state->iobuffer = ngx_pnalloc(state->request->pool, state->buf_len+1);
-    if(state->iobuffer == NULL) {
-        free_cb(state);
-        ngx_log_error(NGX_LOG_ALERT, state->request->connection->log, 0,
-                                  "Could not allocate result buffer");
-        ngx_str_t error_message = ngx_string("Could not allocate result buffer\n");
-        send_status_and_finish_connection(state->request, NGX_HTTP_INTERNAL_SERVER_ERROR, &error_message, NGX_ERROR);
-        return;
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        rlcf->disk_cache = NULL;
+        return NGX_CONF_OK;
     }
-    dd("Spawning async rados_aio_read");
-    err = rados_aio_read(state->rados_conn->io, state->key, comp, state->iobuffer, state->buf_len, state->offset);
-    if (err < 0) {
-        free_cb(state);
 
-        ngx_log_error(NGX_LOG_DEBUG, state->request->connection->log, 0,
-                                  "rados_aio_read Failed");
-        ngx_str_t error_message = ngx_string("rados_aio_read Failed\n");
-        send_status_and_finish_connection(state->request, NGX_HTTP_INTERNAL_SERVER_ERROR, &error_message, NGX_ERROR);
-        return;
+    rlcf->disk_cache = ngx_http_rados_disk_add(cf, &value[1], 0);
+    if (rlcf->disk_cache == NULL) {
+        return NGX_CONF_ERROR;
     }
-    ngx_http_send_header(state->request); /* Send the headers */
+
+    return NGX_CONF_OK;
 }
 
-static void
-ngx_http_rados_cleanup(void *data)
+/*
+* rados_stats_zone name size
+*/
+static char *
+ngx_http_rados_stats_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_rados_ctx_t *state = (ngx_http_rados_ctx_t *) data;
+    ngx_str_t *value;
+    ssize_t size;
 
-    dd("RUNNING CLEANUP FUNCTION");
+    value = cf->args->elts;
 
-    free_cb(state);
+    size = ngx_parse_size(&value[2]);
+    if (size == NGX_ERROR || size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid %V size \"%V\"", &cmd->name, &value[2]);
+        return NGX_CONF_ERROR;
+    }
 
-   if(state->wev.timer_set) {
-        dd("Deleting timer");
-        ngx_del_timer(&state->wev);
-        return;
+    if (ngx_http_rados_stats_add(cf, &value[1], size) == NULL) {
+        return NGX_CONF_ERROR;
     }
-    state->request->main->count--;
-    dd("Timer not set");
+
+    return NGX_CONF_OK;
 }
 
-ngx_http_rados_ctx_t *
-ngx_http_rados_create_ctx(ngx_http_request_t *r)
+/*
+* rados_stats name | off
+*/
+static char *
+ngx_http_rados_stats(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_rados_ctx_t         *ctx;
+    ngx_http_rados_loc_conf_t *rlcf = conf;
+    ngx_str_t *value;
 
-    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_rados_ctx_t));
-    if (ctx == NULL) {
-        return NULL;
+    if (rlcf->stats_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
     }
 
-    ctx->wev.handler   = rados_reading_callback;
-    ctx->wev.data      = ctx;
-    ctx->wev.log       = r->connection->log;
-
-    ngx_http_cleanup_t *cln = ngx_http_cleanup_add(r, 0);
-    cln->handler = ngx_http_rados_cleanup;
-    cln->data = ctx;
+    value = cf->args->elts;
 
-    return ctx;
-}
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        rlcf->stats_zone = NULL;
+        return NGX_CONF_OK;
+    }
 
-inline static ngx_msec_t compute_throttle(size_t limit) {
-    if(!limit) return (ngx_msec_t)0;
+    rlcf->stats_zone = ngx_http_rados_stats_add(cf, &value[1], 0);
+    if (rlcf->stats_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
-    float buf = BUF_LEN;
-    float bufs_per_second = limit / buf;
-    float sleep = 1000/bufs_per_second;
-    return (ngx_msec_t)sleep;
+    return NGX_CONF_OK;
 }
 
 static ngx_int_t
-ngx_http_rados_handler(ngx_http_request_t *request)
+ngx_http_rados_status_handler(ngx_http_request_t *r)
 {
+    ngx_http_rados_loc_conf_t *rados_conf;
+    ngx_chain_t out;
+    ngx_buf_t *b;
+    ngx_int_t rc;
 
-    request->request_body_no_buffering = 1;
-    request->buffered = 0;
-
-    ngx_http_rados_loc_conf_t* rados_conf;
-    char* value = NULL;
-    ngx_http_rados_connection_t *rados_conn;
-
-    ngx_int_t rc = NGX_OK;
-
-	rc = ngx_http_discard_request_body(request);
-    if (rc != NGX_OK)
-		return rc;
-
-    rados_conf = ngx_http_get_module_loc_conf(request, ngx_http_rados_module);
-
-    rados_conn = ngx_http_get_rados_connection( rados_conf->pool );
-    if(rados_conn == NULL) {
-        ngx_log_error(NGX_LOG_DEBUG, request->connection->log, 0,
-                          "Rados Connection not found: \"%s\"", &rados_conf->pool);
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
     }
 
-    rc = nginx_http_get_rados_key(request, &value);
-    if(rc != NGX_OK)
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK) {
         return rc;
+    }
 
-    ngx_log_error(NGX_LOG_DEBUG, request->connection->log, 0,
-                              "Request key: \"%s\"", value);
+    rados_conf = ngx_http_get_module_loc_conf(r, ngx_http_rados_module);
 
-    ngx_http_rados_ctx_t *state = ngx_http_rados_create_ctx(request);
-    if(state == NULL) {
+    b = ngx_http_rados_stats_render(rados_conf->status_zone, r->pool);
+    if (b == NULL) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    state->request = request;
-    state->key = value;
-    state->rados_conn = rados_conn;
-    state->throttle = compute_throttle(rados_conf->rados_throttle);
+    b->last_buf = (r == r->main);
+    b->last_in_chain = 1;
 
-    rados_completion_t *cb = create_cb(on_aio_complete_header, state);
-    if (cb == NULL) {
-            ngx_log_error(NGX_LOG_DEBUG, request->connection->log, 0,
-                                      "Could not create aio completition");
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    ngx_str_set(&r->headers_out.content_type, "text/plain; version=0.0.4");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
     }
 
-    rados_aio_stat(rados_conn->io, value, cb, &state->size, &state->mtime);
-    request->main->count++;
+    out.buf = b;
+    out.next = NULL;
 
-    return NGX_DONE;
+    return ngx_http_output_filter(r, &out);
 }
 
-
-#define TICK_TIME 10
-
-#if 1
-void ngx_dummy_timer_handler(ngx_event_t *ev)
+/*
+* rados_status name
+*/
+static char *
+ngx_http_rados_status(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-  ngx_add_timer(ev, TICK_TIME);
-}
-#endif
+    ngx_http_rados_loc_conf_t *rlcf = conf;
+    ngx_http_core_loc_conf_t *clcf;
+    ngx_str_t *value;
 
-static ngx_int_t ngx_http_rados_init_worker(ngx_cycle_t* cycle) {
-
-    ngx_http_rados_main_conf_t* rados_main_conf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_rados_module);
-    ngx_http_rados_loc_conf_t** rados_loc_confs;
-    ngx_uint_t i;
-
-    signal(SIGPIPE, SIG_IGN);
-
-#if 1
-   ngx_event_t *ngx_dummy_timer = ngx_pcalloc(cycle->pool, sizeof(ngx_event_t));
-   ngx_dummy_timer->log     = ngx_cycle->log;
-   ngx_dummy_timer->data    = NULL;
-   ngx_dummy_timer->handler = ngx_dummy_timer_handler;
-   ngx_add_timer(ngx_dummy_timer, (ngx_msec_t)TICK_TIME);
-#endif
-
-    rados_loc_confs = rados_main_conf->loc_confs.elts;
-    ngx_array_init(&ngx_http_rados_connections, cycle->pool, 4, sizeof(ngx_http_rados_connection_t));
-
-    for (i = 0; i < rados_main_conf->loc_confs.nelts; i++) {
-        if (ngx_http_rados_add_connection(cycle, rados_loc_confs[i]) == NGX_ERROR) {
-            return NGX_OK;
-        }
+    if (rlcf->status_zone) {
+        return "is duplicate";
     }
 
-    return NGX_OK;
-}
+    value = cf->args->elts;
 
-static char *
-ngx_http_rados(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{
-    ngx_http_core_loc_conf_t  *clcf;
-    ngx_http_rados_loc_conf_t *cglcf = conf;
+    rlcf->status_zone = ngx_http_rados_stats_add(cf, &value[1], 0);
+    if (rlcf->status_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
 
     clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
-    clcf->handler = ngx_http_rados_handler;
-
-    cglcf->enable = 1;
+    clcf->handler = ngx_http_rados_status_handler;
 
     return NGX_CONF_OK;
 }
@@ -661,8 +4429,33 @@ ngx_http_rados_create_loc_conf(ngx_conf_t *cf)
     conf->conf_path.len = 0;
     conf->pool.data = NULL;
     conf->pool.len = 0;
+    conf->key = NGX_CONF_UNSET_PTR;
+    conf->nspace = NGX_CONF_UNSET_PTR;
+    conf->locator = NGX_CONF_UNSET_PTR;
+    conf->snap = NGX_CONF_UNSET_PTR;
     conf->enable = NGX_CONF_UNSET;
-    conf->rados_throttle = NGX_CONF_UNSET;
+    conf->rados_throttle = NGX_CONF_UNSET_PTR;
+    conf->throttle_burst = NGX_CONF_UNSET_SIZE;
+    conf->limit_zone = NGX_CONF_UNSET_PTR;
+    conf->limit_key = NGX_CONF_UNSET_PTR;
+    conf->readahead = NGX_CONF_UNSET_UINT;
+    conf->buffer_size = NGX_CONF_UNSET_SIZE;
+    conf->buffer_adaptive = NGX_CONF_UNSET;
+    conf->stat_cache = NGX_CONF_UNSET_PTR;
+    conf->stat_cache_valid = NGX_CONF_UNSET;
+    conf->stat_cache_invalid = NGX_CONF_UNSET;
+    conf->content_cache = NGX_CONF_UNSET_PTR;
+    conf->disk_cache = NGX_CONF_UNSET_PTR;
+    conf->cache_max_object = NGX_CONF_UNSET_SIZE;
+    conf->striper = NGX_CONF_UNSET;
+    conf->coalesce = NGX_CONF_UNSET;
+    conf->read_policy = NGX_CONF_UNSET_UINT;
+    conf->connections = NGX_CONF_UNSET_UINT;
+    conf->gate_zone = NGX_CONF_UNSET_PTR;
+    conf->max_inflight = NGX_CONF_UNSET_UINT;
+    conf->queue_timeout = NGX_CONF_UNSET_MSEC;
+    conf->stats_zone = NGX_CONF_UNSET_PTR;
+    /* upload and upload_buffers are zeroed by ngx_pcalloc */
     return conf;
 }
 
@@ -677,44 +4470,194 @@ ngx_http_rados_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
 
     ngx_conf_merge_str_value(conf->pool, prev->pool, NULL);
     ngx_conf_merge_str_value(conf->conf_path, prev->conf_path, NULL);
+    if (conf->key == NGX_CONF_UNSET_PTR) {
+        conf->key = (prev->key == NGX_CONF_UNSET_PTR) ? NULL : prev->key;
+        conf->key_decode = prev->key_decode;
+    }
+    ngx_conf_merge_ptr_value(conf->nspace, prev->nspace, NULL);
+    ngx_conf_merge_ptr_value(conf->locator, prev->locator, NULL);
+    ngx_conf_merge_ptr_value(conf->snap, prev->snap, NULL);
     ngx_conf_merge_value(conf->enable, prev->enable, 0);
-    ngx_conf_merge_size_value(conf->rados_throttle, prev->rados_throttle, (size_t)0);
+    ngx_conf_merge_ptr_value(conf->rados_throttle, prev->rados_throttle, NULL);
+    ngx_conf_merge_size_value(conf->throttle_burst, prev->throttle_burst, (size_t)0);
+    if (conf->limit_zone == NGX_CONF_UNSET_PTR) {
+        conf->limit_zone = (prev->limit_zone == NGX_CONF_UNSET_PTR) ? NULL : prev->limit_zone;
+        conf->limit_key = (prev->limit_key == NGX_CONF_UNSET_PTR) ? NULL : prev->limit_key;
+    }
+    ngx_conf_merge_uint_value(conf->readahead, prev->readahead, 1);
+    ngx_conf_merge_value(conf->buffer_adaptive, prev->buffer_adaptive, 0);
+    ngx_conf_merge_size_value(conf->buffer_size, prev->buffer_size, (size_t)NGX_HTTP_RADOS_DEFAULT_CHUNK);
+    ngx_conf_merge_ptr_value(conf->stat_cache, prev->stat_cache, NULL);
+    ngx_conf_merge_sec_value(conf->stat_cache_valid, prev->stat_cache_valid, 60);
+    ngx_conf_merge_sec_value(conf->stat_cache_invalid, prev->stat_cache_invalid, 10);
+    ngx_conf_merge_ptr_value(conf->content_cache, prev->content_cache, NULL);
+    ngx_conf_merge_ptr_value(conf->disk_cache, prev->disk_cache, NULL);
+
+    /* like add_header, a level with rados_xattr of its own inherits none */
+    if (conf->xattrs == NULL) {
+        conf->xattrs = prev->xattrs;
+    }
+    ngx_conf_merge_size_value(conf->cache_max_object, prev->cache_max_object, (size_t)262144);
+    ngx_conf_merge_value(conf->striper, prev->striper, 0);
+    ngx_conf_merge_value(conf->coalesce, prev->coalesce, 0);
+    ngx_conf_merge_uint_value(conf->read_policy, prev->read_policy,
+                              LIBRADOS_OPERATION_NOFLAG);
+    ngx_conf_merge_uint_value(conf->connections, prev->connections, 1);
+    if (conf->gate_zone == NGX_CONF_UNSET_PTR) {
+        conf->gate_zone = (prev->gate_zone == NGX_CONF_UNSET_PTR) ? NULL : prev->gate_zone;
+        conf->max_inflight = prev->max_inflight;
+    }
+    ngx_conf_merge_msec_value(conf->queue_timeout, prev->queue_timeout, 10000);
+    ngx_conf_merge_ptr_value(conf->stats_zone, prev->stats_zone, NULL);
+    ngx_conf_merge_bitmask_value(conf->upload, prev->upload,
+                                 (NGX_CONF_BITMASK_SET|NGX_HTTP_RADOS_UPLOAD_OFF));
+    conf->upload &= NGX_HTTP_RADOS_UPLOAD_METHODS;
+    ngx_conf_merge_bufs_value(conf->upload_buffers, prev->upload_buffers, 4, NGX_HTTP_RADOS_DEFAULT_CHUNK);
+
+#if !(NGX_HTTP_RADOS_STRIPER)
+    if (conf->striper) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "rados_striper requires nginx built with libradosstriper");
+        return NGX_CONF_ERROR;
+    }
+#endif
 
+    if (conf->connections == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "rados_connections must be at least 1");
+        return NGX_CONF_ERROR;
+    }
 
-    if (conf->pool.len == 0 || conf->conf_path.len == 0) {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "rados_pool and rados_conf should be specified");
+    if (conf->readahead == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "rados_readahead must be at least 1");
         return NGX_CONF_ERROR;
-    } else {
-        rados_loc_conf = ngx_array_push(&rados_main_conf->loc_confs);
-        *rados_loc_conf = child;
     }
 
 
     if(conf->enable) {
+        if (conf->pool.len == 0 || conf->conf_path.len == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "rados_pool and rados_conf should be specified");
+            return NGX_CONF_ERROR;
+        }
+
+        /* only locations serving rados need a connection */
+        rados_loc_conf = ngx_array_push(&rados_main_conf->loc_confs);
+        if (rados_loc_conf == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        *rados_loc_conf = child;
+
         ngx_http_rados_init(conf);
     }
 
     return NGX_CONF_OK;
 }
 
-ngx_http_rados_connection_t* ngx_http_get_rados_connection( ngx_str_t name ) {
-    ngx_http_rados_connection_t *rados_conns;
-    ngx_uint_t i;
+/*
+* Builds the connection key, conf_path and pool separated by a NUL byte
+* that neither of them can contain.
+*/
+static ngx_int_t ngx_http_rados_connection_key(ngx_pool_t* pool, ngx_http_rados_loc_conf_t* rados_loc_conf, ngx_str_t* key) {
+    u_char *p;
+
+    key->len = rados_loc_conf->conf_path.len + 1 + rados_loc_conf->pool.len;
+    key->data = ngx_pnalloc(pool, key->len);
+    if (key->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(key->data, rados_loc_conf->conf_path.data, rados_loc_conf->conf_path.len);
+    *p++ = '\0';
+    ngx_memcpy(p, rados_loc_conf->pool.data, rados_loc_conf->pool.len);
+
+    return NGX_OK;
+}
+
+/*
+* Least in-flight handle of the pool, ties are broken round robin so that
+* an idle worker still spreads its requests.
+*/
+static ngx_http_rados_handle_t* ngx_http_rados_pick_handle(ngx_http_rados_connection_t* rados_conn) {
+    ngx_http_rados_handle_t *handles, *best;
+    ngx_uint_t i, n;
 
-    rados_conns = ngx_http_rados_connections.elts;
+    handles = rados_conn->handles.elts;
+    n = rados_conn->handles.nelts;
+    best = &handles[rados_conn->next % n];
 
-    for ( i = 0; i < ngx_http_rados_connections.nelts; i++ ) {
-        if ( name.len == rados_conns[i].pool.len
-             && ngx_strncmp(name.data, rados_conns[i].pool.data, name.len) == 0 ) {
-            return &rados_conns[i];
+    for (i = 1; i < n; i++) {
+        ngx_http_rados_handle_t *h = &handles[(rados_conn->next + i) % n];
+
+        if (h->inflight < best->inflight) {
+            best = h;
         }
     }
 
-    return NULL;
+    rados_conn->next = (best - handles + 1) % n;
+
+    return best;
 }
 
 static ngx_int_t ngx_http_rados_add_connection(ngx_cycle_t* cycle, ngx_http_rados_loc_conf_t* rados_loc_conf) {
     ngx_http_rados_connection_t* rados_conn;
+    ngx_http_rados_handle_t* handles;
+    ngx_str_t key;
+    uint32_t hash;
+    ngx_uint_t i;
+
+    if (ngx_http_rados_connection_key(cycle->pool, rados_loc_conf, &key) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    hash = ngx_crc32_short(key.data, key.len);
+
+    rados_conn = (ngx_http_rados_connection_t *) ngx_str_rbtree_lookup(&ngx_http_rados_connections, &key, hash);
+    if(rados_conn == NULL) {
+        rados_conn = ngx_pcalloc(cycle->pool, sizeof(ngx_http_rados_connection_t));
+        if (rados_conn == NULL) {
+            ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "Could not allocate rados connection");
+            return NGX_ERROR;
+        }
+
+        rados_conn->sn.node.key = hash;
+        rados_conn->sn.str = key;
+        rados_conn->pool = rados_loc_conf->pool;
+
+        ngx_queue_init(&rados_conn->waiting);
+        rados_conn->gate_ev.handler = rados_gate_poll;
+        rados_conn->gate_ev.data = rados_conn;
+        rados_conn->gate_ev.log = cycle->log;
+        rados_conn->gate_ev.cancelable = 1;
+
+        if (ngx_array_init(&rados_conn->handles, cycle->pool, rados_loc_conf->connections,
+                           sizeof(ngx_http_rados_handle_t))
+            != NGX_OK)
+        {
+            return NGX_ERROR;
+        }
+
+        ngx_rbtree_insert(&ngx_http_rados_connections, &rados_conn->sn.node);
+    }
+
+    rados_loc_conf->conn = rados_conn;
+
+    /* locations sharing a pool get the most handles any of them asked for */
+    while (rados_conn->handles.nelts < rados_loc_conf->connections) {
+        if (ngx_http_rados_add_handle(cycle, rados_conn, rados_loc_conf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    handles = rados_conn->handles.elts;
+    for (i = 0; i < rados_conn->handles.nelts; i++) {
+        if (ngx_http_rados_add_striper(cycle, &handles[i], rados_loc_conf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_rados_add_handle(ngx_cycle_t* cycle, ngx_http_rados_connection_t* rados_conn, ngx_http_rados_loc_conf_t* rados_loc_conf) {
+    ngx_http_rados_handle_t* handle;
     //ngx_uint_t status;
     ngx_int_t err;
 
@@ -724,47 +4667,68 @@ static ngx_int_t ngx_http_rados_add_connection(ngx_cycle_t* cycle, ngx_http_rado
     ngx_cpystrn( conf, rados_loc_conf->conf_path.data, rados_loc_conf->conf_path.len + 1 );
     ngx_cpystrn( pool, rados_loc_conf->pool.data, rados_loc_conf->pool.len + 1 );
 
-    rados_conn = ngx_http_get_rados_connection(rados_loc_conf->pool);
-    if(rados_conn != NULL) {
-        return NGX_OK;
-    }
-
-    rados_conn = ngx_array_push(&ngx_http_rados_connections);
-    if (rados_conn == NULL) {
+    handle = ngx_array_push(&rados_conn->handles);
+    if (handle == NULL) {
         ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "Could not allocate rados connection");
         return NGX_ERROR;
     }
 
-    rados_conn->pool = rados_loc_conf->pool;
+    ngx_memzero(handle, sizeof(ngx_http_rados_handle_t));
 
     ngx_log_error(NGX_LOG_DEBUG, cycle->log, 0, "Initing cluster");
-    err = rados_create(&rados_conn->cluster, NULL);
+    err = rados_create(&handle->cluster, NULL);
     if (err < 0) {
         ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "Could not init cluster handle");
+        rados_conn->handles.nelts--;
         return NGX_ERROR;
     }
 
     ngx_log_error(NGX_LOG_DEBUG, cycle->log, 0, "Reading conf: %s", conf);
-    err = rados_conf_read_file(rados_conn->cluster, (const char *)conf);
+    err = rados_conf_read_file(handle->cluster, (const char *)conf);
     if (err < 0) {
         ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "Could not load cluster config: %s", conf);
+        rados_shutdown(handle->cluster);
+        rados_conn->handles.nelts--;
         return NGX_ERROR;
     }
 
     ngx_log_error(NGX_LOG_DEBUG, cycle->log, 0, "Connecting cluster");
-    err = rados_connect(rados_conn->cluster);
+    err = rados_connect(handle->cluster);
     if (err < 0) {
         ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "Cannot connect to cluster");
+        rados_shutdown(handle->cluster);
+        rados_conn->handles.nelts--;
         return NGX_ERROR;
     }
 
     ngx_log_error(NGX_LOG_DEBUG, cycle->log, 0, "Opening io: %s", pool);
-    err = rados_ioctx_create(rados_conn->cluster, (const char *)pool, &rados_conn->io);
+    err = rados_ioctx_create(handle->cluster, (const char *)pool, &handle->io);
     if (err < 0) {
         ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "Cannot open rados pool");
-        rados_shutdown(rados_conn->cluster);
-        return err;
+        rados_shutdown(handle->cluster);
+        rados_conn->handles.nelts--;
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_rados_add_striper(ngx_cycle_t* cycle, ngx_http_rados_handle_t* handle, ngx_http_rados_loc_conf_t* rados_loc_conf) {
+#if (NGX_HTTP_RADOS_STRIPER)
+    ngx_int_t err;
+
+    if (!rados_loc_conf->striper || handle->striper != NULL) {
+        return NGX_OK;
+    }
+
+    ngx_log_error(NGX_LOG_DEBUG, cycle->log, 0, "Creating striper: %V", &rados_loc_conf->pool);
+    err = rados_striper_create(handle->io, &handle->striper);
+    if (err < 0) {
+        ngx_log_error(NGX_LOG_ERR, cycle->log, 0, "Cannot create rados striper for pool %V", &rados_loc_conf->pool);
+        handle->striper = NULL;
+        return NGX_ERROR;
     }
+#endif
 
     return NGX_OK;
 }
\ No newline at end of file
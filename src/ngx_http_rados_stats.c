@@ -0,0 +1,339 @@
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include "ngx_http_rados_stats.h"
+
+/* upper bounds of the histogram buckets in milliseconds, +Inf follows */
+static ngx_msec_t ngx_http_rados_stats_bounds[] = {
+    1, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+
+#define NGX_HTTP_RADOS_STATS_BUCKETS                                         \
+    (sizeof(ngx_http_rados_stats_bounds) / sizeof(ngx_msec_t) + 1)
+
+/* longest sample line besides the pool name */
+#define NGX_HTTP_RADOS_STATS_LINE  128
+
+typedef struct {
+    ngx_atomic_t sum; /* milliseconds */
+    ngx_atomic_t buckets[NGX_HTTP_RADOS_STATS_BUCKETS]; /* not cumulative */
+} ngx_http_rados_stats_histogram_t;
+
+/* only the worker in slot ever writes to a record */
+typedef struct {
+    ngx_queue_t queue;
+    ngx_int_t slot;
+    ngx_atomic_t counters[NGX_HTTP_RADOS_STATS_COUNTERS];
+    ngx_http_rados_stats_histogram_t histograms[NGX_HTTP_RADOS_STATS_HISTOGRAMS];
+    u_short len;
+    u_char data[1]; /* pool */
+} ngx_http_rados_stats_record_t;
+
+typedef struct {
+    ngx_queue_t records;
+} ngx_http_rados_stats_sh_t;
+
+typedef struct {
+    ngx_http_rados_stats_sh_t *sh;
+    ngx_slab_pool_t *shpool;
+} ngx_http_rados_stats_t;
+
+typedef struct {
+    char *name;
+    char *help;
+    unsigned seconds:1; /* kept in milliseconds */
+} ngx_http_rados_stats_metric_t;
+
+static ngx_http_rados_stats_metric_t ngx_http_rados_stats_counters[] = {
+    { "nginx_rados_requests_total", "Requests served from the pool.", 0 },
+    { "nginx_rados_sent_bytes_total", "Body bytes handed to the client.", 0 },
+    { "nginx_rados_reads_total", "Body reads completed.", 0 },
+    { "nginx_rados_read_bytes_total", "Body bytes read.", 0 },
+    { "nginx_rados_throttle_seconds_total", "Time responses were held back by rate limits.", 1 },
+    { "nginx_rados_queue_seconds_total", "Time requests waited for rados_max_inflight.", 1 }
+};
+
+static ngx_http_rados_stats_metric_t ngx_http_rados_stats_histograms[] = {
+    { "nginx_rados_stat_seconds", "Time to the object's metadata.", 1 },
+    { "nginx_rados_first_byte_seconds", "Time to the first body bytes.", 1 },
+    { "nginx_rados_read_seconds", "Latency of body reads.", 1 }
+};
+
+
+static ngx_int_t
+ngx_http_rados_stats_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_rados_stats_t *ostats = data;
+    ngx_http_rados_stats_t *stats;
+    size_t len;
+
+    stats = shm_zone->data;
+
+    if (ostats) {
+        stats->sh = ostats->sh;
+        stats->shpool = ostats->shpool;
+        return NGX_OK;
+    }
+
+    stats->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        stats->sh = stats->shpool->data;
+        return NGX_OK;
+    }
+
+    stats->sh = ngx_slab_alloc(stats->shpool, sizeof(ngx_http_rados_stats_sh_t));
+    if (stats->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    stats->shpool->data = stats->sh;
+
+    ngx_queue_init(&stats->sh->records);
+
+    len = sizeof(" in rados stats zone \"\"") + shm_zone->shm.name.len;
+
+    stats->shpool->log_ctx = ngx_slab_alloc(stats->shpool, len);
+    if (stats->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(stats->shpool->log_ctx, " in rados stats zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+static ngx_uint_t ngx_http_rados_stats_tag;
+
+
+ngx_shm_zone_t *
+ngx_http_rados_stats_add(ngx_conf_t *cf, ngx_str_t *name, size_t size)
+{
+    ngx_shm_zone_t *shm_zone;
+    ngx_http_rados_stats_t *stats;
+
+    shm_zone = ngx_shared_memory_add(cf, name, size, &ngx_http_rados_stats_tag);
+    if (shm_zone == NULL) {
+        return NULL;
+    }
+
+    if (shm_zone->data == NULL) {
+        stats = ngx_pcalloc(cf->pool, sizeof(ngx_http_rados_stats_t));
+        if (stats == NULL) {
+            return NULL;
+        }
+
+        shm_zone->init = ngx_http_rados_stats_init_zone;
+        shm_zone->data = stats;
+    }
+
+    return shm_zone;
+}
+
+
+void *
+ngx_http_rados_stats_record(ngx_shm_zone_t *zone, ngx_str_t *pool)
+{
+    ngx_queue_t *q;
+    ngx_http_rados_stats_t *stats = zone->data;
+    ngx_http_rados_stats_record_t *rec;
+
+    ngx_shmtx_lock(&stats->shpool->mutex);
+
+    /* a worker taking over the slot of one that died keeps counting on */
+    for (q = ngx_queue_head(&stats->sh->records);
+         q != ngx_queue_sentinel(&stats->sh->records);
+         q = ngx_queue_next(q))
+    {
+        rec = ngx_queue_data(q, ngx_http_rados_stats_record_t, queue);
+
+        if (rec->slot == ngx_process_slot
+            && ngx_memn2cmp(pool->data, rec->data, pool->len, (size_t) rec->len) == 0)
+        {
+            goto done;
+        }
+    }
+
+    rec = ngx_slab_calloc_locked(stats->shpool,
+                                 offsetof(ngx_http_rados_stats_record_t, data) + pool->len);
+    if (rec == NULL) {
+        goto done;
+    }
+
+    rec->slot = ngx_process_slot;
+    rec->len = (u_short) pool->len;
+    ngx_memcpy(rec->data, pool->data, pool->len);
+
+    ngx_queue_insert_tail(&stats->sh->records, &rec->queue);
+
+done:
+
+    ngx_shmtx_unlock(&stats->shpool->mutex);
+
+    return rec;
+}
+
+
+void
+ngx_http_rados_stats_count(void *record, ngx_uint_t counter, ngx_atomic_uint_t n)
+{
+    ngx_http_rados_stats_record_t *rec = record;
+
+    (void) ngx_atomic_fetch_add(&rec->counters[counter], n);
+}
+
+
+void
+ngx_http_rados_stats_time(void *record, ngx_uint_t histogram, ngx_msec_t ms)
+{
+    ngx_http_rados_stats_record_t *rec = record;
+    ngx_http_rados_stats_histogram_t *h = &rec->histograms[histogram];
+    ngx_uint_t i;
+
+    for (i = 0; i < NGX_HTTP_RADOS_STATS_BUCKETS - 1; i++) {
+        if (ms <= ngx_http_rados_stats_bounds[i]) {
+            break;
+        }
+    }
+
+    (void) ngx_atomic_fetch_add(&h->buckets[i], 1);
+    (void) ngx_atomic_fetch_add(&h->sum, ms);
+}
+
+
+static u_char *
+ngx_http_rados_stats_labels(u_char *p, ngx_http_rados_stats_record_t *rec)
+{
+    u_char *s, *last;
+
+    p = ngx_cpymem(p, "{pool=\"", sizeof("{pool=\"") - 1);
+
+    /* pool names are not expected to need escaping, the odd ones are mangled */
+    last = rec->data + rec->len;
+    for (s = rec->data; s < last; s++) {
+        *p++ = (*s == '"' || *s == '\\' || *s < 0x20) ? '_' : *s;
+    }
+
+    return ngx_sprintf(p, "\",worker=\"%i\"", rec->slot);
+}
+
+
+static u_char *
+ngx_http_rados_stats_value(u_char *p, ngx_atomic_uint_t value, ngx_uint_t seconds)
+{
+    if (seconds) {
+        return ngx_sprintf(p, " %uA.%03uA\n", value / 1000, value % 1000);
+    }
+
+    return ngx_sprintf(p, " %uA\n", value);
+}
+
+
+ngx_buf_t *
+ngx_http_rados_stats_render(ngx_shm_zone_t *zone, ngx_pool_t *pool)
+{
+    ngx_queue_t *q;
+    ngx_http_rados_stats_t *stats = zone->data;
+    ngx_http_rados_stats_record_t *rec;
+    ngx_http_rados_stats_metric_t *m;
+    ngx_http_rados_stats_histogram_t *h;
+    ngx_atomic_uint_t cumulative;
+    ngx_uint_t i, j, lines;
+    size_t size;
+    ngx_buf_t *b;
+    u_char *p;
+
+    lines = NGX_HTTP_RADOS_STATS_COUNTERS
+            + NGX_HTTP_RADOS_STATS_HISTOGRAMS * (NGX_HTTP_RADOS_STATS_BUCKETS + 2);
+
+    ngx_shmtx_lock(&stats->shpool->mutex);
+
+    size = (NGX_HTTP_RADOS_STATS_COUNTERS + NGX_HTTP_RADOS_STATS_HISTOGRAMS) * 2
+           * NGX_HTTP_RADOS_STATS_LINE;
+
+    for (q = ngx_queue_head(&stats->sh->records);
+         q != ngx_queue_sentinel(&stats->sh->records);
+         q = ngx_queue_next(q))
+    {
+        rec = ngx_queue_data(q, ngx_http_rados_stats_record_t, queue);
+        size += lines * (NGX_HTTP_RADOS_STATS_LINE + rec->len);
+    }
+
+    b = ngx_create_temp_buf(pool, size);
+    if (b == NULL) {
+        ngx_shmtx_unlock(&stats->shpool->mutex);
+        return NULL;
+    }
+
+    p = b->last;
+
+    for (i = 0; i < NGX_HTTP_RADOS_STATS_COUNTERS; i++) {
+        m = &ngx_http_rados_stats_counters[i];
+
+        p = ngx_sprintf(p, "# HELP %s %s\n# TYPE %s counter\n", m->name, m->help, m->name);
+
+        for (q = ngx_queue_head(&stats->sh->records);
+             q != ngx_queue_sentinel(&stats->sh->records);
+             q = ngx_queue_next(q))
+        {
+            rec = ngx_queue_data(q, ngx_http_rados_stats_record_t, queue);
+
+            p = ngx_sprintf(p, "%s", m->name);
+            p = ngx_http_rados_stats_labels(p, rec);
+            *p++ = '}';
+            p = ngx_http_rados_stats_value(p, rec->counters[i], m->seconds);
+        }
+    }
+
+    for (i = 0; i < NGX_HTTP_RADOS_STATS_HISTOGRAMS; i++) {
+        m = &ngx_http_rados_stats_histograms[i];
+
+        p = ngx_sprintf(p, "# HELP %s %s\n# TYPE %s histogram\n", m->name, m->help, m->name);
+
+        for (q = ngx_queue_head(&stats->sh->records);
+             q != ngx_queue_sentinel(&stats->sh->records);
+             q = ngx_queue_next(q))
+        {
+            rec = ngx_queue_data(q, ngx_http_rados_stats_record_t, queue);
+            h = &rec->histograms[i];
+
+            cumulative = 0;
+
+            for (j = 0; j < NGX_HTTP_RADOS_STATS_BUCKETS; j++) {
+                cumulative += h->buckets[j];
+
+                p = ngx_sprintf(p, "%s_bucket", m->name);
+                p = ngx_http_rados_stats_labels(p, rec);
+
+                if (j < NGX_HTTP_RADOS_STATS_BUCKETS - 1) {
+                    p = ngx_sprintf(p, ",le=\"%M.%03M\"}",
+                                    ngx_http_rados_stats_bounds[j] / 1000,
+                                    ngx_http_rados_stats_bounds[j] % 1000);
+
+                } else {
+                    p = ngx_cpymem(p, ",le=\"+Inf\"}", sizeof(",le=\"+Inf\"}") - 1);
+                }
+
+                p = ngx_http_rados_stats_value(p, cumulative, 0);
+            }
+
+            p = ngx_sprintf(p, "%s_sum", m->name);
+            p = ngx_http_rados_stats_labels(p, rec);
+            *p++ = '}';
+            p = ngx_http_rados_stats_value(p, h->sum, 1);
+
+            p = ngx_sprintf(p, "%s_count", m->name);
+            p = ngx_http_rados_stats_labels(p, rec);
+            *p++ = '}';
+            p = ngx_http_rados_stats_value(p, cumulative, 0);
+        }
+    }
+
+    ngx_shmtx_unlock(&stats->shpool->mutex);
+
+    b->last = p;
+
+    return b;
+}
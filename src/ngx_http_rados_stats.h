@@ -0,0 +1,57 @@
+#ifndef H_NGX_HTTP_RADOS_STATS
+#define H_NGX_HTTP_RADOS_STATS
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+/**
+* Counters kept per pool and worker
+*/
+enum {
+    NGX_HTTP_RADOS_STATS_REQUESTS = 0,
+    NGX_HTTP_RADOS_STATS_BYTES_SENT,
+    NGX_HTTP_RADOS_STATS_READS,
+    NGX_HTTP_RADOS_STATS_READ_BYTES,
+    NGX_HTTP_RADOS_STATS_THROTTLE_MS,
+    NGX_HTTP_RADOS_STATS_QUEUE_MS,
+    NGX_HTTP_RADOS_STATS_COUNTERS
+};
+
+/**
+* Latency histograms kept per pool and worker
+*/
+enum {
+    NGX_HTTP_RADOS_STATS_STAT = 0,
+    NGX_HTTP_RADOS_STATS_FIRST_BYTE,
+    NGX_HTTP_RADOS_STATS_READ,
+    NGX_HTTP_RADOS_STATS_HISTOGRAMS
+};
+
+/**
+* Declares (or references, when size is 0) a zone collecting counters and
+* latency histograms of all workers
+*/
+ngx_shm_zone_t *ngx_http_rados_stats_add(ngx_conf_t *cf, ngx_str_t *name, size_t size);
+
+/**
+* Finds or creates the record of a pool for the calling worker, NULL when the
+* zone is full. Records are never freed, workers keep the pointer
+*/
+void *ngx_http_rados_stats_record(ngx_shm_zone_t *zone, ngx_str_t *pool);
+
+/**
+* Adds n to a counter of a record
+*/
+void ngx_http_rados_stats_count(void *record, ngx_uint_t counter, ngx_atomic_uint_t n);
+
+/**
+* Accounts one latency of ms milliseconds in a histogram of a record
+*/
+void ngx_http_rados_stats_time(void *record, ngx_uint_t histogram, ngx_msec_t ms);
+
+/**
+* Renders all records of the zone in the Prometheus text format
+*/
+ngx_buf_t *ngx_http_rados_stats_render(ngx_shm_zone_t *zone, ngx_pool_t *pool);
+
+#endif
@@ -1,171 +1,142 @@
 #include <ngx_http.h>
+#include "ngx_http_rados_util.h"
+
+/*
+* Parses "bytes=" ranges (RFC 7233) into half-open intervals, the way the
+* range filter of nginx does: suffix and open-ended ranges are resolved
+* against the object size, NGX_DECLINED means the full body should be sent.
+*/
+ngx_int_t http_parse_range(ngx_http_request_t *r, ngx_str_t *range_str, off_t content_length,
+    ngx_uint_t max_ranges, ngx_array_t *ranges)
+{
+    u_char *p;
+    off_t start, end, size, cutoff, cutlim;
+    ngx_uint_t suffix;
+    ngx_http_rados_range_t *range;
 
-static char h_digit(char hex) {
-    return (hex >= '0' && hex <= '9') ? hex - '0': ngx_tolower(hex)-'a'+10;
-}
-
-static int htoi(char* h) {
-    char ok[] = "0123456789AaBbCcDdEeFf";
-
-    if (ngx_strchr(ok, h[0]) == NULL || ngx_strchr(ok,h[1]) == NULL) { return -1; }
-    return h_digit(h[0])*16 + h_digit(h[1]);
-}
-
-static int url_decode(char * filename) {
-    char * read = filename;
-    char * write = filename;
-    char hex[3];
-    int c;
-
-    hex[2] = '\0';
-    while (*read != '\0'){
-        if (*read == '%') {
-            hex[0] = *(++read);
-            if (hex[0] == '\0') return 0;
-            hex[1] = *(++read);
-            if (hex[1] == '\0') return 0;
-            c = htoi(hex);
-            if (c == -1) return 0;
-            *write = (char)c;
-        }
-        else *write = *read;
-        read++;
-        write++;
+    if (range_str->len < 7
+        || ngx_strncasecmp(range_str->data, (u_char *) "bytes=", 6) != 0)
+    {
+        return NGX_DECLINED;
     }
-    *write = '\0';
-    return 1;
-}
 
-void http_parse_range(ngx_http_request_t* r, ngx_str_t* range_str, uint64_t* range_start, uint64_t* range_end, size_t content_length) {
-    u_char *p, *last;
-    off_t start, end;
-    ngx_uint_t bad;
-    enum {
-        sw_start = 0,
-        sw_first_byte_pos,
-        sw_first_byte_pos_n,
-        sw_last_byte_pos,
-        sw_last_byte_pos_n,
-        sw_done
-    } state = 0;
-
-    p = (u_char *) ngx_strnstr(range_str->data, "bytes=", range_str->len);
-
-    if (p == NULL) {
-        return;
-    }
+    /* header values are null terminated */
+    p = range_str->data + 6;
+    size = 0;
 
-    p += sizeof("bytes=") - 1;
-    last = range_str->data + range_str->len;
+    cutoff = NGX_MAX_OFF_T_VALUE / 10;
+    cutlim = NGX_MAX_OFF_T_VALUE % 10;
 
-    /*
-     * bytes= contain ranges compatible with RFC 2616, "14.35.1 Byte Ranges",
-     * but no whitespaces permitted
-     */
+    for ( ;; ) {
+        start = 0;
+        end = 0;
+        suffix = 0;
 
-    bad = 0;
-    start = 0;
-    end = 0;
+        while (*p == ' ') { p++; }
 
-    while (p < last) {
+        if (*p != '-') {
+            if (*p < '0' || *p > '9') {
+                return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+            }
 
-        switch (state) {
+            while (*p >= '0' && *p <= '9') {
+                if (start >= cutoff && (start > cutoff || *p - '0' > cutlim)) {
+                    return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+                }
 
-        case sw_start:
-        case sw_first_byte_pos:
-            if (*p == '-') {
-                p++;
-                state = sw_last_byte_pos;
-                break;
+                start = start * 10 + (*p++ - '0');
             }
-            start = 0;
-            state = sw_first_byte_pos_n;
 
-            /* fall through */
+            while (*p == ' ') { p++; }
 
-        case sw_first_byte_pos_n:
-            if (*p == '-') {
-                p++;
-                state = sw_last_byte_pos;
-                break;
+            if (*p++ != '-') {
+                return NGX_HTTP_RANGE_NOT_SATISFIABLE;
             }
-            if (*p < '0' || *p > '9') {
-                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                               "bytes header filter: unexpected char '%c'"
-                               " (expected first-byte-pos)", *p);
-                bad = 1;
-                break;
-            }
-            start = start * 10 + *p - '0';
-            p++;
-            break;
 
-        case sw_last_byte_pos:
-            if (*p == ',' || *p == '&' || *p == ';') {
+            while (*p == ' ') { p++; }
+
+            if (*p == ',' || *p == '\0') {
                 /* no last byte pos, assume end of file */
-                end = content_length - 1;
-                state = sw_done;
-                break;
+                end = content_length;
+                goto found;
             }
-            end = 0;
-            state = sw_last_byte_pos_n;
 
-            /* fall though */
+        } else {
+            suffix = 1;
+            p++;
+        }
 
-        case sw_last_byte_pos_n:
-            if (*p == ',' || *p == '&' || *p == ';') {
-                state = sw_done;
-                break;
-            }
-            if (*p < '0' || *p > '9') {
-                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                               "bytes header filter: unexpected char '%c'"
-                               " (expected last-byte-pos)", *p);
-                bad = 1;
-                break;
+        if (*p < '0' || *p > '9') {
+            return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+        }
+
+        while (*p >= '0' && *p <= '9') {
+            if (end >= cutoff && (end > cutoff || *p - '0' > cutlim)) {
+                return NGX_HTTP_RANGE_NOT_SATISFIABLE;
             }
-            end = end * 10 + *p - '0';
-            p++;
-            break;
 
-        case sw_done:
-            *range_start = start;
-            *range_end = end;
+            end = end * 10 + (*p++ - '0');
+        }
 
-            break;
+        while (*p == ' ') { p++; }
+
+        if (*p != ',' && *p != '\0') {
+            return NGX_HTTP_RANGE_NOT_SATISFIABLE;
         }
 
-        if (bad) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "bytes header filter: invalid range specification");
-            return;
+        if (suffix) {
+            start = (end < content_length) ? content_length - end : 0;
+            end = content_length - 1;
         }
-    }
 
-    switch (state) {
+        if (end >= content_length) {
+            end = content_length;
 
-    case sw_last_byte_pos:
-        end = content_length - 1;
+        } else {
+            end++;
+        }
+
+    found:
+
+        if (start < end) {
+            range = ngx_array_push(ranges);
+            if (range == NULL) {
+                return NGX_ERROR;
+            }
+
+            range->start = start;
+            range->end = end;
+            ngx_str_null(&range->header);
+
+            if (size > NGX_MAX_OFF_T_VALUE - (end - start)) {
+                return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+            }
 
-    case sw_last_byte_pos_n:
-        if (start > end) {
-            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                           "bytes header filter: invalid range specification");
-            *range_start = start;
-            *range_end = 0;
-            return;
+            size += end - start;
+
+            if (max_ranges-- == 0) {
+                return NGX_DECLINED;
+            }
+
+        } else if (start == 0) {
+            return NGX_DECLINED;
         }
 
-        *range_start = start;
-        *range_end = end;
-        break;
+        if (*p++ != ',') {
+            break;
+        }
+    }
 
-    default:
-        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "bytes header filter: invalid range specification");
-        return;
+    if (ranges->nelts == 0) {
+        return NGX_HTTP_RANGE_NOT_SATISFIABLE;
+    }
 
+    /* overlapping ranges asking for more than the object itself */
+    if (size > content_length) {
+        return NGX_DECLINED;
     }
+
+    return NGX_OK;
 }
 
 
@@ -199,44 +170,181 @@ ngx_uint_t ngx_http_test_if_modified(ngx_http_request_t *r)
     return 0;
 }
 
-ngx_uint_t nginx_http_get_rados_key(ngx_http_request_t *request, char **value)
+
+ngx_uint_t ngx_http_test_if_match(ngx_http_request_t *r, ngx_table_elt_t *header,
+    ngx_uint_t weak)
+{
+    u_char     *start, *end, ch;
+    ngx_str_t   etag, *list;
+
+    list = &header->value;
+
+    if (list->len == 1 && list->data[0] == '*') {
+        return 1;
+    }
+
+    if (r->headers_out.etag == NULL) {
+        return 0;
+    }
+
+    etag = r->headers_out.etag->value;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http im:\"%V\" etag:%V", list, &etag);
+
+    if (weak
+        && etag.len > 2
+        && etag.data[0] == 'W'
+        && etag.data[1] == '/')
+    {
+        etag.len -= 2;
+        etag.data += 2;
+    }
+
+    start = list->data;
+    end = list->data + list->len;
+
+    while (start < end) {
+
+        if (weak
+            && end - start > 2
+            && start[0] == 'W'
+            && start[1] == '/')
+        {
+            start += 2;
+        }
+
+        if (etag.len > (size_t) (end - start)) {
+            return 0;
+        }
+
+        if (ngx_strncmp(start, etag.data, etag.len) != 0) {
+            goto skip;
+        }
+
+        start += etag.len;
+
+        while (start < end) {
+            ch = *start;
+
+            if (ch == ' ' || ch == '\t') {
+                start++;
+                continue;
+            }
+
+            break;
+        }
+
+        if (start == end || *start == ',') {
+            return 1;
+        }
+
+    skip:
+
+        while (start < end && *start != ',') { start++; }
+        while (start < end) {
+            ch = *start;
+
+            if (ch == ' ' || ch == '\t' || ch == ',') {
+                start++;
+                continue;
+            }
+
+            break;
+        }
+    }
+
+    return 0;
+}
+
+
+ngx_uint_t ngx_http_test_if_range(ngx_http_request_t *r)
 {
+    ngx_str_t  *if_range, *etag;
+    time_t      if_range_time;
+
+    if_range = &r->headers_in.if_range->value;
+
+    if (if_range->len >= 2 && if_range->data[if_range->len - 1] == '"') {
+
+        if (r->headers_out.etag == NULL) {
+            return 0;
+        }
+
+        etag = &r->headers_out.etag->value;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http ir:%V etag:%V", if_range, etag);
+
+        /* strong comparison, a weak validator never matches */
+        return if_range->data[0] == '"'
+               && if_range->len == etag->len
+               && ngx_strncmp(if_range->data, etag->data, etag->len) == 0;
+    }
+
+    if_range_time = ngx_http_parse_time(if_range->data, if_range->len);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http ir:%T lm:%T", if_range_time, r->headers_out.last_modified_time);
+
+    return if_range_time != NGX_ERROR
+           && if_range_time == r->headers_out.last_modified_time;
+}
 
-    ngx_str_t location_name;
-    ngx_str_t full_uri;
+ngx_int_t nginx_http_get_rados_key(ngx_http_request_t *request, ngx_http_complex_value_t *key,
+    ngx_uint_t decode, char **value)
+{
     ngx_http_core_loc_conf_t *core_conf;
-    core_conf = ngx_http_get_module_loc_conf(request, ngx_http_core_module);
+    ngx_str_t src;
+    u_char *dst, *p, *s;
 
-    location_name = core_conf->name;
-    full_uri = request->uri;
+    if (key != NULL) {
+        if (ngx_http_complex_value(request, key, &src) != NGX_OK) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
 
-    if(full_uri.len - location_name.len == 0) {
-        return NGX_HTTP_NOT_FOUND;
-     }
+    } else {
+        core_conf = ngx_http_get_module_loc_conf(request, ngx_http_core_module);
 
-    if (full_uri.len < location_name.len) {
-        ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
-                      "Invalid location name or uri.");
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        if (request->uri.len < core_conf->name.len) {
+            ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                          "Invalid location name or uri.");
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        src.data = request->uri.data + core_conf->name.len;
+        src.len = request->uri.len - core_conf->name.len;
     }
 
-    *value = ngx_pcalloc(request->pool, sizeof(char) * (full_uri.len - location_name.len + 1));
-    if (*value == NULL) {
-        ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
-                      "Failed to allocate memory for value buffer.");
+    if (src.len == 0) {
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    /* decoding never makes the key longer, one byte more holds the NUL */
+    dst = ngx_pnalloc(request->pool, src.len + 1);
+    if (dst == NULL) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    ngx_memcpy(*value, full_uri.data + location_name.len, full_uri.len - location_name.len);
-    value[full_uri.len - location_name.len] = '\0';
+    if (decode) {
+        p = dst;
+        s = src.data;
+        ngx_unescape_uri(&p, &s, src.len, 0);
 
+    } else {
+        p = ngx_cpymem(dst, src.data, src.len);
+    }
 
-    if (!url_decode(*value)) {
-        ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
-            "Malformed request.");
+    /* librados takes the key as a C string, a %00 would cut it short */
+    if (p == dst || ngx_strlchr(dst, p, '\0') != NULL) {
+        ngx_log_error(NGX_LOG_INFO, request->connection->log, 0,
+                      "Malformed request key \"%V\"", &src);
         return NGX_HTTP_BAD_REQUEST;
     }
 
+    *p = '\0';
+    *value = (char *) dst;
+
     return NGX_OK;
 }
 
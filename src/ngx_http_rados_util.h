@@ -4,20 +4,49 @@
 #include <ngx_http.h>
 
 /**
-* Range request header parser
+* One requested byte range
 */
-void http_parse_range(ngx_http_request_t* r, ngx_str_t* range_str, uint64_t* range_start, uint64_t* range_end, size_t content_length);
+typedef struct {
+    off_t start;
+    off_t end;        /* one past the last byte */
+    ngx_str_t header; /* multipart/byteranges part header, empty for a single range */
+} ngx_http_rados_range_t;
+
+/**
+* Range request header parser, fills ranges with ngx_http_rados_range_t.
+* Returns NGX_OK, NGX_DECLINED (send the whole body),
+* NGX_HTTP_RANGE_NOT_SATISFIABLE or NGX_ERROR
+*/
+ngx_int_t http_parse_range(ngx_http_request_t *r, ngx_str_t *range_str, off_t content_length,
+    ngx_uint_t max_ranges, ngx_array_t *ranges);
 
 /**
 * Tests If-Mofidied-Since against provided timestamp
 */
 ngx_uint_t ngx_http_test_if_modified(ngx_http_request_t *r);
 
+/**
+* Tests an If-Match (strong) or If-None-Match (weak) list against the ETag
+* of the response
+*/
+ngx_uint_t ngx_http_test_if_match(ngx_http_request_t *r, ngx_table_elt_t *header,
+    ngx_uint_t weak);
+
+/**
+* Tells whether If-Range still names the response's ETag or Last-Modified,
+* so the requested ranges may be sent
+*/
+ngx_uint_t ngx_http_test_if_range(ngx_http_request_t *r);
+
 
 /*
-* Retrieves request key
+* Retrieves the request's object key, NUL terminated in the request pool: key
+* when set, percent-decoded if decode is set, or else the URI after the
+* location prefix, which nginx has decoded already. Returns NGX_OK or an HTTP
+* status
 */
-ngx_uint_t nginx_http_get_rados_key(ngx_http_request_t *request, char **value);
+ngx_int_t nginx_http_get_rados_key(ngx_http_request_t *request, ngx_http_complex_value_t *key,
+    ngx_uint_t decode, char **value);
 
 //void mangle_filename_by_request_arg(ngx_http_request_t *request, char *my_variable_name);
 